@@ -1,6 +1,18 @@
 ﻿#include "SavingClara.h"
 
 /* Gameplay Scene*/
+/// the settings for the trail behind a shot
+static SEmitterSetting ShotTrail(float rate)
+{
+	SEmitterSetting trail;
+	trail.Rate = rate;
+	trail.Direction = D3DXVECTOR3(0,0,-1);	// straight back from the shot
+	trail.LocalDirection = true;
+	trail.Angle = D2R(20);
+	trail.MinSpeed = trail.MaxSpeed = SHOT_VEL * 0.2f;
+	return trail;
+}
+
 void GameScene::Enter()
 {
 	mpJoy=GetEngine()->FindComponent<CJoystickComponent>();
@@ -21,6 +33,20 @@ void GameScene::Enter()
 	// terrain
 	mpTerrain=new CTerrain(GetDevice(),"media/Terrains/heightmap.bmp",5,0.5,"media/Terrains/trees.bmp");
 	mpTerrain->LoadTexture("media/Terrains/terrain_texture.png");
+	mTrees.Clear();
+	for(int i = 0; i<mpTerrain->treesPosition.size(); i++)
+	{
+		D3DXVECTOR2 pos = mpTerrain->treesPosition[i];
+		mTrees.Add(D3DXVECTOR3(pos.x, mpTerrain->GetHeight(pos.x, pos.y), pos.y), D3DXVECTOR3(0,0,0), 8);
+	}
+	mTrees.Build();
+	mHuts.Clear();
+	for(int i = 0; i<mpTerrain->hutsPosition.size(); i++)
+	{
+		D3DXVECTOR2 pos = mpTerrain->hutsPosition[i];
+		mHuts.Add(D3DXVECTOR3(pos.x, mpTerrain->GetHeight(pos.x, pos.y), pos.y), D3DXVECTOR3(0,0,0), 2);
+	}
+	mHuts.Build();
 
 	// models
 	mpMarcusMesh=new CXMesh(GetDevice(),"media/Models/marcus.X");
@@ -38,13 +64,21 @@ void GameScene::Enter()
 	mpHutMesh = new CXMesh(GetDevice(), "media/Models/hut.X");
 	mpJinMesh = new CXMesh(GetDevice(), "media/Models/jin.X");
 	mMarcus.node.Init(mpMarcusMesh);
-	// the particles
-	mpFire=new CParticleSystem();
-	mpIce = new CParticleSystem();
-	mpWandIce = new CParticleSystem();
-	mpCurrSkillParticles = new CParticleSystem();
-	mpIceCollide = new CExplosion();
-	mpSnow = new CPrecipitation();
+	// the particles (drawn in this order)
+	mpRenderQueue = new CRenderQueue(GetDevice());
+	mpParticles = new CParticleManager();
+	mAI.SetJobPool(&mpParticles->GetJobPool());	// (the enemies are updated on the particles' threads)
+	mAI.Seed(1);
+	mAI.SetMaxUpdates(MAX_AI_UPDATES);	// (seeded, so the budget is a count rather than a time)
+	mpFire = mpParticles->Add(new CParticleSystem());
+	mpIce = mpParticles->Add(new CParticleSystem());
+	mpIceCollide = mpParticles->Add(new CExplosion());
+	mpSnow = mpParticles->Add(new CPrecipitation());
+	mpWandIce = mpParticles->Add(new CParticleSystem());
+	mpCurrSkillParticles = mpParticles->Add(new CParticleSystem());
+	// keep big fights under control: the explosions go first (the snow is left alone, see CParticleSystem::IsBudgeted)
+	mpParticles->SetCamera(&mCamera);
+	mpParticles->SetBudget(6000, 0.004f);
 
 	// make sure its on the ground
 	//mMarcus.node.SetPos(-100,mpTerrain->GetPointOnGround(D3DXVECTOR3(-165,0,125)).y,125);
@@ -54,13 +88,17 @@ void GameScene::Enter()
 	mMarcus.node.SetHpr(D2R(-60),0,0);
 	mMarcus.state = mMarcus.GROUND;
 	mMarcus.node.mLife = 100;
-	// wand
-	mWand.Init(mpWandMesh, mMarcus.node.OffsetPos(D3DXVECTOR3(0.07f,-0.1f,0.1f)),D3DXVECTOR3(D2R(-10),D2R(20),0));
-	// hand
-	mHand.Init(mpHandMesh, mMarcus.node.OffsetPos(D3DXVECTOR3(-0.07f, 0.2f, 0.5f)));
-	// current skill
-	mCurrSkill.Init(mpMagicballMesh, mMarcus.node.GetPos());
+	// wand, hand & current skill are attached to the player
+	mWand.Init(mpWandMesh);
+	mWand.SetParent(&mMarcus.node, D3DXVECTOR3(0.07f,-0.1f,0.1f));
+	mHand.Init(mpHandMesh);
+	mHand.SetParent(&mMarcus.node, D3DXVECTOR3(-0.07f, -0.1f, 0.1f));
+	mCurrSkill.Init(mpMagicballMesh);
+	mCurrSkill.SetParent(&mMarcus.node, D3DXVECTOR3(-0.09f,-0.05f,0.2f));
 	mCurrSkill.mScale = 0.02f;
+	mAttachments.Add(&mWand);
+	mAttachments.Add(&mHand);
+	mAttachments.Add(&mCurrSkill);
 
 	// npcs
 	mMark.Init(mpMarkMesh, D3DXVECTOR3(190,0,-190));
@@ -78,11 +116,8 @@ void GameScene::Enter()
 	{
 		for(float z=-50;z<50;z+= 10)
 		{
-			Enemy* enemy = new Enemy();
 			D3DXVECTOR3 pos(x, mpTerrain->GetHeight(x,z), z);
-			enemy->Init(mpEnemySMesh, pos);
-			enemy->mLife = 100;
-			mEnemies.push_back(enemy);
+			mEnemies.Add(mpEnemySMesh, pos, 100);
 		}
 	}
 
@@ -130,27 +165,26 @@ void GameScene::Update(float dt)
 	// first person view
 	mCamera.Match(mMarcus.node);
 
-	mCurrSkill.SetPos(mMarcus.node.OffsetPos(D3DXVECTOR3(-0.09f,-0.05f,0.2f)));
-	mCurrSkill.Yaw(D2R(45*dt));
-
-	mWand.SetPos(mMarcus.node.OffsetPos(D3DXVECTOR3(0.07f,-0.1f,0.1f)));
-	mWand.SetHpr(mCamera.GetHpr());
-
-	mHand.SetPos(mMarcus.node.OffsetPos(D3DXVECTOR3(-0.07f, -0.1f, 0.1f)));
-	mHand.SetHpr(mCamera.GetHpr());
+	// the current skill spins, the wand & hand just follow the player
+	mCurrSkill.TurnLocal(D3DXVECTOR3(D2R(45*dt),0,0));
+	mAttachments.Update();
 
 	//check collisions
 	CheckCollisions(oldPos);
 
 	// move shots
-	UpdateMeshNodes(mMagicball, dt);
-	UpdateMeshNodes(mIcicles, dt);
-	UpdateMeshNodes(mFireball, dt);
-	for(int i=(int)mEnemies.size()-1;i>=0;i--)
+	mMagicball.Update(dt);
+	mIcicles.Update(dt);
+	mFireball.Update(dt);
+	UpdateShotSounds();
+	mAI.Update(mEnemies,mMarcus.node.GetPos(),dt);
+	if(mAI.GetPlayerDamage() > 0)
+	{
+		mMarcus.node.Damage(mAI.GetPlayerDamage());
+		mMarcus.lastHitTime=0;
+	}
+	for(int i=mEnemies.GetCount()-1;i>=0;i--)
 	{
-		mEnemies[i]->Update(&mMarcus.node,dt);
-		if(mEnemies[i]->Dmg())
-			mMarcus.lastHitTime=0;
 		if (mEnemies[i]->mLife <= 0)
 		{
 			if (activeQuest)
@@ -173,30 +207,24 @@ void GameScene::Update(float dt)
 			mJin.SetDmgMultiplier(0.5f);
 		if(mJin.Shoot())
 		{
-			CShot* shot = new CShot();
-
 			D3DXVECTOR3 dir = mJin.RotateVector(D3DXVECTOR3(0,0,1));
 
-			// setup the magicball
-			shot->Init(mpFireballMesh, mJin.GetPos(), mJin.GetHpr());
-			shot->mPos = mJin.OffsetPos(D3DXVECTOR3(0.2f,0.2f,0.0f));
-			shot->mVel = dir*SHOT_VEL;
-			shot->mScale = 0.3f;
-			shot->mLife = 3000;
+			// setup the fireball
+			ShotHandle shot = mFireball.Add(mpFireballMesh, mJin.OffsetPos(D3DXVECTOR3(0.2f,0.2f,0.0f)),
+									mJin.GetHpr(), dir*SHOT_VEL, 0.3f, 3.0f);
 
 			// play sound
 			pCue = mpSound->Play3DCue("fireball_cast");
 			vec_pCue.push_back(pCue);
-			emitter.Position = shot->GetPos();
-			vec_emitter.push_back(emitter);
+			FollowShot(mFireball, shot);
 
-			mFireball.push_back(shot);
+			mFireball.AddEmitter(mpFire, ShotTrail(100), shot);
 		}
 	}
 	else
 		defeatedJin = true;
 
-	UpdateParticles(dt, mMagicball, mIcicles, mFireball);
+	UpdateParticles(dt);
 
 	// update 3D sound
 	FillListener(mCamera, listener);
@@ -204,10 +232,10 @@ void GameScene::Update(float dt)
 	mpSound->Apply3D(vec_pCue, listener, vec_emitter);
 
 	// delete dead meshes
-	DeleteDeadMeshNodes(mMagicball);
-	DeleteDeadMeshNodes(mIcicles);
-	DeleteDeadMeshNodes(mFireball);
-	DeleteDeadEnemy(mEnemies);
+	mMagicball.RemoveDead();
+	mIcicles.RemoveDead();
+	mFireball.RemoveDead();
+	mEnemies.RemoveDead();
 }
 void GameScene::UpdatePlayer(float dt)
 {
@@ -341,6 +369,15 @@ void GameScene::HandleInput(float dt)
 	if(CGameWindow::KeyPress('B'))
 		mMarcus.node.SetPos(200,mpTerrain->GetPointOnGround(mMarcus.node.GetPos()).y,-190);
 
+	// record the particles, for replaying with CParticlePlayer
+	if(CGameWindow::KeyPress('P'))
+	{
+		if(mpParticles->IsRecording())
+			mpParticles->StopRecording();
+		else
+			mpParticles->StartRecording("particles.rec");
+	}
+
 	// do the movement
 	const float TURN_SPEED=D2R(90);
 	const float SPEED=5.0f;
@@ -348,10 +385,11 @@ void GameScene::HandleInput(float dt)
 	mMarcus.node.MoveGround(move*dt*SPEED);
 
 	// player can only rotate up and down 45 degrees
-	if (mMarcus.node.GetHpr().y <= -D3DXToRadian(45))
-		mMarcus.node.mHpr.y = -D3DXToRadian(45);
-	else if (mMarcus.node.GetHpr().y >= D3DXToRadian(45))
-		mMarcus.node.mHpr.y = D3DXToRadian(45);
+	const D3DXVECTOR3& hpr = mMarcus.node.GetHpr();
+	if (hpr.y <= -D3DXToRadian(45))
+		mMarcus.node.SetHpr(hpr.x, -D3DXToRadian(45), hpr.z);
+	else if (hpr.y >= D3DXToRadian(45))
+		mMarcus.node.SetHpr(hpr.x, D3DXToRadian(45), hpr.z);
 
 	// do the jumping
 	D3DXVECTOR3 rate = D3DXVECTOR3(0,9.81,0);
@@ -407,11 +445,11 @@ void GameScene::ChangeSpell(int spell)
 	switch (spell)
 	{
 	case 1:
-		mCurrSkill.Init(mpMagicballMesh, mMarcus.node.GetPos());
+		mCurrSkill.mpMesh = mpMagicballMesh;	// (its still attached to the player)
 		mCurrSkill.mScale = 0.03f;
 		break;
 	case 2:
-		mCurrSkill.Init(mpIcicleMesh, mMarcus.node.GetPos());
+		mCurrSkill.mpMesh = mpIcicleMesh;
 		mCurrSkill.mScale = 0.02f;
 		break;
 	}
@@ -425,22 +463,16 @@ void GameScene::CastSpell(bool charge)
 	case 1:
 		if (clock()-magicballStartTime > MAGICBALL_COOLDOWN)
 		{
-			CShot* shot = new CShot();
-
 			// setup the magicball
-			shot->Init(mpMagicballMesh, mMarcus.node.GetPos(), mMarcus.node.GetHpr());
-			shot->mPos = mMarcus.node.OffsetPos(D3DXVECTOR3(0.2f,0,2.0f));
-			shot->mVel = dir*SHOT_VEL;
-			shot->mScale = 0.3f;
-			shot->mLife = 3000;
+			ShotHandle shot = mMagicball.Add(mpMagicballMesh, mMarcus.node.OffsetPos(D3DXVECTOR3(0.2f,0,2.0f)),
+									mMarcus.node.GetHpr(), dir*SHOT_VEL, 0.3f, 3.0f);
 
 			// play sound
 			pCue = mpSound->Play3DCue("frost_cast_01");
 			vec_pCue.push_back(pCue);
-			emitter.Position = shot->GetPos();
-			vec_emitter.push_back(emitter);
+			FollowShot(mMagicball, shot);
 
-			mMagicball.push_back(shot);
+			mMagicball.AddEmitter(mpIce, ShotTrail(100), shot);
 			magicballStartTime = clock();
 			MB_COOLDOWN = true;
 			mpCurrSkillParticles->GetSettings().Size = 0.0f;
@@ -456,15 +488,10 @@ void GameScene::CastSpell(bool charge)
 			}
 			else if (icicle_charge > 0)
 			{
-				CShot* shot = new CShot();
-
 				// setup the icicle
-				shot->Init(mpIcicleMesh, mMarcus.node.GetPos(), mMarcus.node.GetHpr());
-				shot->mPos = mMarcus.node.OffsetPos(D3DXVECTOR3(0.2f,0,2.0f));
-				shot->mVel = dir*SHOT_VEL;
-				shot->mScale = 0.3f + (icicle_charge/100.0f);
-				shot->mLife = 2000;
-				mIcicles.push_back(shot);
+				ShotHandle shot = mIcicles.Add(mpIcicleMesh, mMarcus.node.OffsetPos(D3DXVECTOR3(0.2f,0,2.0f)),
+									mMarcus.node.GetHpr(), dir*SHOT_VEL, 0.3f + (icicle_charge/100.0f), 2.0f);
+				mIcicles.AddEmitter(mpIce, ShotTrail(200), shot);
 				icicleDamage = 20+icicle_charge;
 				icicle_charge = 0;
 				icicleStartTime = clock();
@@ -472,8 +499,7 @@ void GameScene::CastSpell(bool charge)
 				// play sound
 				pCue = mpSound->Play3DCue("frost_cast_02");
 				vec_pCue.push_back(pCue);
-				emitter.Position = shot->GetPos();
-				vec_emitter.push_back(emitter);
+				FollowShot(mIcicles, shot);
 				ICE_COOLDOWN = true;
 				mpCurrSkillParticles->GetSettings().Size = 0.0f;
 			}
@@ -481,7 +507,7 @@ void GameScene::CastSpell(bool charge)
 		break;
 	}
 
-	mEnemies[0]->Alerted();
+	mAI.Alert(mMarcus.node.GetPos());	// the enemies nearby hear it
 }
 void GameScene::TalkToNPC()
 {
@@ -501,14 +527,14 @@ void GameScene::TalkToNPC()
 void GameScene::CheckCollisions(D3DXVECTOR3 oldPos)
 {
 	// check collision
-	for(int sh=0;sh<mMagicball.size();sh++)
+	for(int sh=0;sh<mMagicball.GetCount();sh++)
 	{
-		for(int en=0;en<mEnemies.size();en++)
+		for(int en=0;en<mEnemies.GetCount();en++)
 		{
 			// if it occurs, destroy the shot and do 50 damage to the enemy
-			if(CollisionMeshNode(mMagicball[sh], mEnemies[en],1.1f))
+			if(mMagicball.Collides(sh, mEnemies[en],1.1f))
 			{
-				mpIceCollide->Explode(mMagicball[sh]->GetPos(),
+				mpIceCollide->Explode(mMagicball.GetPos(sh),
 					D3DCOLOR_XRGB(0,0,255),
 					D3DCOLOR_XRGB(50,50,255),
 					CParticleSystem::GetRandomFloat(1.5f,2.0f));
@@ -516,18 +542,19 @@ void GameScene::CheckCollisions(D3DXVECTOR3 oldPos)
 				//sound
 				pCue = mpSound->Play3DCue("frost_hit_01");
 				vec_pCue.push_back(pCue);
-				emitter.Position = mMagicball[sh]->GetPos();
+				emitter.Position = mMagicball.GetPos(sh);
 				vec_emitter.push_back(emitter);
 
-				mMagicball[sh]->Destroy();
+				mMagicball.Destroy(sh);
 				mEnemies[en]->Alerted(&mMarcus.node);
 				mEnemies[en]->Damage(randi(20,30));
+				mAI.Wake(mEnemies[en]);	// (so it reacts now, rather than when its next due)
 				break;
 			}
 		}
-		if(mMagicball[sh]->GetPos().y < mpTerrain->GetHeight(mMagicball[sh]->GetPos().x, mMagicball[sh]->GetPos().z))
+		if(mMagicball.GetPos(sh).y < mpTerrain->GetHeight(mMagicball.GetPos(sh).x, mMagicball.GetPos(sh).z))
 		{
-			mpIceCollide->Explode(mMagicball[sh]->GetPos(),
+			mpIceCollide->Explode(mMagicball.GetPos(sh),
 				D3DCOLOR_XRGB(0,0,255),
 				D3DCOLOR_XRGB(50,50,255),
 				CParticleSystem::GetRandomFloat(1.5f,2.0f));
@@ -535,18 +562,18 @@ void GameScene::CheckCollisions(D3DXVECTOR3 oldPos)
 			// sound
 			pCue = mpSound->Play3DCue("frost_hit_01");
 			vec_pCue.push_back(pCue);
-			emitter.Position = mMagicball[sh]->GetPos();
+			emitter.Position = mMagicball.GetPos(sh);
 			vec_emitter.push_back(emitter);
 
-			mMagicball[sh]->Destroy();
+			mMagicball.Destroy(sh);
 			break;
 		}
 		
 		if(mJin.IsAlive())
 		{
-			if(CollisionMeshNode(mMagicball[sh], &mJin,1.5f))
+			if(mMagicball.Collides(sh, &mJin,1.5f))
 			{
-				mpIceCollide->Explode(mMagicball[sh]->GetPos(),
+				mpIceCollide->Explode(mMagicball.GetPos(sh),
 					D3DCOLOR_XRGB(0,0,255),
 					D3DCOLOR_XRGB(50,50,255),
 					CParticleSystem::GetRandomFloat(1.5f,2.0f));
@@ -554,24 +581,24 @@ void GameScene::CheckCollisions(D3DXVECTOR3 oldPos)
 				// sound
 				pCue = mpSound->Play3DCue("frost_hit_01");
 				vec_pCue.push_back(pCue);
-				emitter.Position = mMagicball[sh]->GetPos();
+				emitter.Position = mMagicball.GetPos(sh);
 				vec_emitter.push_back(emitter);
 
 				mJin.Damage(randi(20,30));
-				mMagicball[sh]->Destroy();
+				mMagicball.Destroy(sh);
 				break;
 			}
 		}
 	}
 
-	for(int sh=0;sh<mIcicles.size();sh++)
+	for(int sh=0;sh<mIcicles.GetCount();sh++)
 	{
-		for(int en=0;en<mEnemies.size();en++)
+		for(int en=0;en<mEnemies.GetCount();en++)
 		{
 			// if it occurs, destroy the shot and do 50 damage to the enemy
-			if(CollisionMeshNode(mIcicles[sh], mEnemies[en],1.1f))
+			if(mIcicles.Collides(sh, mEnemies[en],1.1f))
 			{
-				mpIceCollide->Explode(mIcicles[sh]->GetPos(),
+				mpIceCollide->Explode(mIcicles.GetPos(sh),
 					D3DCOLOR_XRGB(0,157,157),
 					D3DCOLOR_XRGB(0,0,0),
 					CParticleSystem::GetRandomFloat(1.5f+(icicleDamage/20.0f),2.0f+(icicleDamage/20.0f)),
@@ -580,18 +607,19 @@ void GameScene::CheckCollisions(D3DXVECTOR3 oldPos)
 				// sound
 				pCue = mpSound->Play3DCue("frost_hit_02");
 				vec_pCue.push_back(pCue);
-				emitter.Position = mIcicles[sh]->GetPos();
+				emitter.Position = mIcicles.GetPos(sh);
 				vec_emitter.push_back(emitter);
 
-				mIcicles[sh]->Destroy();
+				mIcicles.Destroy(sh);
 				mEnemies[en]->Alerted(&mMarcus.node);
 				mEnemies[en]->Damage(icicleDamage);
+				mAI.Wake(mEnemies[en]);	// (so it reacts now, rather than when its next due)
 				break;
 			}
 		}
-		if(mIcicles[sh]->GetPos().y < mpTerrain->GetHeight(mIcicles[sh]->GetPos().x, mIcicles[sh]->GetPos().z))
+		if(mIcicles.GetPos(sh).y < mpTerrain->GetHeight(mIcicles.GetPos(sh).x, mIcicles.GetPos(sh).z))
 		{
-			mpIceCollide->Explode(mIcicles[sh]->GetPos(),
+			mpIceCollide->Explode(mIcicles.GetPos(sh),
 				D3DCOLOR_XRGB(0,157,157),
 				D3DCOLOR_XRGB(0,0,0),
 				CParticleSystem::GetRandomFloat(1.5f,2.0f));
@@ -599,16 +627,16 @@ void GameScene::CheckCollisions(D3DXVECTOR3 oldPos)
 			// sound
 			pCue = mpSound->Play3DCue("frost_hit_02");
 			vec_pCue.push_back(pCue);
-			emitter.Position = mIcicles[sh]->GetPos();
+			emitter.Position = mIcicles.GetPos(sh);
 			vec_emitter.push_back(emitter);
 
-			mIcicles[sh]->Destroy();
+			mIcicles.Destroy(sh);
 			break;
 		}
 
-		else if(CollisionMeshNode(mIcicles[sh], &mJin, 1.5f))
+		else if(mIcicles.Collides(sh, &mJin, 1.5f))
 		{
-			mpIceCollide->Explode(mIcicles[sh]->GetPos(),
+			mpIceCollide->Explode(mIcicles.GetPos(sh),
 				D3DCOLOR_XRGB(0,157,157),
 				D3DCOLOR_XRGB(0,0,0),
 				CParticleSystem::GetRandomFloat(1.5f,2.0f));
@@ -616,10 +644,10 @@ void GameScene::CheckCollisions(D3DXVECTOR3 oldPos)
 			// sound
 			pCue = mpSound->Play3DCue("frost_hit_02");
 			vec_pCue.push_back(pCue);
-			emitter.Position = mIcicles[sh]->GetPos();
+			emitter.Position = mIcicles.GetPos(sh);
 			vec_emitter.push_back(emitter);
 			mJin.Damage(icicleDamage);
-			mIcicles[sh]->Destroy();
+			mIcicles.Destroy(sh);
 			break;
 		}
 	}
@@ -640,13 +668,13 @@ void GameScene::CheckCollisions(D3DXVECTOR3 oldPos)
 			mMarcus.node.SetPos(oldPos);
 	}
 
-	for(int i = mFireball.size()-1;i>=0;i--)
+	for(int i = mFireball.GetCount()-1;i>=0;i--)
 	{
-		if(CollisionMeshNode(mFireball[i], &mMarcus.node, 1.5f))
+		if(mFireball.Collides(i, &mMarcus.node, 1.5f))
 		{
 			mpSound->PlayCue("fireball_hit");
 			mMarcus.node.Damage(mJin.Dmg());
-			mFireball[i]->Destroy();
+			mFireball.Destroy(i);
 			break;
 		}
 	}
@@ -660,56 +688,55 @@ void GameScene::Draw(float dt)
 	// draw terrain
 	mpTerrain->Draw(IDENTITY_MAT,false);
 
-	// draw trees
-	for(int i = 0; i<mpTerrain->treesPosition.size(); i++)
+	// draw trees (all the visible ones in one go)
+	mVisibleTrees.clear();
+	for(int i = 0; i<mTrees.GetCount(); i++)
 	{
-		if(CollisionSphereSphere(D3DXVECTOR3(mpTerrain->treesPosition[i].x,
-			mpTerrain->GetHeight(mpTerrain->treesPosition[i].x, mpTerrain->treesPosition[i].y),
-			mpTerrain->treesPosition[i].y),1.0f,mMarcus.node.GetPos(),100.0f))
+		const D3DXMATRIX& world = mTrees.GetMatrix(i);
+		D3DXVECTOR3 pos(world._41, world._42, world._43);
+		if(CollisionSphereSphere(pos,1.0f,mMarcus.node.GetPos(),100.0f))
 		{
-			if(GetDeltaDirection(mMarcus.node.GetHpr().x , GetDirection(D3DXVECTOR3(mpTerrain->treesPosition[i].x,
-				mpTerrain->GetHeight(mpTerrain->treesPosition[i].x, mpTerrain->treesPosition[i].y),
-				mpTerrain->treesPosition[i].y)-mMarcus.node.GetPos())) < D2R(40))  //  field of vision of the enemy(angle of enemy can see you)
+			if(GetDeltaDirection(mMarcus.node.GetHpr().x , GetDirection(pos-mMarcus.node.GetPos())) < D2R(40))  //  field of vision of the enemy(angle of enemy can see you)
 			{
-				mpTreeMesh->Draw(D3DXVECTOR3(mpTerrain->treesPosition[i].x,
-					mpTerrain->GetHeight(mpTerrain->treesPosition[i].x, mpTerrain->treesPosition[i].y),
-					mpTerrain->treesPosition[i].y),8,0);
+				mVisibleTrees.push_back(world);
 			}
 
 		}
 	}
+	if(!mVisibleTrees.empty())
+		mpTreeMesh->DrawInstanced(&mVisibleTrees[0], (int)mVisibleTrees.size());
 	// draw huts
-	for(int i = 0; i<mpTerrain->hutsPosition.size(); i++)
-	{
-		mpHutMesh->Draw(D3DXVECTOR3(mpTerrain->hutsPosition[i].x,
-			mpTerrain->GetHeight(mpTerrain->hutsPosition[i].x, mpTerrain->hutsPosition[i].y),
-			mpTerrain->hutsPosition[i].y), 2, 0);
-	}
+	mpHutMesh->DrawInstanced(mHuts.GetMatrices(), mHuts.GetCount());
 	// draw wand and current skill
-	mWand.Draw();
-	mHand.Draw();
-	mCurrSkill.Draw();
+	mWand.Submit(*mpRenderQueue);
+	mHand.Submit(*mpRenderQueue);
+	mCurrSkill.Submit(*mpRenderQueue);
 
 	// draw boss
 	if(mJin.IsAlive())
-		mJin.Draw();
+		mJin.Submit(*mpRenderQueue);
 
 	// draw npcs
-	mMark.Draw();
-	mClara.Draw();
+	mMark.Submit(*mpRenderQueue);
+	mClara.Submit(*mpRenderQueue);
 
 	// draw shots
-	DrawMeshNodes(mMagicball);
-	DrawMeshNodes(mIcicles);
-	DrawMeshNodes(mFireball);
+	mMagicball.Draw(mpRenderQueue);
+	mIcicles.Draw(mpRenderQueue);
+	mFireball.Draw(mpRenderQueue);
 
-	// draw skybox
-	mpSkyBoxMesh->Draw(mMarcus.node.GetPos());
+	// draw skybox (after the rest, so most of it is hidden)
+	D3DXMATRIX skyWorld;
+	D3DXMatrixTranslation(&skyWorld, mMarcus.node.GetPos().x, mMarcus.node.GetPos().y, mMarcus.node.GetPos().z);
+	mpRenderQueue->Add(mpSkyBoxMesh, skyWorld, 1);
 
 	// draw enemies
-	for(unsigned i=0;i<mEnemies.size();i++)
+	for(int i=0;i<mEnemies.GetCount();i++)
 		mEnemies[i]->DrawBounds(GetDevice());
-	DrawEnemy(mEnemies,&mMarcus.node);
+	DrawEnemy(mEnemies.GetEnemies(),&mMarcus.node);
+
+	// all the meshes, sorted by texture & material
+	mpRenderQueue->Flush();
 
 	DrawParticles();
 
@@ -718,7 +745,13 @@ void GameScene::Draw(float dt)
 	sout << "Player pos: " << mMarcus.node.GetPos();
 	sout << "Player hpr: " << mMarcus.node.GetHpr();
 	sout << "\nCharge value: " << icicle_charge; 
-	sout << "\nNo of enemies: " << mEnemies.size();
+	sout << "\nNo of enemies: " << mEnemies.GetCount() << " (updated " << mAI.GetUpdated()
+		<< (mAI.WasOverBudget()? ", over budget)" : ")");
+	sout << "\nShots (most/capacity): " << mMagicball.GetHighWater() << "/" << mMagicball.GetCapacity()
+		<< " " << mIcicles.GetHighWater() << "/" << mIcicles.GetCapacity()
+		<< " " << mFireball.GetHighWater() << "/" << mFireball.GetCapacity();
+	sout << "\nDraws: " << mpRenderQueue->GetStats().Draws << " textures: " << mpRenderQueue->GetStats().TextureChanges
+		<< " materials: " << mpRenderQueue->GetStats().MaterialChanges;
 	sout << "\nIcicle blast damage: " << icicleDamage;
 	sout << "\nCurrent time: " << clock();
 	sout << "\nClock: " << clock();
@@ -762,7 +795,11 @@ void GameScene::InitParticles()
 	// additive blend
 	settings.SourceBlend=D3DBLEND_SRCALPHA;
 	settings.DestBlend = D3DBLEND_INVSRCALPHA;
+	settings.DepthSort = true;	// (alpha blending must be drawn back to front)
+	settings.GroundCollision = SParticleSetting::KILL;	// no point drawing them underground
 	settings.MaxParticles=500;
+	settings.Priority = 2;
+	settings.LodDistance = 15;	// fewer particles for far away shots
 	mpFire->Init(GetDevice(),"media/Particles/fire.png",settings);
 
 	settings.StartColor = D3DCOLOR_XRGB(0,0,255);
@@ -770,6 +807,8 @@ void GameScene::InitParticles()
 
 	settings.Size = 0.05f;
 	settings.LifeTime = 0.3f;
+	settings.Priority = 3;	// always close to the camera, & the player needs to see these
+	settings.LodDistance = 0;
 	mpWandIce->Init(GetDevice(), "media/Particles/smoke.png", settings);
 
 	settings.Size = 0.05f;
@@ -777,14 +816,36 @@ void GameScene::InitParticles()
 	mpCurrSkillParticles->Init(GetDevice(), "media/Particles/smoke.png", settings);
 
 	mpIceCollide->Init(GetDevice(), "media/Particles/flare.bmp");
+	mpIceCollide->GetSettings().Priority = 1;
+	mpIceCollide->GetSettings().LodDistance = 15;
+	mpIceCollide->GetSettings().GroundCollision = SParticleSetting::BOUNCE;
+	mpFire->SetTerrain(mpTerrain);
+	mpIce->SetTerrain(mpTerrain);
+	mpIceCollide->SetTerrain(mpTerrain);
+	// every shot has a trail, so make them now (they are reused as the shots die)
+	mpFire->ReserveEmitters(mFireball.GetCapacity()+1);	// (& Jin's glow)
+	mpIce->ReserveEmitters(mMagicball.GetCapacity()+mIcicles.GetCapacity());
+
+	// the glow around the current skill, wand & Jin's wand
+	SEmitterSetting glow;
+	glow.Rate = 50;
+	glow.Angle = D2R(10);
+	glow.MinSpeed = 0.02f;
+	glow.MaxSpeed = 0.1f;
+	mpCurrSkillParticles->AddEmitter(glow, &mCurrSkill);
+	glow.Angle = D2R(20);
+	glow.Offset = D3DXVECTOR3(-0.025f,0.095f,0.04f);
+	mpWandEmitter = mpWandIce->AddEmitter(glow, &mWand);
+	glow.Rate = 35;
+	glow.Offset = D3DXVECTOR3(0.18f,0.3f,0.35f);
+	mpFire->AddEmitter(glow, &mJin);	// (removed once Jin dies)
 
 	mpSnow->Init(GetDevice(), "media/Particles/snowball.bmp", D3DXVECTOR3(CParticleSystem::GetRandomFloat(0.7f,1.0f), -3, 0));
+	mpSnow->SetTerrain(mpTerrain);
 }
 
-void GameScene::UpdateParticles(float dt, vector<CMeshNode*>& mpMagicBall, vector<CMeshNode*>& mpIcicles, vector<CMeshNode*>& mpFireBall)
+void GameScene::UpdateParticles(float dt)
 {
-	D3DXVECTOR3 dir = mMarcus.node.RotateVector(D3DXVECTOR3(0,0,1));
-
 	if(MB_COOLDOWN)
 		mpCurrSkillParticles->GetSettings().Size += 0.005f;
 	else if(ICE_COOLDOWN)
@@ -795,15 +856,6 @@ void GameScene::UpdateParticles(float dt, vector<CMeshNode*>& mpMagicBall, vecto
 		mpCurrSkillParticles->GetSettings().StartColor = D3DCOLOR_XRGB(0,0,255);
 	}
 
-	for(int i = 0; i<(int)(50*dt); i++)
-	{
-		D3DXVECTOR3 vel = CParticleSystem::VaryDirection(D3DXVECTOR3(0,0.1f,0), D2R(10));
-		vel *= CParticleSystem::GetRandomFloat(0.2f,1.0f);
-		D3DXVECTOR3 pos = mCurrSkill.GetPos();
-		mpCurrSkillParticles->AddParticle(pos, vel);
-	}
-	mpCurrSkillParticles->Update(dt);
-
 	if(icicle_charge > 0)
 	{
 		mpWandIce->GetSettings().Size += 0.0001f;
@@ -815,105 +867,44 @@ void GameScene::UpdateParticles(float dt, vector<CMeshNode*>& mpMagicBall, vecto
 		mpWandIce->GetSettings().LifeTime = 0.3f;
 	}
 
-	for(int k = 0; k<(int)(icicle_charge+(50*dt)); k++)
-	{
-		D3DXVECTOR3 vel=CParticleSystem::VaryDirection(D3DXVECTOR3(0,0.1f,0),D2R(20));
-		vel*=CParticleSystem::GetRandomFloat(0.2f,1.0f);
-		D3DXVECTOR3 pos = mWand.OffsetPos(D3DXVECTOR3(-0.025f,0.095f,0.04f));
-		mpWandIce->AddParticle(pos, vel);
-	}
-	mpWandIce->Update(dt);
-
-	for(int i = 0; i<mpMagicBall.size(); i++)
-	{
-		for(int k = 0; k<(int)(100*dt); k++)
-		{
-			D3DXVECTOR3 vel = CParticleSystem::VaryDirection(-dir, D2R(20));
-			vel *= SHOT_VEL * 0.2f;
-			mpIce->AddParticle(mpMagicBall[i]->GetPos(), vel);
-		}
-	}
+	// the wand glows more as the icicle charges (each point of charge was an extra particle per frame)
+	mpWandEmitter->GetSettings().Rate = 50 + icicle_charge*60;
 
-	for(int i = 0; i<mpIcicles.size(); i++)
-	{
-		for(int k = 0; k<(int)(200*dt); k++)
-		{
-			D3DXVECTOR3 vel = CParticleSystem::VaryDirection(-dir, D2R(20));
-			vel *= SHOT_VEL * 0.2f;
-			mpIce->AddParticle(mpIcicles[i]->GetPos(), vel);
-		}
-	}
-
-	D3DXVECTOR3 boss_dir = mJin.RotateVector(D3DXVECTOR3(0,0,1));
-
-	//for jin's attack
-	for(int i = 0; i<mpFireBall.size(); i++)
-	{
-		for(int k = 0; k<(int)(100*dt); k++)
-		{
-			D3DXVECTOR3 vel = CParticleSystem::VaryDirection(-boss_dir, D2R(20));
-			vel *= SHOT_VEL * 0.2f;
-			mpFire->AddParticle(mpFireBall[i]->GetPos(), vel);
-		}
-	}
-
-	if(mJin.IsAlive())
-	{
-		//for jin's wand
-		for(int i = 0; i<(int)(35*dt); i++)
-		{
-			D3DXVECTOR3 vel=CParticleSystem::VaryDirection(D3DXVECTOR3(0,0.1f,0),D2R(20));
-			vel*=CParticleSystem::GetRandomFloat(0.2f,1.0f);
-			D3DXVECTOR3 pos = mJin.OffsetPos(D3DXVECTOR3(0.18f,0.3f,0.35f));
-			mpFire->AddParticle(pos, vel);
-		}
-	}
-
-
-	mpFire->Update(dt);
-	mpIce->Update(dt);
-	mpIceCollide->Update(dt);
 	mpSnow->SetCentre(mCamera.GetPos());
-	mpSnow->Update(dt);
+	mpParticles->Update(dt);
 }
 void GameScene::DrawParticles()
 {
-	mpFire->Draw(IDENTITY_MAT);
-	mpIce->Draw(IDENTITY_MAT);
-	mpIceCollide->Draw(IDENTITY_MAT);
-	mpSnow->Draw(IDENTITY_MAT);
-	mpWandIce->Draw(IDENTITY_MAT);
-	mpCurrSkillParticles->Draw(IDENTITY_MAT);
+	mpParticles->Draw(IDENTITY_MAT);
 }
 void GameScene::Leave()
 {
+	// the shots' trails belong to the particle systems, so clear them first
+	mFireball.Clear();
+	mMagicball.Clear();
+	mIcicles.Clear();
+	mShotSounds.clear();
+
 	SAFE_DELETE(mpEnemySMesh);
+	mAI.SetJobPool(NULL);
+	SAFE_DELETE(mpParticles);	// and all the particle systems
+	SAFE_DELETE(mpRenderQueue);
 	SAFE_DELETE(mpTerrain);
 	SAFE_DELETE(mpMarcusMesh);
 	SAFE_DELETE(mpClaraMesh);
 	SAFE_DELETE(mpMarkMesh);
 	SAFE_DELETE(mpFireballMesh);
 	SAFE_DELETE(mpHandMesh);
-	SAFE_DELETE(mpFire);
-	SAFE_DELETE(mpIce);
 	SAFE_DELETE(mpIcicleMesh);
 	SAFE_DELETE(mpMagicballMesh);
 	SAFE_DELETE(mpEnemyWMesh);
 	SAFE_DELETE(mpWandMesh);
-	SAFE_DELETE(mpIceCollide);
 	SAFE_DELETE(mpTreeMesh);
 	SAFE_DELETE(mpSkyBoxMesh);
 	SAFE_DELETE(mpHutMesh);
-	SAFE_DELETE(mpCurrSkillParticles);
-	SAFE_DELETE(mpSnow);
-	SAFE_DELETE(mpWandIce);
 	SAFE_DELETE(mpJinMesh);
 
-	DeleteMeshNodes(mFireball);
-	DeleteMeshNodes(mMagicball);
-	DeleteMeshNodes(mIcicles);
-
-	DeleteEnemy(mEnemies);
+	mEnemies.Clear();
 
 	for( int i = (int)vec_pCue.size()-1; i>=0; i--)
 	{
@@ -943,7 +934,7 @@ void GameScene::UpdateBackgroundMusic()
 		return;
 	}
 
-	else if(!inTown && notAttacking == mEnemies.size() && !mpSound->IsCuePlaying("quiet") && !fightingBoss)
+	else if(!inTown && notAttacking == mEnemies.GetCount() && !mpSound->IsCuePlaying("quiet") && !fightingBoss)
 	{
 		mpSound->StopCategory("Music");
 		mpSound->PlayCue("quiet");
@@ -952,14 +943,14 @@ void GameScene::UpdateBackgroundMusic()
 
 	// check if all enemies are not attacking and chasing
 	notAttacking = 0;
-	for(int i = 0; i<mEnemies.size(); i++)
+	for(int i = 0; i<mEnemies.GetCount(); i++)
 	{
 		if(!mEnemies[i]->IsAttacking())
 			notAttacking += 1;
 	}
 
 	// check if enemies are engaging the player
-	for(int i = 0 ; i<mEnemies.size(); i++)
+	for(int i = 0 ; i<mEnemies.GetCount(); i++)
 	{
 		//battle *= mEnemies[i]->GetState();
 		if((mEnemies[i]->IsAttacking() || mJin.GetState() == 0 || mJin.GetState() == 1) &&
@@ -988,6 +979,33 @@ void GameScene::FillListener(CNode& node, X3DAUDIO_LISTENER& listener)
 	listener.OrientTop = node.RotateVector(D3DXVECTOR3(0,1,0));
 	listener.Velocity = D3DXVECTOR3(0,0,0);
 }
+void GameScene::FollowShot(CShotStore& shots, ShotHandle shot)
+{
+	int index = shots.GetIndex(shot);
+	if (index >= 0)
+		emitter.Position = shots.GetPos(index);
+	vec_emitter.push_back(emitter);
+	if (index >= 0)
+	{
+		ShotSound sound = {(int)vec_emitter.size()-1, &shots, shot};
+		mShotSounds.push_back(sound);
+	}
+}
+void GameScene::UpdateShotSounds()
+{
+	for(int i = (int)mShotSounds.size()-1; i>=0; i--)
+	{
+		// once the shot has gone the sound stays where it was
+		int index = mShotSounds[i].pShots->GetIndex(mShotSounds[i].shot);
+		if (index < 0)
+		{
+			mShotSounds[i] = mShotSounds.back();
+			mShotSounds.pop_back();
+		}
+		else
+			vec_emitter[mShotSounds[i].emitter].Position = mShotSounds[i].pShots->GetPos(index);
+	}
+}
 void GameScene::FillEmitter(vector<X3DAUDIO_EMITTER>& emitter)
 {
 	for(int i = 0 ;i<emitter.size();i++)
@@ -17,12 +17,16 @@
 #include "JoystickComponent.h"
 #include "MessageBoxScene.h"
 #include "Node.h"
+#include "ParticleManager.h"
 #include "ParticleSystem.h"
 #include "SpriteUtils.h"
 #include "SoundComponent.h"
 #include "Terrain.h"
+#include "RenderQueue.h"
+#include "Transform.h"
 #include "Shot.h"
 #include "Enemy.h"
+#include "AIScheduler.h"
 #include "NPC.h"
 #include "Boss.h"
 #include <ctime>
@@ -47,6 +51,7 @@ const int FULLY_CHARGED = 70;
 const int MAGICBALL_COOLDOWN = 20;
 const int ICICLE_COOLDOWN = 200;
 const short HEALTH_COOLDOWN = 60;
+const int MAX_AI_UPDATES = 2000;  //  most enemies the AI updates in one frame (see CAIScheduler::SetMaxUpdates)
 
 class GameScene: public CScene
 {
@@ -59,14 +64,24 @@ class GameScene: public CScene
 	X3DAUDIO_EMITTER emitter;
 	vector<IXACT3Cue*> vec_pCue;
 	IXACT3Cue* pCue;
+	// a sound (in vec_emitter) which follows a shot about
+	struct ShotSound
+	{
+		int emitter;
+		CShotStore* pShots;
+		ShotHandle shot;
+	};
+	vector<ShotSound> mShotSounds;
 
 	// particles
+	CParticleManager* mpParticles;	// owns all the particle systems below
 	CParticleSystem* mpFire;
 	CParticleSystem* mpIce;
 	CParticleSystem* mpWandIce;
 	CParticleSystem* mpCurrSkillParticles;
 	CExplosion* mpIceCollide;
 	CPrecipitation* mpSnow;
+	CParticleEmitter* mpWandEmitter;
 
 	CTerrain* mpTerrain;
 	CCameraNode mCamera;
@@ -87,12 +102,19 @@ class GameScene: public CScene
 	CXMesh* mpHandMesh;
 	CXMesh* mpJinMesh;
 
+	// the trees & huts never move, so their world matrices are worked out once
+	CTransformBatch mTrees, mHuts;
+	std::vector<D3DXMATRIX> mVisibleTrees;	// the trees to draw this frame
+	CRenderQueue* mpRenderQueue;	// all the meshes are drawn through this
+
 	CMeshNode mCurrSkill;
 	CMeshNode mWand, mHand;
-	vector<CMeshNode*> mMagicball;
-	vector<CMeshNode*> mIcicles;
-	vector<CMeshNode*> mFireball;
-	vector<Enemy*> mEnemies;
+	CNodeHierarchy mAttachments;	// the nodes attached to the player
+	CShotStore mMagicball;
+	CShotStore mIcicles;
+	CShotStore mFireball;
+	CEnemyStore mEnemies;	// (in one block, see CEnemyStore)
+	CAIScheduler mAI;	// decides which enemies are updated each frame
 	Boss mJin;
 	NPC mMark;
 	NPC mClara;
@@ -133,12 +155,14 @@ class GameScene: public CScene
 	void TalkToNPC();
 	void Draw(float dt);
 	void InitParticles();
-	void UpdateParticles(float dt, vector<CMeshNode*>& mpMagicBall, vector<CMeshNode*>& mpIcicles, vector<CMeshNode*>& mpFireBall);
+	void UpdateParticles(float dt);
 	void UpdateBackgroundMusic();
 	void DrawParticles();
 	void CheckCollisions(D3DXVECTOR3 oldPos);
 	void FillListener(CNode& node, X3DAUDIO_LISTENER& listener);
 	void FillEmitter(vector<X3DAUDIO_EMITTER>& emitter);
+	void FollowShot(CShotStore& shots, ShotHandle shot);	// adds a sound emitter at the shot
+	void UpdateShotSounds();	// moves the sound emitters along with their shots
 	void Leave();
 };
 
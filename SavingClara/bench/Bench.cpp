@@ -0,0 +1,108 @@
+/*==============================================
+ * Bench
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#include <stdio.h>
+#include <stdlib.h>	// __argc
+#include <string.h>
+#include "Bench.h"
+
+#pragma comment(lib, "d3d9.lib") // instruction to the linker
+#pragma comment(lib, "d3dx9.lib") // instruction to the linker
+
+/// a group of checks
+struct SBenchGroup
+{
+	const char* Name;
+	void (*Function)(CBench& bench);
+};
+
+// all the groups, in the order they are run
+static const SBenchGroup BENCH_GROUPS[]=
+{
+	{"enemies",BenchEnemies},
+	{"maze",BenchMaze},
+	{"node",BenchNode},
+	{"particles",BenchParticles},
+	{"perception",BenchPerception},
+	{"renderqueue",BenchRenderQueue},
+	{"shots",BenchShots},
+	{"transform",BenchTransform},
+};
+const int NUM_BENCH_GROUPS=sizeof(BENCH_GROUPS)/sizeof(BENCH_GROUPS[0]);
+
+volatile float gBenchSink=0;
+
+void BenchKeep(float value)
+{
+	gBenchSink+=value;
+}
+
+CBench::CBench()
+{
+	mChecks=0;
+	mFailures=0;
+}
+
+void CBench::Begin(const char* group)
+{
+	printf("\n[%s]\n",group);
+}
+
+bool CBench::Check(bool ok,const char* what)
+{
+	mChecks++;
+	if (!ok)	mFailures++;
+	printf("  %-4s %s\n",ok?"ok":"FAIL",what);
+	return ok;
+}
+
+void CBench::Report(const char* what,double value,const char* units)
+{
+	printf("       %-52s %12.3f %s\n",what,value,units);
+}
+
+CBenchTimer::CBenchTimer()
+{
+	QueryPerformanceFrequency(&mFreq);
+	Start();
+}
+
+void CBenchTimer::Start()
+{
+	QueryPerformanceCounter(&mStart);
+}
+
+double CBenchTimer::GetMs()
+{
+	LARGE_INTEGER now;
+	QueryPerformanceCounter(&now);
+	return (double)(now.QuadPart-mStart.QuadPart)*1000/mFreq.QuadPart;
+}
+
+int main(int argc,char* argv[])
+{
+	CBench bench;
+	for(int g=0;g<NUM_BENCH_GROUPS;g++)
+	{
+		// the groups named on the command line (or all of them)
+		bool run=(argc<2);
+		for(int a=1;a<argc;a++)
+		{
+			if (strcmp(argv[a],BENCH_GROUPS[g].Name)==0)	run=true;
+		}
+		if (!run)	continue;
+		bench.Begin(BENCH_GROUPS[g].Name);
+		BENCH_GROUPS[g].Function(bench);
+	}
+	printf("\n%d checks, %d failed\n",bench.GetChecks(),bench.GetFailures());
+	return (bench.GetFailures()>0)? 1 : 0;
+}
+
+// some of the engine includes ConsoleOutput.h, which makes the linker start at WinMain
+int WINAPI WinMain(HINSTANCE,HINSTANCE,LPSTR,int)
+{
+	return main(__argc,__argv);
+}
@@ -0,0 +1,74 @@
+/*==============================================
+ * Bench
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#pragma once
+
+/** \file Bench.h The headless checks & timings.
+The Bench program runs the engine code which does not need a device (or a game),
+checking it does what it should & timing it against the way it used to be done.
+It returns non zero if any check fails.
+
+Each group is a function taking a CBench, listed in Bench.cpp.
+Run it with no arguments for every group, or with the names of the groups to run.
+\code
+void BenchParticles(CBench& bench)
+{
+	...
+	bench.Check(player.GetMismatches()==0,"replay counts match the recording");
+	CBenchTimer timer;
+	for(int i=0;i<FRAMES;i++)
+		system.Update(1/60.0f);
+	bench.Report("particles per ms",count*FRAMES/timer.GetMs(),"");
+}
+\endcode
+*/
+
+#include <windows.h>
+
+/// collects up the results of the checks & prints them
+class CBench
+{
+public:
+	CBench();
+	/// prints the name of the next group
+	void Begin(const char* group);
+	/// records a check, which must pass, returns ok
+	bool Check(bool ok,const char* what);
+	/// prints a measurement
+	void Report(const char* what,double value,const char* units);
+	int GetChecks(){return mChecks;}
+	int GetFailures(){return mFailures;}
+private:
+	int mChecks;
+	int mFailures;
+};
+
+/// a stop watch
+class CBenchTimer
+{
+public:
+	CBenchTimer();
+	void Start();
+	/// the time since Start() in milliseconds
+	double GetMs();
+private:
+	LARGE_INTEGER mStart,mFreq;
+};
+
+/// stops the optimiser throwing away a result which is never used
+void BenchKeep(float value);
+
+/// \defgroup BenchGroups The groups (one file each)
+/// @{
+void BenchEnemies(CBench& bench);
+void BenchMaze(CBench& bench);
+void BenchNode(CBench& bench);
+void BenchParticles(CBench& bench);
+void BenchPerception(CBench& bench);
+void BenchRenderQueue(CBench& bench);
+void BenchShots(CBench& bench);
+void BenchTransform(CBench& bench);
+/// @}
@@ -0,0 +1,296 @@
+/*==============================================
+ * Enemy Bench
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#include <math.h>
+#include <stdlib.h>	// malloc
+#include <vector>
+#include "AIScheduler.h"
+#include "Bench.h"
+#include "Enemy.h"
+#include "JobPool.h"
+#include "Random.h"
+
+// the store sweep: a million enemies
+static const int NUM_SWEPT=1000000;
+static const int SWEEPS=10;
+// the scheduler test: how many enemies, over how big an area, for how long
+static const int NUM_SCHEDULED=100000;
+static const float SCHEDULED_AREA=1000;
+static const int SCHEDULED_FRAMES=120;
+static const float DT=1/60.0f;
+// the repeatable test: how many enemies (around the player), for how long, & the most updated per frame
+static const int NUM_REPEATED=20000;
+static const float REPEATED_AREA=150;
+static const int REPEATED_FRAMES=300;
+static const int REPEATED_MAX_UPDATES=3000;
+
+/// what the scheduler does to every enemy each frame: checks its alive & looks where it is
+static float Sweep(const std::vector<Enemy*>& enemies,const D3DXVECTOR3& playerPos)
+{
+	float nearCount=0;
+	for(size_t i=0;i<enemies.size();i++)
+	{
+		if (!enemies[i]->IsAlive())	continue;
+		D3DXVECTOR3 diff=enemies[i]->GetPos()-playerPos;
+		if (D3DXVec3LengthSq(&diff)<50*50)	nearCount++;
+	}
+	return nearCount;
+}
+
+/// a million enemies in a CEnemyStore against a million new'ed ones
+static void TimeStore(CBench& bench)
+{
+	CRandom random;
+	random.Seed(41);
+	CEnemyStore store(NUM_SWEPT);
+	std::vector<Enemy*> oldEnemies;
+	oldEnemies.reserve(NUM_SWEPT);
+	std::vector<void*> other;	// (the game allocates other things between enemies, so they don't end up side by side)
+	for(int i=0;i<NUM_SWEPT;i++)
+	{
+		D3DXVECTOR3 pos(random.NextFloat(-500,500),0,random.NextFloat(-500,500));
+		store.Add(NULL,pos,100);
+		Enemy* pEnemy=new Enemy();
+		pEnemy->Init(NULL,pos);
+		oldEnemies.push_back(pEnemy);
+		other.push_back(malloc(16+(random.Next()&255)));
+	}
+	bench.Check(store.GetCount()==NUM_SWEPT && store.GetOverflows()==0,"the store holds a million enemies");
+
+	// (the player moves each sweep, so the optimiser can't do them all at once)
+	float sum=0;
+	CBenchTimer timer;
+	for(int s=0;s<SWEEPS;s++)
+		sum+=Sweep(oldEnemies,D3DXVECTOR3(s*10.0f,0,0));
+	double oldMs=timer.GetMs()/SWEEPS;
+	timer.Start();
+	for(int s=0;s<SWEEPS;s++)
+		sum-=Sweep(store.GetEnemies(),D3DXVECTOR3(s*10.0f,0,0));
+	double newMs=timer.GetMs()/SWEEPS;
+	bench.Check(sum==0,"the store sweep finds the same enemies");
+
+	// kill half, then fill up again: it should reuse the space rather than run out
+	for(int i=0;i<NUM_SWEPT;i+=2)
+	{
+		store[i]->Damage(1000);
+		oldEnemies[i]->Damage(1000);
+	}
+	timer.Start();
+	RemoveDead(oldEnemies);
+	double oldRemoveMs=timer.GetMs();
+	timer.Start();
+	store.RemoveDead();
+	double removeMs=timer.GetMs();
+	bool ordered=true;
+	for(int i=1;i<store.GetCount();i++)
+		if (store[i]<=store[i-1])	ordered=false;
+	bench.Check(store.GetCount()==NUM_SWEPT/2 && ordered,"RemoveDead() keeps the living half in order");
+	for(int i=0;i<NUM_SWEPT/2;i++)
+		store.Add(NULL,D3DXVECTOR3(0,0,0),100);
+	bench.Check(store.GetCount()==NUM_SWEPT && store.GetOverflows()==0 && store.Add(NULL,D3DXVECTOR3(0,0,0))==NULL,
+			"the store reuses the space of the dead (& fails when its full)");
+	bench.Check(store[NUM_SWEPT-1]->mLastUpdate<0 && store[NUM_SWEPT-1]->IsAlive(),"a reused enemy starts afresh");
+
+	bench.Report("1M enemies: new'ed, sweep ms",oldMs,"ms");
+	bench.Report("1M enemies: store, sweep ms",newMs,"ms");
+	bench.Report("speed up: sweep",oldMs/newMs,"x");
+	bench.Report("1M enemies: RemoveDead(Enemy*) half, ms",oldRemoveMs,"ms");
+	bench.Report("1M enemies: store RemoveDead() half, ms",removeMs,"ms");
+
+	for(unsigned i=0;i<oldEnemies.size();i++)
+		delete oldEnemies[i];
+	for(unsigned i=0;i<other.size();i++)
+		free(other[i]);
+}
+
+/// what the old PickDue() did every frame: looked at every enemy to see if it was due
+static int OldPickDue(std::vector<Enemy*>& enemies,const D3DXVECTOR3& playerPos,float clock,float dt)
+{
+	int due=0;
+	for(unsigned i=0;i<enemies.size();i++)
+	{
+		if (!enemies[i]->IsAlive())	continue;
+		float interval=CAIScheduler::GetInterval(enemies[i],playerPos);
+		if (clock-enemies[i]->mLastUpdate+dt*0.5f>=interval)	due++;
+	}
+	return due;
+}
+
+/// fills the store with enemies spread over the area (most of them far from the player at 0,0,0)
+static void Spawn(CEnemyStore& store,int count,unsigned seed)
+{
+	CRandom random;
+	random.Seed(seed);
+	for(int i=0;i<count;i++)
+		store.Add(NULL,D3DXVECTOR3(random.NextFloat(-SCHEDULED_AREA,SCHEDULED_AREA),0,random.NextFloat(-SCHEDULED_AREA,SCHEDULED_AREA)));
+}
+
+/// 100k enemies for 2 seconds: each updated as often as its distance says, & only the due ones looked at
+static void TimeScheduler(CBench& bench)
+{
+	CEnemyStore store(NUM_SCHEDULED);
+	Spawn(store,NUM_SCHEDULED,48);
+	CAIScheduler ai(0);
+	ai.Seed(1);
+	D3DXVECTOR3 playerPos(0,0,0);
+	std::vector<float> last(NUM_SCHEDULED,-1);
+	std::vector<float> longest(NUM_SCHEDULED,0);	// (the longest wait past its interval)
+	std::vector<int> updates(NUM_SCHEDULED,0);
+	std::vector<float> interval(NUM_SCHEDULED,0);
+	int total=0;
+	double ms=0,oldMs=0;
+	CBenchTimer timer;
+	for(int f=0;f<SCHEDULED_FRAMES;f++)
+	{
+		float clock=f*DT;
+		// (the old way only looks, it doesn't update them)
+		timer.Start();
+		BenchKeep((float)OldPickDue(store.GetEnemies(),playerPos,clock,DT));
+		oldMs+=timer.GetMs();
+		timer.Start();
+		ai.Update(store,playerPos,DT);
+		ms+=timer.GetMs();
+		total+=ai.GetUpdated();
+		for(int i=0;i<NUM_SCHEDULED;i++)
+		{
+			Enemy* pEnemy=store[i];
+			if (pEnemy->mLastUpdate==last[i])	continue;	// (not updated this frame)
+			// (against the interval it was given last time, as it may have moved since,
+			// & not from its first, as that is spread out)
+			float late=pEnemy->mLastUpdate-last[i]-((interval[i]>DT)? interval[i] : DT);
+			if (updates[i]>1 && late>longest[i])	longest[i]=late;
+			last[i]=pEnemy->mLastUpdate;
+			updates[i]++;
+			interval[i]=CAIScheduler::GetInterval(pEnemy,playerPos);
+		}
+	}
+	// nobody waits longer than their interval (& half a frame, as they are picked by the frame)
+	bool starved=false;
+	for(int i=0;i<NUM_SCHEDULED;i++)
+		if (updates[i]<3 || longest[i]>DT*0.51f)	starved=true;
+	bench.Check(!starved,"every enemy is updated at least as often as its interval");
+
+	// a far one which is hit is updated next frame
+	int farIndex=0;
+	while(farIndex<NUM_SCHEDULED && CAIScheduler::GetInterval(store[farIndex],playerPos)<0.5f)
+		farIndex++;
+	Enemy* pFar=store[farIndex];
+	float before=pFar->mLastUpdate;
+	int waited=0;
+	while(pFar->mLastUpdate==before && waited<SCHEDULED_FRAMES)
+	{
+		if (waited==0)	ai.Wake(pFar);	// (the frame after it was updated)
+		ai.Update(store,playerPos,DT);
+		waited++;
+	}
+	bench.Check(waited==1,"Wake() updates a far enemy on the next Update()");
+
+	// kill half & add new ones in their space: the new ones are updated, the dead ones never are
+	for(int i=0;i<NUM_SCHEDULED;i+=2)
+		store[i]->Damage(1000);
+	store.RemoveDead();
+	Spawn(store,NUM_SCHEDULED/2,49);
+	ai.Update(store,playerPos,DT);
+	bool allNew=true;
+	for(int i=NUM_SCHEDULED/2;i<NUM_SCHEDULED;i++)
+		if (store[i]->mLastUpdate<0)	allNew=false;
+	bench.Check(allNew && ai.GetUpdated()>=NUM_SCHEDULED/2,"new enemies in reused space are updated on the first Update()");
+
+	bench.Report("100k enemies: updates per frame",(double)total/SCHEDULED_FRAMES,"");
+	bench.Report("100k enemies: old PickDue() scan alone, ms per frame",oldMs/SCHEDULED_FRAMES,"ms");
+	bench.Report("100k enemies: Update() (pick & update), ms per frame",ms/SCHEDULED_FRAMES,"ms");
+}
+
+/// what a seeded game did, to compare with another
+struct SGameRecord
+{
+	std::vector<float> Damage;	// the damage to the player each frame
+	std::vector<int> Updated;	// the enemies updated each frame
+	std::vector<float> End;	// where each enemy ended up, which way it faced, its life, when updated & its next random number
+	std::vector<int> States;	// what each enemy ended up doing
+};
+
+/// the player walks round in a circle, firing every so often, while the enemies die & are replaced
+static void PlaySeeded(CAIScheduler& ai,unsigned seed,SGameRecord& record)
+{
+	CEnemyStore store(NUM_REPEATED);
+	CRandom random;
+	random.Seed(49);
+	for(int i=0;i<NUM_REPEATED;i++)
+		store.Add(NULL,D3DXVECTOR3(random.NextFloat(-REPEATED_AREA,REPEATED_AREA),0,random.NextFloat(-REPEATED_AREA,REPEATED_AREA)));
+	ai.Seed(seed);
+	ai.SetMaxUpdates(REPEATED_MAX_UPDATES);
+	for(int f=0;f<REPEATED_FRAMES;f++)
+	{
+		float angle=f*0.01f;
+		D3DXVECTOR3 playerPos(cosf(angle)*50,0,sinf(angle)*50);
+		if (f%10==0)	ai.Alert(playerPos);
+		if (f%60==30)
+		{
+			// (the player kills some, & new ones take their space)
+			int killed=0;
+			for(int i=f;i<store.GetCount();i+=97,killed++)
+				store[i]->Damage(1000);
+			store.RemoveDead();
+			for(int i=0;i<killed;i++)
+				store.Add(NULL,D3DXVECTOR3(random.NextFloat(-REPEATED_AREA,REPEATED_AREA),0,random.NextFloat(-REPEATED_AREA,REPEATED_AREA)));
+		}
+		ai.Update(store,playerPos,DT);
+		record.Damage.push_back(ai.GetPlayerDamage());
+		record.Updated.push_back(ai.GetUpdated());
+	}
+	for(int i=0;i<store.GetCount();i++)
+	{
+		Enemy* pEnemy=store[i];
+		float end[]={pEnemy->GetPos().x,pEnemy->GetPos().z,pEnemy->mHpr.x,pEnemy->mLife,pEnemy->mLastUpdate,(float)(pEnemy->mRandom.Next()>>8)};
+		record.End.insert(record.End.end(),end,end+sizeof(end)/sizeof(end[0]));
+		record.States.push_back(pEnemy->GetState());
+	}
+}
+
+/// 20k enemies, seeded the same: on one thread & on a pool (with a time budget it must ignore), the same game
+static void CheckRepeatable(CBench& bench)
+{
+	SGameRecord serial,pooled,other;
+	CBenchTimer timer;
+	CAIScheduler serialAI(0);
+	PlaySeeded(serialAI,7,serial);
+	double serialMs=timer.GetMs()/REPEATED_FRAMES;
+
+	CJobPool pool(3);
+	CAIScheduler pooledAI(0.00001f);	// (far too short, if it was used)
+	pooledAI.SetJobPool(&pool);
+	timer.Start();
+	PlaySeeded(pooledAI,7,pooled);
+	double pooledMs=timer.GetMs()/REPEATED_FRAMES;
+
+	CAIScheduler otherAI(0);
+	PlaySeeded(otherAI,8,other);
+
+	float totalDamage=0;
+	int capped=0;
+	for(int f=0;f<REPEATED_FRAMES;f++)
+	{
+		totalDamage+=serial.Damage[f];
+		if (serial.Updated[f]==REPEATED_MAX_UPDATES)	capped++;
+	}
+	bench.Check(serial.Damage==pooled.Damage && serial.Updated==pooled.Updated,"the same seed does the same damage each frame (one thread or many)");
+	bench.Check(serial.End==pooled.End && serial.States==pooled.States,"the same seed leaves every enemy the same");
+	bench.Check(capped>0 && totalDamage>0,"the game was cut short by SetMaxUpdates() & the player was hurt");
+	bench.Check(serial.End!=other.End,"a different seed gives a different game");
+
+	bench.Report("20k seeded: frames cut short by SetMaxUpdates()",capped,"");
+	bench.Report("20k seeded: damage to the player",totalDamage,"");
+	bench.Report("20k seeded: one thread, ms per frame",serialMs,"ms");
+	bench.Report("20k seeded: job pool, ms per frame",pooledMs,"ms");
+}
+
+void BenchEnemies(CBench& bench)
+{
+	TimeStore(bench);
+	TimeScheduler(bench);
+	CheckRepeatable(bench);
+}
@@ -0,0 +1,140 @@
+/*==============================================
+ * Maze Bench
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#include <math.h>
+#include <stdio.h>
+#include "Bench.h"
+#include "Maze.h"
+
+// where the test maze goes (in the current directory)
+static const char* MAZE_FILE="bench_maze.txt";
+
+/// the rows are different lengths, so there are cells off the end of the short ones
+static const char* MAZE_ROWS[]=
+{
+	"##########",
+	"#....#...........%...#",
+	"#...",
+	"#.......##.........................................#",
+	"##########",
+};
+
+/** A room for the sweep tests, with a one cell wall at x=6, z=3 (the rows are upside down, z=0 is the bottom one).
+The room is x=1..10, z=1..5, so its inside corner (top right) is at x=10.5, z=5.5.
+*/
+static const char* SWEEP_ROWS[]=
+{
+	"############",
+	"#..........#",
+	"#..........#",
+	"#.....#....#",
+	"#..........#",
+	"#..........#",
+	"############",
+};
+// the size of the objects swept (as the player's)
+static const float SWEEP_RADIUS=0.3f;
+// how close the contact must be (the maths is exact apart from float rounding)
+static const float SWEEP_TOLERANCE=1e-5f;
+// how far from a wall an object is stopped (SWEEP_SKIN in Maze.cpp)
+static const float SKIN=0.001f;
+
+/// the first cell at or after x which GetCell() says is not clear, one cell at a time
+static int SlowFindWall(CMaze& maze,int z,int x)
+{
+	while(maze.GetCell(D3DXVECTOR3((float)x,0,(float)z))=='.')
+		x++;
+	return x;
+}
+
+/// writes the rows to MAZE_FILE & loads them, returns false on failure
+static bool LoadMaze(CMaze& maze,const char** rows,int count)
+{
+	FILE* file=fopen(MAZE_FILE,"w");
+	if (file==NULL)	return false;
+	for(int i=0;i<count;i++)
+		fprintf(file,"%s\n",rows[i]);
+	fclose(file);
+	bool ok=maze.Init(MAZE_FILE);
+	remove(MAZE_FILE);
+	return ok;
+}
+
+/// whether a & b are the same to within SWEEP_TOLERANCE
+static bool Near(float a,float b){return fabsf(a-b)<=SWEEP_TOLERANCE;}
+
+/// SweepCircle() & WallSlide(): no tunnelling, exact contacts, sliding & stopping in corners
+static void CheckSweep(CBench& bench)
+{
+	CMaze maze(NULL,NULL);
+	const int ROWS=sizeof(SWEEP_ROWS)/sizeof(SWEEP_ROWS[0]);
+	if (!bench.Check(LoadMaze(maze,SWEEP_ROWS,ROWS),"sweep maze loaded"))	return;
+
+	// 20 cells to the right, through the one cell wall (the old sampling would step right over it)
+	SSweepResult sweep;
+	D3DXVECTOR3 start(2,0,3);
+	bool hit=maze.SweepCircle(start,D3DXVECTOR3(20,0,0),SWEEP_RADIUS,sweep);
+	bench.Check(hit && sweep.Pos.x<5.5f-SWEEP_RADIUS && maze.IsClear(sweep.Pos,SWEEP_RADIUS),
+			"a move of 20 cells stops at a one cell wall (no tunnelling)");
+	D3DXVECTOR3 slid=maze.WallSlide(start,start+D3DXVECTOR3(20,0,0),SWEEP_RADIUS);
+	bench.Check(slid.x<5.5f-SWEEP_RADIUS && Near(slid.z,3),"WallSlide() stops at it too");
+
+	// the contact: the leading edge (2.3) meets the wall's face (5.5) after 3.2 of the 20
+	bench.Check(Near(sweep.Time,3.2f/20) && Near(sweep.Pos.x,5.5f-SWEEP_RADIUS-SKIN) && Near(sweep.Pos.z,3),
+			"the contact time & position are exact (hitting x)");
+	bench.Check(sweep.Normal==D3DXVECTOR3(-1,0,0),"the normal faces back along x");
+	// & up into the top wall (5.5) from 2.3, after 3.2 of the 5
+	hit=maze.SweepCircle(D3DXVECTOR3(3,0,2),D3DXVECTOR3(0,0,5),SWEEP_RADIUS,sweep);
+	bench.Check(hit && Near(sweep.Time,3.2f/5) && Near(sweep.Pos.z,5.5f-SWEEP_RADIUS-SKIN) && sweep.Normal==D3DXVECTOR3(0,0,-1),
+			"the contact time, position & normal are exact (hitting z)");
+
+	// at an angle into the wall: the x is stopped after 0.4, the rest of the z (0.6 of 1) is kept
+	hit=maze.SweepCircle(start,D3DXVECTOR3(8,0,1),SWEEP_RADIUS,sweep);
+	bench.Check(hit && Near(sweep.Time,0.4f) && sweep.Normal==D3DXVECTOR3(-1,0,0) &&
+			sweep.Slide.x==0 && Near(sweep.Slide.z,0.6f),"the slide keeps the part along the wall");
+	slid=maze.WallSlide(start,start+D3DXVECTOR3(8,0,1),SWEEP_RADIUS);
+	bench.Check(Near(slid.x,5.5f-SWEEP_RADIUS-SKIN) && Near(slid.z,4),"WallSlide() slides along the wall");
+
+	// into the top right corner: it stops there, touching both walls
+	D3DXVECTOR3 corner=maze.WallSlide(D3DXVECTOR3(9,0,4),D3DXVECTOR3(14,0,9),SWEEP_RADIUS);
+	bench.Check(Near(corner.x,10.5f-SWEEP_RADIUS-SKIN) && Near(corner.z,5.5f-SWEEP_RADIUS-SKIN) &&
+			maze.IsClear(corner,SWEEP_RADIUS),"WallSlide() into a corner stops in the corner");
+	// & moving on into it doesn't move it (or push it through)
+	D3DXVECTOR3 again=maze.WallSlide(corner,corner+D3DXVECTOR3(1,0,1),SWEEP_RADIUS);
+	bench.Check(Near(again.x,corner.x) && Near(again.z,corner.z),"pushing on into the corner stays put");
+
+	// the group version gives the same as one at a time
+	D3DXVECTOR3 oldPos[]={start,start,D3DXVECTOR3(9,0,4),D3DXVECTOR3(3,0,2)};
+	D3DXVECTOR3 newPos[]={start+D3DXVECTOR3(20,0,0),start+D3DXVECTOR3(8,0,1),D3DXVECTOR3(14,0,9),D3DXVECTOR3(3,0,2.5f)};
+	const int MOVERS=sizeof(oldPos)/sizeof(oldPos[0]);
+	float radius[MOVERS];
+	D3DXVECTOR3 result[MOVERS];
+	for(int i=0;i<MOVERS;i++)
+		radius[i]=SWEEP_RADIUS;
+	maze.WallSlide(oldPos,newPos,radius,result,MOVERS);
+	bool same=true;
+	for(int i=0;i<MOVERS;i++)
+		if (result[i]!=maze.WallSlide(oldPos[i],newPos[i],radius[i]))	same=false;
+	bench.Check(same,"WallSlide() for a group matches one at a time");
+}
+
+void BenchMaze(CBench& bench)
+{
+	const int ROWS=sizeof(MAZE_ROWS)/sizeof(MAZE_ROWS[0]);
+	CMaze maze(NULL,NULL);
+	if (!bench.Check(LoadMaze(maze,MAZE_ROWS,ROWS),"maze loaded"))	return;
+
+	bench.Check(maze.GetDepth()==ROWS,"every row loaded");
+	bench.Check(maze.GetRowLength(-1)==0 && maze.GetRowLength(ROWS)==0,"rows off the map are empty");
+	// everything off the map (including past the end of each row) is a wall
+	bool same=true;
+	for(int z=-2;z<ROWS+2;z++)
+		for(int x=-3;x<60;x++)
+			if (maze.FindWall(z,x)!=SlowFindWall(maze,z,x))	same=false;
+	bench.Check(same,"FindWall() matches GetCell() on & off the map");
+	bench.Check(maze.FindWall(2,1)==4 && maze.FindWall(3,6)==17,"FindWall() stops at the end of a short row & at hot cells");
+	CheckSweep(bench);
+}
@@ -0,0 +1,187 @@
+/*==============================================
+ * Node Bench
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "Bench.h"
+#include "Node.h"
+#include "Random.h"
+
+// how many nodes & how many offsets each one is asked for, per pass (about what the AI & camera ask for)
+static const int NUM_NODES=1000;
+static const int OFFSETS_PER_NODE=8;
+static const int PASSES=200;
+// the remove dead test: how many nodes, half of which die
+static const int NUM_KILLED=100000;
+
+/// OffsetPos() the way it used to be, building the rotation matrix every call
+static D3DXVECTOR3 OldOffsetPos(CNode& node,const D3DXVECTOR3& offset)
+{
+	D3DXMATRIX rot;
+	D3DXMatrixRotationYawPitchRoll(&rot, node.mHpr.x, node.mHpr.y, node.mHpr.z);
+	D3DXVECTOR3 rvec;	// rotated vec
+	D3DXVec3TransformCoord(&rvec, &offset, &rot);
+	return node.mPos + rvec;
+}
+
+/// the bigger of worst & the length of diff
+static float Worse(float worst,const D3DXVECTOR3& diff)
+{
+	float len=D3DXVec3Length(&diff);
+	return (len>worst)? len : worst;
+}
+
+/// OffsetPos() against building the matrix every call
+static void TimeOffsetPos(CBench& bench)
+{
+	CRandom random;
+	random.Seed(40);
+	std::vector<CNode*> nodes;
+	for(int i=0;i<NUM_NODES;i++)
+	{
+		D3DXVECTOR3 pos(random.NextFloat(-100,100),random.NextFloat(0,10),random.NextFloat(-100,100));
+		D3DXVECTOR3 hpr(random.NextFloat(-D3DX_PI,D3DX_PI),random.NextFloat(-1,1),random.NextFloat(-1,1));
+		nodes.push_back(new CNode(pos,hpr));
+	}
+	D3DXVECTOR3 offsets[OFFSETS_PER_NODE];
+	for(int j=0;j<OFFSETS_PER_NODE;j++)
+		offsets[j]=D3DXVECTOR3(random.NextFloat(-20,20),random.NextFloat(-20,20),random.NextFloat(-20,20));
+
+	// the same answers as before
+	float worst=0;
+	for(int i=0;i<NUM_NODES;i++)
+		for(int j=0;j<OFFSETS_PER_NODE;j++)
+		{
+			D3DXVECTOR3 diff=nodes[i]->OffsetPos(offsets[j])-OldOffsetPos(*nodes[i],offsets[j]);
+			worst=Worse(worst,diff);
+			diff=nodes[i]->RotateVector(offsets[j])-(OldOffsetPos(*nodes[i],offsets[j])-nodes[i]->mPos);
+			worst=Worse(worst,diff);
+		}
+	bench.Check(worst<1e-4f,"OffsetPos() & RotateVector() match the matrix");
+	// & still right after turning (including changing mHpr directly)
+	worst=0;
+	for(int i=0;i<NUM_NODES;i++)
+	{
+		nodes[i]->OffsetPos(offsets[0]);
+		if (i&1)	nodes[i]->Yaw(0.1f);
+		else	nodes[i]->mHpr.y+=0.1f;
+		D3DXVECTOR3 diff=nodes[i]->OffsetPos(offsets[0])-OldOffsetPos(*nodes[i],offsets[0]);
+		worst=Worse(worst,diff);
+	}
+	bench.Check(worst<1e-4f,"OffsetPos() follows Yaw() & changes to mHpr");
+
+	const double CALLS=(double)NUM_NODES*OFFSETS_PER_NODE*PASSES;
+	D3DXVECTOR3 sum(0,0,0);
+	CBenchTimer timer;
+	for(int p=0;p<PASSES;p++)
+		for(int i=0;i<NUM_NODES;i++)
+			for(int j=0;j<OFFSETS_PER_NODE;j++)
+				sum+=OldOffsetPos(*nodes[i],offsets[j]);
+	double oldNs=timer.GetMs()*1e6/CALLS;
+	timer.Start();
+	for(int p=0;p<PASSES;p++)
+		for(int i=0;i<NUM_NODES;i++)
+			for(int j=0;j<OFFSETS_PER_NODE;j++)
+				sum+=nodes[i]->OffsetPos(offsets[j]);
+	double newNs=timer.GetMs()*1e6/CALLS;
+	// the worst case, turning before every call (so the rotation is worked out every time)
+	timer.Start();
+	for(int p=0;p<PASSES;p++)
+		for(int i=0;i<NUM_NODES;i++)
+			for(int j=0;j<OFFSETS_PER_NODE;j++)
+			{
+				nodes[i]->Yaw(0.001f);
+				sum+=nodes[i]->OffsetPos(offsets[j]);
+			}
+	double turnNs=timer.GetMs()*1e6/CALLS;
+	BenchKeep(sum.x+sum.y+sum.z);
+
+	bench.Report("old OffsetPos(), ns per call",oldNs,"ns");
+	bench.Report("OffsetPos(), ns per call",newNs,"ns");
+	bench.Report("OffsetPos() after turning, ns per call",turnNs,"ns");
+	bench.Report("speed up: OffsetPos()",oldNs/newNs,"x");
+	bench.Check(newNs<oldNs,"OffsetPos() is quicker than building the matrix");
+
+	for(int i=0;i<NUM_NODES;i++)
+		delete nodes[i];
+}
+
+/// DeleteDeadMeshNodes() the way it used to be, erase()'ing each dead node
+static void OldDeleteDead(std::vector<CMeshNode*>& vec)
+{
+	for(int i=(int)vec.size()-1;i>=0;i--)
+	{
+		if (vec[i]->IsAlive()==false)
+		{
+			delete vec[i];
+			vec.erase(vec.begin()+i);
+		}
+	}
+}
+
+/// makes the nodes, killing a random half (the same half each time)
+static void MakeHalfDead(std::vector<CMeshNode*>& vec)
+{
+	CRandom random;
+	random.Seed(43);
+	std::vector<int> life(NUM_KILLED);
+	for(int i=0;i<NUM_KILLED;i++)
+		life[i]=(i<NUM_KILLED/2)? 0 : 100;
+	for(int i=NUM_KILLED-1;i>0;i--)	// (shuffled)
+		std::swap(life[i],life[random.Next()%(i+1)]);
+	vec.clear();
+	for(int i=0;i<NUM_KILLED;i++)
+		vec.push_back(new CMeshNode(NULL,D3DXVECTOR3((float)i,0,0),D3DXVECTOR3(0,0,0),1,life[i]));
+}
+
+/// the x of each node (which is its number when made)
+static std::vector<float> GetNumbers(std::vector<CMeshNode*>& vec)
+{
+	std::vector<float> numbers;
+	for(unsigned i=0;i<vec.size();i++)
+		numbers.push_back(vec[i]->GetPos().x);
+	return numbers;
+}
+
+/// killing half of 100k nodes: the old erase() loop against RemoveDead()
+static void TimeRemoveDead(CBench& bench)
+{
+	std::vector<CMeshNode*> vec;
+	MakeHalfDead(vec);
+	CBenchTimer timer;
+	OldDeleteDead(vec);
+	double oldMs=timer.GetMs();
+	std::vector<float> oldNumbers=GetNumbers(vec);
+	DeleteMeshNodes(vec);
+
+	MakeHalfDead(vec);
+	timer.Start();
+	RemoveDead(vec);
+	double keepMs=timer.GetMs();
+	bench.Check(GetNumbers(vec)==oldNumbers,"RemoveDead() leaves the same nodes, in the same order");
+	DeleteMeshNodes(vec);
+
+	MakeHalfDead(vec);
+	timer.Start();
+	RemoveDead(vec,false);
+	double mixMs=timer.GetMs();
+	std::vector<float> numbers=GetNumbers(vec);
+	std::sort(numbers.begin(),numbers.end());
+	bench.Check(numbers==oldNumbers,"RemoveDead(vec,false) leaves the same nodes");
+	DeleteMeshNodes(vec);
+
+	bench.Report("kill half of 100k: erase() each, ms",oldMs,"ms");
+	bench.Report("kill half of 100k: RemoveDead(), ms",keepMs,"ms");
+	bench.Report("kill half of 100k: RemoveDead(vec,false), ms",mixMs,"ms");
+	bench.Report("speed up: RemoveDead()",oldMs/keepMs,"x");
+}
+
+void BenchNode(CBench& bench)
+{
+	TimeOffsetPos(bench);
+	TimeRemoveDead(bench);
+}
@@ -0,0 +1,542 @@
+/*==============================================
+ * Particle Bench
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>	// rand
+#include <algorithm>
+#include <deque>
+#include <vector>
+#include "Bench.h"
+#include "ParticleManager.h"
+#include "ParticleRecorder.h"
+#include "Random.h"
+
+// where the recording goes (in the current directory)
+static const char* RECORDING_FILE="bench_particles.rec";
+static const char* DAMAGED_FILE="bench_damaged.rec";
+// how many places the recording is cut short to check the replay stops safely
+static const int NUM_CUTS=64;
+
+/** A particle system on bumpy ground, without a terrain (which needs a device).
+The ground is worked out rather than looked up, so the replay can only match if the heights were recorded.
+*/
+template<class T>
+class CBumpyGround: public T
+{
+protected:
+	bool CollidesWithGround(){return true;}
+	void GetGroundHeights(int begin,int end)
+	{
+		for(int i=begin;i<end;i++)
+			this->mGroundHeight[i]=sinf(this->mParticles.PosX[i]*0.7f)*0.5f+cosf(this->mParticles.PosZ[i]*1.3f)*0.5f;
+	}
+};
+
+/// a particle system which lets the particles be looked at
+class CArraySystem: public CParticleSystem
+{
+public:
+	const SParticleArrays& GetArrays(){return mParticles;}
+	void Sort(const D3DXMATRIX& worldView){SortByDepth(worldView);}
+	const std::vector<int>& GetOrder(){return mSortIndex;}
+};
+
+/// a particle as it was stored before the structure of arrays (to time against)
+struct SOldParticle
+{
+	D3DXVECTOR3 mPosition;
+	D3DXVECTOR3 mVelocity;
+	float       mLifeTime;
+	float       mAge;
+	D3DXCOLOR   mColor;
+	D3DXCOLOR   mColorFade;
+	bool        mIsAlive;
+};
+
+/// snow on a slope which rises up through the top of its box (the camera in a valley next to a hill)
+class CSlopedSnow: public CPrecipitation
+{
+public:
+	const SParticleArrays& GetArrays(){return mParticles;}
+	/// the ground at x (above the top of a box at 0,0,0 past x=2.5)
+	static float Ground(float x){return x*2;}
+protected:
+	bool CollidesWithGround(){return true;}
+	void GetGroundHeights(int begin,int end)
+	{
+		for(int i=begin;i<end;i++)
+			mGroundHeight[i]=Ground(mParticles.PosX[i]);
+	}
+};
+
+/// the old CParticleSystem::Update()
+static void OldUpdate(std::deque<SOldParticle>& particles,float inDeltaTime)
+{
+	std::deque<SOldParticle>::iterator theIterator = particles.begin( );
+	std::deque<SOldParticle>::iterator theEnd = particles.end( );
+	for( ; theIterator != theEnd; ++theIterator )
+	{
+		if (theIterator->mIsAlive)
+		{
+			theIterator->mPosition += theIterator->mVelocity * inDeltaTime;
+			theIterator->mColor+= theIterator->mColorFade * inDeltaTime;
+			theIterator->mAge+=inDeltaTime;
+			if (theIterator->mAge > theIterator->mLifeTime)
+				theIterator->mIsAlive=false;
+		}
+	}
+	while(particles.empty()==false && particles.front().mIsAlive==false)
+		particles.pop_front();
+}
+
+/// snow falling on a hill higher than its box: it must go back up, never be left in the ground
+static void CheckSnowOnHill(CBench& bench)
+{
+	SeedRandom(37);
+	CSlopedSnow snow;
+	snow.Init(NULL,NULL);
+	snow.SetCentre(D3DXVECTOR3(0,0,0));
+	const float top=snow.GetCentre().y+5;	// (the box is 10 high)
+	int buried=0,parked=0,misplaced=0;
+	for(int f=0;f<200;f++)
+	{
+		snow.Update(1/60.0f);
+		const SParticleArrays& p=snow.GetArrays();
+		for(int i=0;i<snow.GetCount();i++)
+		{
+			float ground=CSlopedSnow::Ground(p.PosX[i]);
+			if (ground>=top)
+			{
+				// (under the hill all the way up, so it waits at the top)
+				if (p.PosY[i]==top)	parked++;
+				else if (p.PosY[i]<ground)	misplaced++;
+			}
+			else if (p.PosY[i]<ground || p.PosY[i]>top)
+				buried++;
+		}
+	}
+	bench.Check(buried==0,"snow which hits the ground goes back up (never into the ground or over the top)");
+	bench.Check(parked>0 && misplaced==0,"snow under a hill above the box waits at the top");
+}
+
+/// the budget cuts down the fire but leaves the snow alone
+static void CheckBudget(CBench& bench)
+{
+	const int BUDGET=1000;
+	CParticleManager manager(1);
+	manager.SetBudget(BUDGET,0);
+	manager.SetChunkSize(0);	// (the smallest there is)
+	SParticleSetting fire;
+	fire.MaxParticles=4000;
+	fire.LifeTime=10;
+	CParticleSystem* pFire=manager.Add(new CParticleSystem());
+	pFire->Init(NULL,NULL,fire);
+	CParticleSystem* pSmoke=manager.Add(new CParticleSystem());	// (the top priority is never cut, so something has to be above the fire)
+	fire.Priority=1;
+	pSmoke->Init(NULL,NULL,fire);
+	CPrecipitation* pSnow=manager.Add(new CPrecipitation());
+	pSnow->Init(NULL,NULL);
+	int snow=pSnow->GetSettings().MaxParticles;
+
+	bool steady=true,under=true;
+	for(int f=0;f<100;f++)
+	{
+		pFire->Emit(200,D3DXVECTOR3(0,0,0),D3DXVECTOR3(0,1,0),1);
+		pSmoke->Emit(5,D3DXVECTOR3(0,0,0),D3DXVECTOR3(0,1,0),1);
+		manager.Update(1/60.0f);
+		if (pSnow->GetCount()!=snow)	steady=false;
+		if (manager.GetBudgetedCount()>BUDGET)	under=false;
+	}
+	bench.Check(under,"the budgeted systems stay within the budget");
+	bench.Check(pFire->GetEmitScale()<1,"the fire was cut down");
+	bench.Check(steady && pSnow->GetEmitScale()==1,"the snow was left alone");
+	bench.Check(manager.GetTotalCount()>BUDGET,"the snow doesn't count towards the budget");
+}
+
+/// particles per ms for Update() against the old deque, from 10k to 1M particles
+static void TimeUpdate(CBench& bench)
+{
+	const int SIZES[]={10000,100000,1000000};
+	const float DT=1/60.0f;
+	bool same=true;
+	for(int s=0;s<3;s++)
+	{
+		int count=SIZES[s];
+		int frames=10000000/count;	// (10M particle updates each)
+		SeedRandom(1);
+		std::deque<SOldParticle> old;
+		CArraySystem system;
+		SParticleSetting settings;
+		settings.MaxParticles=count;
+		settings.LifeTime=1000;
+		system.Init(NULL,NULL,settings);
+		for(int i=0;i<count;i++)
+		{
+			SOldParticle p;
+			p.mPosition=CParticleSystem::GetRandomVector(D3DXVECTOR3(-10,0,-10),D3DXVECTOR3(10,10,10));
+			p.mVelocity=CParticleSystem::GetRandomDirection();
+			p.mLifeTime=1000;
+			p.mAge=0;
+			p.mColor=D3DXCOLOR(1,1,1,1);
+			p.mColorFade=D3DXCOLOR(0,0,0,-0.001f);
+			p.mIsAlive=true;
+			old.push_back(p);
+			system.AddParticle(p.mPosition,p.mVelocity,p.mColor,D3DXCOLOR(1,1,1,0),p.mLifeTime);
+		}
+
+		CBenchTimer timer;
+		for(int f=0;f<frames;f++)
+			OldUpdate(old,DT);
+		double oldMs=timer.GetMs();
+		timer.Start();
+		for(int f=0;f<frames;f++)
+			system.Update(DT);
+		double newMs=timer.GetMs();
+
+		// (the same sums, so the same answers)
+		const SParticleArrays& p=system.GetArrays();
+		for(int i=0;i<count;i+=997)
+		{
+			if (fabsf(p.PosX[i]-old[i].mPosition.x)>1e-3f || fabsf(p.PosY[i]-old[i].mPosition.y)>1e-3f)
+				same=false;
+		}
+		char what[64];
+		sprintf(what,"%dk particles: deque, per ms",count/1000);
+		bench.Report(what,count*(double)frames/oldMs,"");
+		sprintf(what,"%dk particles: arrays, per ms",count/1000);
+		bench.Report(what,count*(double)frames/newMs,"");
+		sprintf(what,"%dk particles: speed up",count/1000);
+		bench.Report(what,oldMs/newMs,"x");
+	}
+	bench.Check(same,"the arrays move the particles the same as the deque");
+}
+
+/// the old CParticleSystem::VaryDirection(), with the old GetRandomFloat()
+static D3DXVECTOR3 OldVaryDirection(const D3DXVECTOR3& vec, float angRad)
+{
+	float yaw=(rand() % 10000) * 0.0001f * 2*angRad-angRad;
+	float pitch=(rand() % 10000) * 0.0001f * 2*angRad-angRad;
+	float roll=(rand() % 10000) * 0.0001f * 2*angRad-angRad;
+	D3DXMATRIX rot;
+	D3DXMatrixRotationYawPitchRoll(&rot,yaw,pitch,roll);
+	D3DXVECTOR3 result;
+	D3DXVec3TransformCoord(&result,&vec,&rot);
+	return result;
+}
+
+/// the cost of each emitted direction: the old way, VaryDirection() & Emit()
+static void TimeEmission(CBench& bench)
+{
+	const int COUNT=1000000;
+	const int REPEATS=7;	// (the old way & Emit() take turns, & each is timed at its best, as the target is checked)
+	const D3DXVECTOR3 AXIS(0,1,0);
+	const float ANGLE=D3DX_PI/8;
+	D3DXVECTOR3 sum(0,0,0);
+
+	SeedRandom(3);
+	bool inside=true;
+	CBenchTimer timer;
+	for(int i=0;i<COUNT;i++)
+	{
+		D3DXVECTOR3 dir=CParticleSystem::VaryDirection(AXIS,ANGLE);
+		if (dir.y<cosf(ANGLE)-1e-4f)	inside=false;
+		sum+=dir;
+	}
+	double varyMs=timer.GetMs();
+
+	// (a system the size of the game's, filled & emptied over & over)
+	const int SYSTEM_SIZE=10000;
+	CArraySystem system;
+	SParticleSetting settings;
+	settings.MaxParticles=SYSTEM_SIZE;
+	system.Init(NULL,NULL,settings);
+	int emitted=0;
+	double oldMs=0,emitMs=0;
+	for(int r=0;r<REPEATS;r++)
+	{
+		timer.Start();
+		for(int i=0;i<COUNT;i++)
+			sum+=OldVaryDirection(AXIS,ANGLE);
+		double ms=timer.GetMs();
+		if (r==0 || ms<oldMs)	oldMs=ms;
+
+		emitted=0;
+		timer.Start();
+		for(int i=0;i<COUNT;i+=1000)
+		{
+			if (system.GetCount()==SYSTEM_SIZE)	system.Clear();
+			system.Emit(1000,D3DXVECTOR3(0,0,0),AXIS,ANGLE);
+			emitted+=1000;
+		}
+		ms=timer.GetMs();
+		if (r==0 || ms<emitMs)	emitMs=ms;
+	}
+	BenchKeep(sum.x+sum.y+sum.z);
+
+	bench.Report("old VaryDirection(), ns per direction",oldMs*1e6/COUNT,"ns");
+	bench.Report("VaryDirection(), ns per direction",varyMs*1e6/COUNT,"ns");
+	bench.Report("Emit() in 1000s, ns per particle",emitMs*1e6/COUNT,"ns");
+	bench.Report("speed up: VaryDirection()",oldMs/varyMs,"x");
+	bench.Report("speed up: Emit() (target 10x)",oldMs/emitMs,"x");
+	bench.Check(inside,"VaryDirection() stays inside the cone");
+	bench.Check(system.GetCount()==SYSTEM_SIZE && emitted==COUNT,"Emit() made them all");
+	bench.Check(oldMs/emitMs>=10,"Emit() is at least 10x the old VaryDirection() per particle");
+
+	// the same seed gives the same directions
+	bool same=true;
+	D3DXVECTOR3 first[100];
+	SeedRandom(11);
+	for(int i=0;i<100;i++)	first[i]=CParticleSystem::VaryDirection(AXIS,ANGLE);
+	SeedRandom(11);
+	for(int i=0;i<100;i++)
+	{
+		if (CParticleSystem::VaryDirection(AXIS,ANGLE)!=first[i])	same=false;
+	}
+	bench.Check(same,"the same seed gives the same directions");
+}
+
+/// for std::sort(), the particle furthest away first
+struct SFurther
+{
+	const float* Depth;
+	bool operator()(int a,int b) const{return Depth[a]>Depth[b];}
+};
+
+/// the depth sort on 50k particles (which must take under 0.5 ms), against std::sort()
+static void TimeDepthSort(CBench& bench)
+{
+	const int COUNT=50000;
+	const int SORTS=100;
+	CArraySystem system;
+	SParticleSetting settings;
+	settings.MaxParticles=COUNT;
+	system.Init(NULL,NULL,settings);
+	SeedRandom(4);
+	system.Emit(COUNT,D3DXVECTOR3(0,0,0),D3DXVECTOR3(0,1,0),D3DX_PI,0,20);
+	system.Update(1);	// (spread them out)
+	D3DXMATRIX view;
+	D3DXVECTOR3 eye(5,3,-30),at(0,0,0),up(0,1,0);
+	D3DXMatrixLookAtLH(&view,&eye,&at,&up);
+
+	CBenchTimer timer;
+	for(int i=0;i<SORTS;i++)
+		system.Sort(view);
+	double sortMs=timer.GetMs()/SORTS;
+
+	// check its a furthest first ordering of all the particles
+	const SParticleArrays& p=system.GetArrays();
+	const std::vector<int>& order=system.GetOrder();
+	std::vector<float> depth(COUNT);
+	for(int i=0;i<COUNT;i++)
+		depth[i]=p.PosX[i]*view._13+p.PosY[i]*view._23+p.PosZ[i]*view._33+view._43;
+	std::vector<bool> seen(COUNT,false);
+	bool all=true,ordered=true;
+	float nearest=*std::min_element(depth.begin(),depth.end()),furthest=*std::max_element(depth.begin(),depth.end());
+	float step=(furthest-nearest)/65535*1.01f;	// (the keys are 16 bit, so particles closer than this may be either way round)
+	for(int i=0;i<COUNT;i++)
+	{
+		if (order[i]<0 || order[i]>=COUNT || seen[order[i]])	all=false;
+		else	seen[order[i]]=true;
+		if (i>0 && depth[order[i]]>depth[order[i-1]]+step)	ordered=false;
+	}
+
+	std::vector<int> index(COUNT);
+	SFurther further={&depth[0]};
+	timer.Start();
+	for(int s=0;s<SORTS;s++)
+	{
+		for(int i=0;i<COUNT;i++)	index[i]=i;
+		std::sort(index.begin(),index.end(),further);
+	}
+	double stdMs=timer.GetMs()/SORTS;
+
+	bench.Report("depth sort 50k, ms",sortMs,"ms");
+	bench.Report("std::sort 50k (for comparison), ms",stdMs,"ms");
+	bench.Check(all && ordered,"the depth sort puts every particle furthest first");
+	bench.Check(sortMs<0.5,"the depth sort of 50k takes under 0.5 ms");
+}
+
+/// fills the systems used for the scaling test (the same particles each time)
+static void FillScalingSystems(std::vector<CParticleSystem*>& systems)
+{
+	const int SYSTEMS=6;	// (as many as the game has)
+	const int PER_SYSTEM=100000;
+	SeedRandom(9);
+	for(int i=0;i<SYSTEMS;i++)
+	{
+		SParticleSetting settings;
+		settings.MaxParticles=PER_SYSTEM;
+		settings.LifeTime=1000;
+		systems[i]->Init(NULL,NULL,settings);
+		systems[i]->Emit(PER_SYSTEM,D3DXVECTOR3((float)i,0,0),D3DXVECTOR3(0,1,0),D3DX_PI/4,1,5);
+	}
+}
+
+/// Update() of 6 systems of 100k particles, one after another & on a CParticleManager with 2, 4 & 8 threads
+static void TimeScaling(CBench& bench)
+{
+	const int FRAMES=50;
+	const float DT=1/60.0f;
+	std::vector<CParticleSystem*> systems(6);
+
+	// one thread: the systems one after another, as the game did before the manager
+	for(unsigned i=0;i<systems.size();i++)
+		systems[i]=new CParticleSystem();
+	FillScalingSystems(systems);
+	CBenchTimer timer;
+	for(int f=0;f<FRAMES;f++)
+		for(unsigned i=0;i<systems.size();i++)
+			systems[i]->Update(DT);
+	double serialMs=timer.GetMs()/FRAMES;
+	unsigned checksum=CParticlePlayer::Checksum(systems);
+	for(unsigned i=0;i<systems.size();i++)
+		delete systems[i];
+	bench.Report("1 thread, ms per frame",serialMs,"ms");
+
+	bool same=true;
+	const int THREADS[]={2,4,8};
+	for(int t=0;t<3;t++)
+	{
+		CParticleManager manager(THREADS[t]-1);	// (the main thread works as well)
+		for(unsigned i=0;i<systems.size();i++)
+			systems[i]=manager.Add(new CParticleSystem());
+		FillScalingSystems(systems);
+		timer.Start();
+		for(int f=0;f<FRAMES;f++)
+			manager.Update(DT);
+		double ms=timer.GetMs()/FRAMES;
+		if (CParticlePlayer::Checksum(systems)!=checksum)	same=false;
+		char what[64];
+		sprintf(what,"%d threads, ms per frame",THREADS[t]);
+		bench.Report(what,ms,"ms");
+		sprintf(what,"%d threads, speed up",THREADS[t]);
+		bench.Report(what,serialMs/ms,"x");
+	}
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	bench.Report("(processors)",info.dwNumberOfProcessors,"");
+	bench.Check(same,"the same particles however many threads");
+}
+
+/// writes size bytes of data to DAMAGED_FILE, returns false on failure
+static bool WriteDamaged(const std::vector<char>& data,size_t size)
+{
+	FILE* pFile=fopen(DAMAGED_FILE,"wb");
+	if (pFile==NULL)	return false;
+	bool ok=(size==0 || fwrite(&data[0],1,size,pFile)==size);
+	fclose(pFile);
+	return ok;
+}
+
+/** The recording cut short at NUM_CUTS places & scribbled on: the replay must stop early, not read off the end.
+\param frames the number of frames in the whole recording
+*/
+static void CheckDamaged(CBench& bench,int frames)
+{
+	std::vector<char> data;
+	FILE* pFile=fopen(RECORDING_FILE,"rb");
+	if (!bench.Check(pFile!=NULL,"recording read back"))	return;
+	char buffer[4096];
+	size_t got;
+	while((got=fread(buffer,1,sizeof(buffer),pFile))>0)
+		data.insert(data.end(),buffer,buffer+got);
+	fclose(pFile);
+
+	CParticlePlayer player;
+	int corrupt=0,cut=0,badReport=0,tooMany=0;
+	for(int c=1;c<=NUM_CUTS;c++)
+	{
+		// (an odd step, so the cuts land all over the events)
+		size_t size=8+(data.size()-8)*c/(NUM_CUTS+1)+c%5;
+		if (!WriteDamaged(data,size) || !player.Load(DAMAGED_FILE))	continue;
+		cut++;
+		bool ok=player.Play();
+		if (player.IsCorrupt())	corrupt++;
+		// a cut between events just ends early, one in the middle of an event must be counted
+		if (ok==player.IsCorrupt() || (player.IsCorrupt() && player.GetMismatches()==0))	badReport++;
+		if ((int)player.GetFrames().size()>=frames)	tooMany++;
+	}
+	bench.Check(cut==NUM_CUTS && tooMany==0,"cut short recordings replay fewer frames");
+	bench.Check(corrupt>0 && badReport==0,"cut short recordings stop with an error & a mismatch");
+
+	// garbage from the middle on (a bad event, id or count, whichever it comes to first) must also stop it
+	std::vector<char> scribbled=data;
+	for(size_t i=scribbled.size()/2;i<scribbled.size();i++)
+		scribbled[i]=(char)0xFF;
+	bool loaded=WriteDamaged(scribbled,scribbled.size()) && player.Load(DAMAGED_FILE);
+	bench.Check(loaded && !player.Play() && player.IsCorrupt() && player.GetMismatches()>0,"a scribbled on recording stops with an error");
+
+	bench.Report("cut short recordings found corrupt",corrupt,"");
+	remove(DAMAGED_FILE);
+}
+
+/// records a few hundred frames of fire, explosions & snow hitting the ground, then replays them
+static void CheckReplay(CBench& bench)
+{
+	const int FRAMES=300;
+	std::vector<CParticleSystem*> live;
+	unsigned liveChecksum;
+	int killed=0;
+	{
+		CParticleManager manager(1);
+		manager.SetBudget(3000,0);	// (so the fire & explosions get cut down as well)
+		SParticleSetting fire;
+		fire.MaxParticles=4000;
+		fire.LifeTime=10;	// (so they only die on the ground)
+		fire.Priority=2;
+		fire.GroundCollision=SParticleSetting::KILL;
+		CParticleSystem* pFire=manager.Add(new CBumpyGround<CParticleSystem>());
+		pFire->Init(NULL,NULL,fire);
+		CExplosion* pExplosion=manager.Add(new CBumpyGround<CExplosion>());
+		pExplosion->Init(NULL,NULL);
+		pExplosion->GetSettings().Priority=1;
+		pExplosion->GetSettings().GroundCollision=SParticleSetting::BOUNCE;
+		CPrecipitation* pSnow=manager.Add(new CBumpyGround<CPrecipitation>());
+		pSnow->Init(NULL,NULL);
+
+		bench.Check(manager.StartRecording(RECORDING_FILE),"recording opened");
+		SeedRandom(7);
+		for(int f=0;f<FRAMES;f++)
+		{
+			float dt=0.01f+(f%7)*0.003f;	// (the frame time wobbles)
+			pFire->Emit(60,D3DXVECTOR3(0,2,0),D3DXVECTOR3(0,-1,0),1.2f,1,3);
+			int before=pFire->GetCount();
+			if (f%20==0)	pExplosion->Explode(D3DXVECTOR3(1,2,1),4,400);
+			if (f%30==5)	pExplosion->Explode(D3DXVECTOR3(-1,2,0),D3DXCOLOR(1,0,0,1),D3DXCOLOR(0,0,1,1),4,300);
+			pSnow->SetCentre(D3DXVECTOR3(f*0.5f,0,0));
+			manager.Update(dt);
+			killed+=before-pFire->GetCount();
+		}
+		manager.StopRecording();
+		live.push_back(pFire);	live.push_back(pExplosion);	live.push_back(pSnow);
+		liveChecksum=CParticlePlayer::Checksum(live);
+	}
+	bench.Check(killed>0,"some of the fire hit the ground");
+
+	CParticlePlayer player;
+	if (!bench.Check(player.Load(RECORDING_FILE),"recording loaded"))	return;
+	player.Play();
+	bench.Check((int)player.GetFrames().size()==FRAMES,"every frame replayed");
+	bench.Check(player.GetMismatches()==0,"replay counts match the recording");
+	bench.Check(player.GetChecksum()==liveChecksum,"replay checksum matches the live systems");
+	CJobPool pool(3);
+	player.Play(&pool,512);
+	bench.Check(player.GetMismatches()==0 && player.GetChecksum()==liveChecksum,"threaded replay matches as well");
+	CheckDamaged(bench,FRAMES);
+	remove(RECORDING_FILE);
+}
+
+void BenchParticles(CBench& bench)
+{
+	CheckReplay(bench);
+	CheckBudget(bench);
+	CheckSnowOnHill(bench);
+	TimeUpdate(bench);
+	TimeEmission(bench);
+	TimeScaling(bench);
+	TimeDepthSort(bench);
+}
@@ -0,0 +1,187 @@
+/*==============================================
+ * Perception Bench
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "Bench.h"
+#include "GameUtils.h"
+#include "Node.h"
+#include "Perception.h"
+#include "Random.h"
+
+// the hearing test: how many agents, over how big an area (& how high), & how many noises
+static const int NUM_LISTENERS=100000;
+static const float LISTENER_AREA=500;
+static const float LISTENER_HEIGHT=20;
+static const int NUM_NOISES=1000;
+static const float HEARING=15;	// (Enemy::HEARING_DISTANCE)
+// the sight test: how many agents, each looking at how many targets, per pass
+static const int NUM_LOOKERS=1000;
+static const int TARGETS_PER_LOOKER=8;
+static const int PASSES=200;
+static const float SIGHT_DEGREES=35;	// (Enemy::ENEMYSIGHT)
+// how close to the edge of the cone an angle may be & still be called either way (rounding)
+static const float ANGLE_SLACK=1e-3f;
+
+/// the ids within radius of centre across the ground, looking at every one (the answer the grid must give)
+static void BruteHear(const std::vector<D3DXVECTOR3>& pos,const D3DXVECTOR3& centre,float radius,std::vector<int>& out)
+{
+	for(int i=0;i<(int)pos.size();i++)
+	{
+		float dx=pos[i].x-centre.x,dz=pos[i].z-centre.z;
+		if (dx*dx+dz*dz<=radius*radius)	out.push_back(i);
+	}
+}
+
+/// the grid finds the same agents as looking at them all, for 1000 noises among 100k agents
+static void CheckHearingGrid(CBench& bench)
+{
+	CRandom random;
+	random.Seed(50);
+	std::vector<D3DXVECTOR3> pos(NUM_LISTENERS);
+	for(int i=0;i<NUM_LISTENERS;i++)
+		pos[i]=D3DXVECTOR3(random.NextFloat(-LISTENER_AREA,LISTENER_AREA),random.NextFloat(0,LISTENER_HEIGHT),
+				random.NextFloat(-LISTENER_AREA,LISTENER_AREA));
+	std::vector<D3DXVECTOR3> noises(NUM_NOISES);
+	for(int n=0;n<NUM_NOISES;n++)
+		noises[n]=D3DXVECTOR3(random.NextFloat(-LISTENER_AREA,LISTENER_AREA),random.NextFloat(0,LISTENER_HEIGHT),
+				random.NextFloat(-LISTENER_AREA,LISTENER_AREA));
+
+	CHearingGrid grid(HEARING);
+	std::vector<std::vector<int> > heard(NUM_NOISES);
+	CBenchTimer timer;
+	for(int i=0;i<NUM_LISTENERS;i++)
+		grid.Add(i,pos[i]);
+	grid.Build();
+	double buildMs=timer.GetMs();
+	timer.Start();
+	for(int n=0;n<NUM_NOISES;n++)
+		grid.Query(noises[n],HEARING,heard[n]);
+	double gridMs=timer.GetMs();
+
+	std::vector<std::vector<int> > brute(NUM_NOISES);
+	timer.Start();
+	for(int n=0;n<NUM_NOISES;n++)
+		BruteHear(pos,noises[n],HEARING,brute[n]);
+	double bruteMs=timer.GetMs();
+
+	// the same agents (in any order), & how many the old 3D distance would have missed
+	bool same=true;
+	int total=0,missed3D=0;
+	for(int n=0;n<NUM_NOISES;n++)
+	{
+		std::sort(heard[n].begin(),heard[n].end());
+		if (heard[n]!=brute[n])	same=false;
+		total+=(int)brute[n].size();
+		for(unsigned i=0;i<brute[n].size();i++)
+		{
+			D3DXVECTOR3 diff=pos[brute[n][i]]-noises[n];
+			if (D3DXVec3Length(&diff)>HEARING)	missed3D++;
+		}
+	}
+	bench.Check(grid.GetCount()==NUM_LISTENERS && same,"CHearingGrid::Query() finds the same agents as looking at them all");
+	bench.Check(total>0,"the noises were heard");
+
+	bench.Report("100k agents: heard by 1000 noises",total,"");
+	bench.Report("100k agents: of which out of range in 3D",missed3D,"");
+	bench.Report("100k agents: build the grid, ms",buildMs,"ms");
+	bench.Report("1000 noises: grid, ms",gridMs,"ms");
+	bench.Report("1000 noises: every agent, ms",bruteMs,"ms");
+	bench.Report("speed up: hearing (including the build)",bruteMs/(buildMs+gridMs),"x");
+}
+
+/// the angle to the target the old way (the yaw against an atan2)
+static float OldAngle(CNode& node,const D3DXVECTOR3& target)
+{
+	return NormalizeAngle(node.mHpr.x-GetDirection(target-node.mPos));
+}
+
+/// Perceive() sees what the old atan2 did (the same side, in sight or not), & time it
+static void CheckPerceive(CBench& bench)
+{
+	CRandom random;
+	random.Seed(50);
+	std::vector<CNode*> nodes;
+	for(int i=0;i<NUM_LOOKERS;i++)
+	{
+		D3DXVECTOR3 pos(random.NextFloat(-100,100),0,random.NextFloat(-100,100));
+		nodes.push_back(new CNode(pos,D3DXVECTOR3(random.NextFloat(-D3DX_PI,D3DX_PI),0,0)));
+	}
+	D3DXVECTOR3 targets[TARGETS_PER_LOOKER];
+	for(int j=0;j<TARGETS_PER_LOOKER;j++)
+		targets[j]=D3DXVECTOR3(random.NextFloat(-120,120),random.NextFloat(0,5),random.NextFloat(-120,120));
+
+	const float sight=D2R(SIGHT_DEGREES),cosSight=cosf(sight);
+	float worst=0;
+	int sideWrong=0,sightWrong=0,inSight=0;
+	for(int i=0;i<NUM_LOOKERS;i++)
+	{
+		D3DXVECTOR3 right,up,forward;
+		nodes[i]->GetBasis(right,up,forward);
+		for(int j=0;j<TARGETS_PER_LOOKER;j++)
+		{
+			SPerception see;
+			Perceive(nodes[i]->mPos,forward,right,targets[j],see);
+			float old=OldAngle(*nodes[i],targets[j]);
+			float diff=fabsf(acosf(see.CosAngle)-fabsf(old));
+			worst=(diff>worst)? diff : worst;
+			// (the old code turned left when old>0, the new one when Side<0)
+			if (fabsf(old)>ANGLE_SLACK && fabsf(old)<D3DX_PI-ANGLE_SLACK && (old>0)!=(see.Side<0))
+				sideWrong++;
+			if (fabsf(fabsf(old)-sight)>ANGLE_SLACK && (fabsf(old)<sight)!=InCone(see,cosSight))
+				sightWrong++;
+			if (InCone(see,cosSight))	inSight++;
+		}
+	}
+	bench.Check(worst<ANGLE_SLACK,"Perceive() gives the same angle as atan2");
+	bench.Check(sideWrong==0 && sightWrong==0,"Perceive() turns the same way & sees the same targets as atan2");
+
+	// (the targets move each pass, so the optimiser can't do them all at once)
+	const double CALLS=(double)NUM_LOOKERS*TARGETS_PER_LOOKER*PASSES;
+	float sum=0;
+	CBenchTimer timer;
+	for(int p=0;p<PASSES;p++)
+		for(int i=0;i<NUM_LOOKERS;i++)
+			for(int j=0;j<TARGETS_PER_LOOKER;j++)
+			{
+				D3DXVECTOR3 target(targets[j].x+p,targets[j].y,targets[j].z);
+				sum+=(GetDeltaDirection(nodes[i]->mHpr.x,GetDirection(target-nodes[i]->mPos))<sight)? 1.0f : 0.0f;
+			}
+	double oldNs=timer.GetMs()*1e6/CALLS;
+	timer.Start();
+	for(int p=0;p<PASSES;p++)
+		for(int i=0;i<NUM_LOOKERS;i++)
+		{
+			D3DXVECTOR3 right,up,forward;
+			nodes[i]->GetBasis(right,up,forward);
+			for(int j=0;j<TARGETS_PER_LOOKER;j++)
+			{
+				D3DXVECTOR3 target(targets[j].x+p,targets[j].y,targets[j].z);
+				SPerception see;
+				Perceive(nodes[i]->mPos,forward,right,target,see);
+				sum-=InCone(see,cosSight)? 1.0f : 0.0f;
+			}
+		}
+	double newNs=timer.GetMs()*1e6/CALLS;
+	bench.Check(sum==0,"the timed loops see the same targets");
+	BenchKeep(sum);
+
+	bench.Report("targets in sight",inSight,"");
+	bench.Report("largest angle difference from atan2, millionths of a radian",worst*1e6,"");
+	bench.Report("atan2 sight check, ns per call",oldNs,"ns");
+	bench.Report("Perceive() sight check (& GetBasis()), ns per call",newNs,"ns");
+	bench.Report("speed up: sight check",oldNs/newNs,"x");
+
+	for(int i=0;i<NUM_LOOKERS;i++)
+		delete nodes[i];
+}
+
+void BenchPerception(CBench& bench)
+{
+	CheckHearingGrid(bench);
+	CheckPerceive(bench);
+}
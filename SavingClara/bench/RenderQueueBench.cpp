@@ -0,0 +1,142 @@
+/*==============================================
+ * Render Queue Bench
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#include <string.h>
+#include <vector>
+#include "Bench.h"
+#include "Random.h"
+#include "RenderQueue.h"
+
+// the state change test: how many draws & how many of each thing they use
+static const int NUM_DRAWS=100000;
+static const int NUM_TEXTURES=3;
+static const int NUM_MATERIALS=4;
+static const int NUM_MESHES=5;
+// more than the old queue could hold (it drew what it had every 0x10000)
+static const int NUM_LAYERED=70000;
+
+/** A render queue without a device, which counts what it would have done.
+The meshes & textures are never used, so they can be any number (see Fake()).
+*/
+class CMockQueue: public CRenderQueue
+{
+public:
+	CMockQueue():CRenderQueue(NULL){Reset();}
+	void Reset()
+	{
+		Textures=Materials=0;
+		Drawn.clear();
+		DrawnTexture.clear();
+		DrawnMaterial.clear();
+		pTexture=NULL;
+		pMaterial=NULL;
+	}
+	int Textures,Materials;	// number of SetTexture() & SetMaterial() calls
+	std::vector<int> Drawn;	// the subset of each draw, in order
+	std::vector<IDirect3DTexture9*> DrawnTexture;	// & what the device had for it
+	std::vector<const D3DMATERIAL9*> DrawnMaterial;
+	IDirect3DTexture9* pTexture;	// what the device has
+	const D3DMATERIAL9* pMaterial;
+protected:
+	void SetTexture(IDirect3DTexture9* pTex){Textures++;pTexture=pTex;}
+	void SetMaterial(const D3DMATERIAL9* pMat){Materials++;pMaterial=pMat;}
+	void SetWorld(const D3DXMATRIX&){}
+	void DrawSubset(ID3DXMesh*,int subset)
+	{
+		Drawn.push_back(subset);
+		DrawnTexture.push_back(pTexture);
+		DrawnMaterial.push_back(pMaterial);
+	}
+};
+
+/// a pointer to stand in for a device object (never used)
+template<class T>
+static T* Fake(int n){return (T*)(size_t)(0x1000*(n+1));}
+
+/// a queue of draws in a random order, should only change the texture & material for each new combination
+static void CheckStateChanges(CBench& bench)
+{
+	D3DMATERIAL9 materials[NUM_MATERIALS];
+	for(int m=0;m<NUM_MATERIALS;m++)
+	{
+		memset(&materials[m],0,sizeof(D3DMATERIAL9));
+		materials[m].Power=(float)m;	// (all different)
+	}
+	CRandom random;
+	random.Seed(46);
+	CMockQueue queue;
+	D3DXMATRIX world;
+	D3DXMatrixIdentity(&world);
+	// what it would cost drawing them as they come
+	int unsortedTextures=0,unsortedMaterials=0;
+	int lastTexture=-1,lastMaterial=-1;
+	std::vector<int> textureOf(NUM_DRAWS),materialOf(NUM_DRAWS);
+	for(int i=0;i<NUM_DRAWS;i++)
+	{
+		int t=random.Next()%NUM_TEXTURES,m=random.Next()%NUM_MATERIALS;
+		queue.Add(Fake<ID3DXMesh>(random.Next()%NUM_MESHES),i,&materials[m],Fake<IDirect3DTexture9>(t),world);
+		textureOf[i]=t;
+		materialOf[i]=m;
+		if (t!=lastTexture)	unsortedTextures++;
+		if (m!=lastMaterial)	unsortedMaterials++;
+		lastTexture=t;
+		lastMaterial=m;
+	}
+
+	CBenchTimer timer;
+	queue.Flush();
+	double ms=timer.GetMs();
+
+	// each draw (the subset is its number) must have had its own texture & material
+	std::vector<bool> drawn(NUM_DRAWS,false);
+	bool right=((int)queue.Drawn.size()==NUM_DRAWS);
+	for(int d=0;d<(int)queue.Drawn.size() && right;d++)
+	{
+		int i=queue.Drawn[d];
+		if (drawn[i] || queue.DrawnTexture[d]!=Fake<IDirect3DTexture9>(textureOf[i]) ||
+				memcmp(queue.DrawnMaterial[d],&materials[materialOf[i]],sizeof(D3DMATERIAL9))!=0)
+			right=false;
+		drawn[i]=true;
+	}
+	const SRenderStats& stats=queue.GetStats();
+	bench.Check(queue.Textures==NUM_TEXTURES && queue.Materials==NUM_TEXTURES*NUM_MATERIALS,
+			"one texture change per texture, one material change per texture & material");
+	bench.Check(stats.TextureChanges==queue.Textures && stats.MaterialChanges==queue.Materials && stats.Draws==NUM_DRAWS,
+			"the stats match what the device was told");
+	bench.Check(right,"every draw was made once, with its texture & material");
+
+	bench.Report("100k draws: texture changes, as added",unsortedTextures,"");
+	bench.Report("100k draws: texture changes, queued",queue.Textures,"");
+	bench.Report("100k draws: material changes, as added",unsortedMaterials,"");
+	bench.Report("100k draws: material changes, queued",queue.Materials,"");
+	bench.Report("100k draws: Flush() (sort & mock draws), ms",ms,"ms");
+}
+
+/// more draws than the queue used to hold, the layers must still be drawn in order
+static void CheckLayers(CBench& bench)
+{
+	CMockQueue queue;
+	D3DXMATRIX world;
+	D3DXMatrixIdentity(&world);
+	D3DMATERIAL9 material;
+	memset(&material,0,sizeof(material));
+	// lots on layer 1 (all the same, so they should stay in order), then one on layer 0
+	for(int i=0;i<NUM_LAYERED;i++)
+		queue.Add(Fake<ID3DXMesh>(0),i+1,&material,NULL,world,1);
+	queue.Add(Fake<ID3DXMesh>(0),0,&material,NULL,world,0);
+	bench.Check(queue.Drawn.empty() && queue.GetCount()==NUM_LAYERED+1,"nothing is drawn before Flush()");
+	queue.Flush();
+	bool ordered=((int)queue.Drawn.size()==NUM_LAYERED+1);
+	for(int i=0;i<(int)queue.Drawn.size() && ordered;i++)
+		if (queue.Drawn[i]!=i)	ordered=false;
+	bench.Check(ordered,"70k draws: layer 0 first, then the rest in the order added");
+}
+
+void BenchRenderQueue(CBench& bench)
+{
+	CheckStateChanges(bench);
+	CheckLayers(bench);
+}
@@ -0,0 +1,150 @@
+/*==============================================
+ * Shot Bench
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#include <set>
+#include <vector>
+#include "Bench.h"
+#include "ParticleSystem.h"
+#include "Random.h"
+#include "Shot.h"
+
+// a million shots, in as many full stores as it takes
+static const int NUM_SHOTS=1<<20;
+static const int SHOTS_PER_STORE=0x10000;
+static const int NUM_STORES=NUM_SHOTS/SHOTS_PER_STORE;
+static const int FRAMES=10;
+static const float DT=1/60.0f;
+// the trails: shots fired each frame & how long for
+static const int TRAIL_SHOTS=8;
+static const int TRAIL_FRAMES=600;
+
+/// a million shots in stores against a million CShot's
+static void TimeMillion(CBench& bench)
+{
+	CRandom random;
+	random.Seed(41);
+	// the old way: each shot new'ed & moved by its virtual Update()
+	std::vector<CShot*> oldShots;
+	oldShots.reserve(NUM_SHOTS);
+	std::vector<CShotStore*> stores;
+	for(int s=0;s<NUM_STORES;s++)
+		stores.push_back(new CShotStore(SHOTS_PER_STORE));
+	bool added=true;
+	for(int i=0;i<NUM_SHOTS;i++)
+	{
+		D3DXVECTOR3 pos(random.NextFloat(-100,100),1,random.NextFloat(-100,100));
+		D3DXVECTOR3 vel(random.NextFloat(-10,10),0,random.NextFloat(-10,10));
+		float life=(i&1)? 100.0f : 1.5f*DT;	// (half of them die after 2 frames)
+		CShot* pShot=new CShot();
+		pShot->Init(NULL,pos,D3DXVECTOR3(0,0,0),0.3f,(int)(life*1000));
+		pShot->mVel=vel;
+		oldShots.push_back(pShot);
+		if (stores[i/SHOTS_PER_STORE]->Add(NULL,pos,D3DXVECTOR3(0,0,0),vel,0.3f,life)==NULL_SHOT)
+			added=false;
+	}
+	bench.Check(added,"the stores hold a million shots");
+
+	CBenchTimer timer;
+	for(int f=0;f<FRAMES;f++)
+		for(int i=0;i<NUM_SHOTS;i++)
+			oldShots[i]->Update(DT);
+	double oldMs=timer.GetMs()/FRAMES;
+	timer.Start();
+	for(int f=0;f<FRAMES;f++)
+		for(int s=0;s<NUM_STORES;s++)
+			stores[s]->Update(DT);
+	double newMs=timer.GetMs()/FRAMES;
+
+	// the same places as the old way
+	bool same=true;
+	for(int i=0;i<NUM_SHOTS;i++)
+	{
+		D3DXVECTOR3 diff=stores[i/SHOTS_PER_STORE]->GetPos(i%SHOTS_PER_STORE)-oldShots[i]->GetPos();
+		if (D3DXVec3LengthSq(&diff)>1e-6f)	same=false;
+	}
+	bench.Check(same,"the stores move the shots as CShot::Update() did");
+
+	// remove the half which are dead
+	timer.Start();
+	RemoveDead(oldShots);
+	double oldRemoveMs=timer.GetMs();
+	timer.Start();
+	int left=0;
+	for(int s=0;s<NUM_STORES;s++)
+	{
+		stores[s]->RemoveDead();
+		left+=stores[s]->GetCount();
+	}
+	double removeMs=timer.GetMs();
+	bench.Check(left==NUM_SHOTS/2 && (int)oldShots.size()==NUM_SHOTS/2,"RemoveDead() leaves the living half");
+
+	bench.Report("1M shots: CShot* update, ms per frame",oldMs,"ms");
+	bench.Report("1M shots: store update, ms per frame",newMs,"ms");
+	bench.Report("speed up: update",oldMs/newMs,"x");
+	bench.Report("1M shots: RemoveDead(CShot*) half, ms",oldRemoveMs,"ms");
+	bench.Report("1M shots: store RemoveDead() half, ms",removeMs,"ms");
+
+	for(int s=0;s<NUM_STORES;s++)
+		delete stores[s];
+	for(unsigned i=0;i<oldShots.size();i++)
+		delete oldShots[i];
+}
+
+/// shots with trails, fired & dying for 10 seconds, should only ever use the reserved emitters
+static void TimeTrails(CBench& bench)
+{
+	CRandom random;
+	random.Seed(42);
+	SParticleSetting settings;
+	settings.MaxParticles=5000;
+	CParticleSystem system;
+	system.Init(NULL,NULL,settings);
+	CShotStore store;
+	system.ReserveEmitters(store.GetCapacity());
+	// (see which emitters were made)
+	std::set<CParticleEmitter*> reserved;
+	for(int i=0;i<store.GetCapacity();i++)
+		reserved.insert(system.AddEmitter(SEmitterSetting()));
+	system.ClearEmitters();
+	SEmitterSetting trail;
+	trail.Rate=100;
+	trail.Direction=D3DXVECTOR3(0,0,-1);
+	trail.LocalDirection=true;
+
+	std::set<CParticleEmitter*> used;
+	int trails=0,reused=0;
+	CBenchTimer timer;
+	for(int f=0;f<TRAIL_FRAMES;f++)
+	{
+		for(int i=0;i<TRAIL_SHOTS;i++)
+		{
+			D3DXVECTOR3 hpr(random.NextFloat(-D3DX_PI,D3DX_PI),0,0);
+			ShotHandle shot=store.Add(NULL,D3DXVECTOR3(0,1,0),hpr,D3DXVECTOR3(0,0,20),0.3f,random.NextFloat(0.1f,0.5f));
+			CParticleEmitter* pEmitter=store.AddEmitter(&system,trail,shot);
+			if (pEmitter)
+			{
+				if (reserved.count(pEmitter))	reused++;
+				used.insert(pEmitter);
+				trails++;
+			}
+		}
+		store.Update(DT);
+		system.Update(DT);
+		store.RemoveDead();
+	}
+	double ms=timer.GetMs()/TRAIL_FRAMES;
+	bench.Check(trails==TRAIL_SHOTS*TRAIL_FRAMES,"every shot got a trail");
+	bench.Check(reused==trails,"the trails only use the reserved emitters");
+	bench.Report("trails added",trails,"");
+	bench.Report("different emitters used",(double)used.size(),"");
+	bench.Report("shots with trails, ms per frame",ms,"ms");
+}
+
+void BenchShots(CBench& bench)
+{
+	TimeMillion(bench);
+	TimeTrails(bench);
+}
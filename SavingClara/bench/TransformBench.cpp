@@ -0,0 +1,120 @@
+/*==============================================
+ * Transform Bench
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#include <math.h>
+#include <vector>
+#include "Bench.h"
+#include "Random.h"
+#include "Transform.h"
+
+// how many objects & how many times they are all built
+static const int NUM_TRANSFORMS=100000;
+static const int BUILDS=20;
+
+/// the world matrix the way D3DX does it (& CMeshNode::Draw used to)
+static void OldWorld(const D3DXVECTOR3& pos,const D3DXVECTOR3& hpr,float scale,D3DXMATRIX& out)
+{
+	D3DXMATRIX scl,rot,trans;
+	D3DXMatrixScaling(&scl,scale,scale,scale);
+	D3DXMatrixRotationYawPitchRoll(&rot,hpr.x,hpr.y,hpr.z);
+	D3DXMatrixTranslation(&trans,pos.x,pos.y,pos.z);
+	out=scl*rot*trans;
+}
+
+/// the biggest difference between any two elements
+static float MaxDifference(const D3DXMATRIX& a,const D3DXMATRIX& b)
+{
+	float worst=0;
+	for(int i=0;i<16;i++)
+		worst=(fabsf(a[i]-b[i])>worst)? fabsf(a[i]-b[i]) : worst;
+	return worst;
+}
+
+/// 100k world matrices with BuildWorldMatrices() against D3DX
+static void TimeWorldMatrices(CBench& bench)
+{
+	CRandom random;
+	random.Seed(44);
+	std::vector<D3DXVECTOR3> pos(NUM_TRANSFORMS),hpr(NUM_TRANSFORMS);
+	std::vector<float> scale(NUM_TRANSFORMS);
+	CTransformBatch batch;
+	for(int i=0;i<NUM_TRANSFORMS;i++)
+	{
+		pos[i]=D3DXVECTOR3(random.NextFloat(-500,500),random.NextFloat(0,50),random.NextFloat(-500,500));
+		hpr[i]=D3DXVECTOR3(random.NextFloat(-20,20),random.NextFloat(-20,20),random.NextFloat(-20,20));
+		scale[i]=random.NextFloat(0.1f,4);
+		batch.Add(pos[i],hpr[i],scale[i]);
+	}
+
+	std::vector<D3DXMATRIX> old(NUM_TRANSFORMS);
+	CBenchTimer timer;
+	for(int b=0;b<BUILDS;b++)
+		for(int i=0;i<NUM_TRANSFORMS;i++)
+			OldWorld(pos[i],hpr[i],scale[i]+b*0.001f,old[i]);	// (a different scale each time, so they can't be skipped)
+	double oldMs=timer.GetMs()/BUILDS;
+	timer.Start();
+	for(int b=0;b<BUILDS;b++)
+		batch.Build();
+	double newMs=timer.GetMs()/BUILDS;
+	BenchKeep(old[0]._42+batch.GetMatrix(0)._42);
+
+	float worst=0,worstScaled=0;
+	for(int i=0;i<NUM_TRANSFORMS;i++)
+	{
+		OldWorld(pos[i],hpr[i],scale[i],old[i]);
+		float diff=MaxDifference(old[i],batch.GetMatrix(i));
+		worst=(diff>worst)? diff : worst;
+		worstScaled=(diff/scale[i]>worstScaled)? diff/scale[i] : worstScaled;
+	}
+	bench.Check(worstScaled<1e-5f,"BuildWorldMatrices() matches D3DX (angles up to 20 radians)");
+
+	bench.Report("100k world matrices: D3DX, ms",oldMs,"ms");
+	bench.Report("100k world matrices: BuildWorldMatrices(), ms",newMs,"ms");
+	bench.Report("speed up: world matrices",oldMs/newMs,"x");
+	bench.Report("largest difference from D3DX, millionths",worst*1e6,"");
+}
+
+/// the instances must put points where D3DX would (as the instancing shader uses them), & time packing 100k
+static void CheckPackInstances(CBench& bench)
+{
+	CRandom random;
+	random.Seed(47);
+	std::vector<D3DXMATRIX> worlds(NUM_TRANSFORMS);
+	for(int i=0;i<NUM_TRANSFORMS;i++)
+	{
+		D3DXVECTOR3 pos(random.NextFloat(-500,500),random.NextFloat(0,50),random.NextFloat(-500,500));
+		D3DXVECTOR3 hpr(random.NextFloat(-20,20),random.NextFloat(-20,20),random.NextFloat(-20,20));
+		OldWorld(pos,hpr,random.NextFloat(0.1f,4),worlds[i]);
+	}
+	std::vector<SMeshInstance> instances(NUM_TRANSFORMS);
+	CBenchTimer timer;
+	for(int b=0;b<BUILDS;b++)
+		PackInstances(&worlds[0],NUM_TRANSFORMS,&instances[0]);
+	double ms=timer.GetMs()/BUILDS;
+
+	// as the shader: x=dot(pos,X), y=dot(pos,Y), z=dot(pos,Z)
+	float worst=0;
+	for(int i=0;i<NUM_TRANSFORMS;i++)
+	{
+		D3DXVECTOR3 local(random.NextFloat(-2,2),random.NextFloat(-2,2),random.NextFloat(-2,2));
+		D3DXVECTOR4 p(local.x,local.y,local.z,1);
+		D3DXVECTOR3 shader(D3DXVec4Dot(&p,&instances[i].X),D3DXVec4Dot(&p,&instances[i].Y),D3DXVec4Dot(&p,&instances[i].Z));
+		D3DXVECTOR3 d3dx;
+		D3DXVec3TransformCoord(&d3dx,&local,&worlds[i]);
+		D3DXVECTOR3 diff=shader-d3dx;
+		float len=D3DXVec3Length(&diff);
+		worst=(len>worst)? len : worst;
+	}
+	bench.Check(worst<1e-3f,"PackInstances() puts the points where D3DXVec3TransformCoord() does");
+	bench.Report("100k instances: PackInstances(), ms",ms,"ms");
+	bench.Report("largest point difference from D3DX, millionths",worst*1e6,"");
+}
+
+void BenchTransform(CBench& bench)
+{
+	TimeWorldMatrices(bench);
+	CheckPackInstances(bench);
+}
@@ -0,0 +1,232 @@
+/*==============================================
+ * AI Scheduler
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#include <math.h>
+#include <algorithm>
+#include "AIScheduler.h"
+
+// beyond these distances from the player the enemies are updated less often
+const float NEAR_DISTANCE=30,MID_DISTANCE=60,FAR_DISTANCE=120;
+// the time between updates: 10, 5 & 2 times a second
+const float MID_INTERVAL=1/10.0f,FAR_INTERVAL=1/5.0f,DISTANT_INTERVAL=1/2.0f;
+// the longest dt an enemy is given (so one which has been waiting a while doesn't jump)
+const float MAX_ENEMY_DT=0.5f;
+// number of enemies picked between looking at the clock
+const int CLOCK_CHECK=16;
+// the part of the budget which may be spent looking for enemies which are due (the rest is for updating them)
+const float PICK_SHARE=0.25f;
+// enemies per job: enough to make the job worth handing out
+const int AI_CHUNK_SIZE=256;
+
+CAIScheduler::CAIScheduler(float budget)
+	:mHearing((float)Enemy::HEARING_DISTANCE)
+{
+	mBudget=budget;
+	mCostPerUpdate=0;
+	mClock=DISTANT_INTERVAL;	// (so a spread out last update is never <0, which means never)
+	mNextId=0;
+	mMaxUpdates=0;
+	mSeed=0;
+	mSeeded=false;
+	mOverBudget=false;
+	mUpdateTime=0;
+	mPlayerDamage=0;
+	mpPool=NULL;
+	QueryPerformanceFrequency(&mTimerFreq);
+}
+
+void CAIScheduler::Seed(unsigned seed)
+{
+	mSeed=seed;
+	mSeeded=true;
+}
+
+void CAIScheduler::Alert(const D3DXVECTOR3& pos)
+{
+	mNewNoises.push_back(pos);
+}
+
+float CAIScheduler::GetInterval(Enemy* pEnemy,const D3DXVECTOR3& playerPos)
+{
+	if (pEnemy->IsEngaged())	return 0;	// (its fighting, so it must keep up)
+	D3DXVECTOR3 diff=pEnemy->GetPos()-playerPos;
+	float dist2=D3DXVec3LengthSq(&diff);
+	if (dist2<NEAR_DISTANCE*NEAR_DISTANCE)	return 0;
+	if (dist2<MID_DISTANCE*MID_DISTANCE)	return MID_INTERVAL;
+	if (dist2<FAR_DISTANCE*FAR_DISTANCE)	return FAR_INTERVAL;
+	return DISTANT_INTERVAL;
+}
+
+void CAIScheduler::Wake(Enemy* pEnemy)
+{
+	if (pEnemy->mNextDue>=0 && pEnemy->mNextDue>mClock)	Schedule(pEnemy,mClock);
+}
+
+void CAIScheduler::Schedule(Enemy* pEnemy,float due)
+{
+	// (if its already queued, the old entry is left to be thrown away when it comes up, see PickDue)
+	pEnemy->mNextDue=due;
+	SQueued queued={due,pEnemy->mId,pEnemy};
+	mQueue.push_back(queued);
+	std::push_heap(mQueue.begin(),mQueue.end());
+}
+
+void CAIScheduler::AddNew(std::vector<Enemy*>& enemies)
+{
+	// the new ones are on the end of the store (in mId order), so only they are looked at
+	int first=(int)enemies.size();
+	while(first>0 && enemies[first-1]->mId>=mNextId)
+		first--;
+	for(int i=first;i<(int)enemies.size();i++)
+	{
+		Schedule(enemies[i],mClock);	// (new, so due now)
+		mNextId=enemies[i]->mId+1;
+	}
+}
+
+void CAIScheduler::PickDue(float dt)
+{
+	LARGE_INTEGER start,now;
+	QueryPerformanceCounter(&start);
+	mDue.clear();
+	mOverBudget=false;
+	// as many as allowed, & (unless its to be repeatable) as many as the last few frames say there is time for
+	unsigned maxDue=(mMaxUpdates>0)? (unsigned)mMaxUpdates : 0xFFFFFFFF;
+	const bool timed=(mBudget>0 && !mSeeded);
+	if (timed && mCostPerUpdate>0)
+	{
+		unsigned inTime=(unsigned)(mBudget*(1-PICK_SHARE)/mCostPerUpdate)+1;
+		if (inTime<maxDue)	maxDue=inTime;
+	}
+
+	// (half a frame early is closer than a frame late)
+	const float dueBy=mClock+dt*0.5f;
+	int picked=0;
+	while(!mQueue.empty() && mQueue.front().Due<=dueBy)
+	{
+		if (mDue.size()>=maxDue)
+		{
+			// out of time: the rest have been due longest, so they go first next frame
+			mOverBudget=true;
+			break;
+		}
+		if (timed && ++picked%CLOCK_CHECK==0)
+		{
+			QueryPerformanceCounter(&now);
+			if ((float)(now.QuadPart-start.QuadPart)/mTimerFreq.QuadPart>mBudget*PICK_SHARE)
+			{
+				mOverBudget=true;
+				break;
+			}
+		}
+		SQueued queued=mQueue.front();
+		std::pop_heap(mQueue.begin(),mQueue.end());
+		mQueue.pop_back();
+		Enemy* pEnemy=queued.pEnemy;
+		// throw away the removed, the dead & the ones which have been moved (see Wake)
+		if (pEnemy->mId!=queued.Id || pEnemy->mNextDue!=queued.Due || pEnemy->IsAlive()==false)
+			continue;
+
+		SDue due={pEnemy,dt,mClock};
+		if (pEnemy->mLastUpdate<0)
+			pEnemy->mRandom.Seed(mSeed+pEnemy->mId*0x9E3779B9);	// new: seed it (see Seed)
+		else
+		{
+			float since=mClock-pEnemy->mLastUpdate;
+			due.Dt=(since>MAX_ENEMY_DT)? MAX_ENEMY_DT : since;
+		}
+		pEnemy->mNextDue=-1;	// (until its rescheduled, after its update)
+		mDue.push_back(due);
+	}
+}
+
+void CAIScheduler::Hear(std::vector<Enemy*>& enemies)
+{
+	if (mNewNoises.empty())	return;
+	// put the living enemies in the grid, then each noise only looks at the ones near it
+	mHearing.Clear();
+	for(unsigned i=0;i<enemies.size();i++)
+	{
+		if (enemies[i]->IsAlive())
+			mHearing.Add(i,enemies[i]->GetPos());
+	}
+	mHearing.Build();
+	for(unsigned n=0;n<mNewNoises.size();n++)
+	{
+		mHeard.clear();
+		mHearing.Query(mNewNoises[n],(float)Enemy::HEARING_DISTANCE,mHeard);
+		for(unsigned i=0;i<mHeard.size();i++)
+		{
+			enemies[mHeard[i]]->mHeardNoise=true;	// (it acts on it when its next updated)
+			Wake(enemies[mHeard[i]]);	// (which is now)
+		}
+	}
+	mNewNoises.clear();
+}
+
+void CAIScheduler::UpdateChunk(void* pData,int begin,int end)
+{
+	CAIScheduler* pThis=(CAIScheduler*)pData;
+	for(int i=begin;i<end;i++)
+	{
+		const SDue& due=pThis->mDue[i];
+		due.pEnemy->Update(pThis->mWorld,due.Dt);
+	}
+}
+
+void CAIScheduler::Update(CEnemyStore& enemies,const D3DXVECTOR3& playerPos,float dt)
+{
+	LARGE_INTEGER start,now;
+	QueryPerformanceCounter(&start);
+	mClock+=dt;
+
+	AddNew(enemies.GetEnemies());
+	Hear(enemies.GetEnemies());
+	PickDue(dt);
+	LARGE_INTEGER picked;
+	QueryPerformanceCounter(&picked);
+
+	// update them all (they only change themselves)
+	mWorld.PlayerPos=playerPos;
+	const int count=(int)mDue.size();
+	if (mpPool)
+	{
+		for(int i=0;i<count;i+=AI_CHUNK_SIZE)
+			mpPool->Add(UpdateChunk,this,i,(i+AI_CHUNK_SIZE<count)?i+AI_CHUNK_SIZE:count);
+		mpPool->Wait();
+	}
+	else
+		UpdateChunk(this,0,count);
+
+	// then collect up what they did, in order (so the total is the same every time)
+	// & decide when they are next due, now they have moved & thought
+	mPlayerDamage=0;
+	for(int i=0;i<count;i++)
+	{
+		Enemy* pEnemy=mDue[i].pEnemy;
+		mPlayerDamage+=pEnemy->TakePlayerDamage();
+		float interval=GetInterval(pEnemy,playerPos);
+		if (pEnemy->mLastUpdate<0)
+		{
+			// new: spread the next updates out (otherwise all the far ones would be due on the same frame)
+			float spread=pEnemy->mId*0.618034f;	// (the golden ratio spreads them evenly)
+			pEnemy->mLastUpdate=mClock-interval*(spread-floorf(spread));
+		}
+		else
+			pEnemy->mLastUpdate=mDue[i].LastUpdate;
+		if (pEnemy->IsAlive())
+			Schedule(pEnemy,pEnemy->mLastUpdate+interval);
+	}
+
+	QueryPerformanceCounter(&now);
+	mUpdateTime=(float)(now.QuadPart-start.QuadPart)/mTimerFreq.QuadPart;
+	if (count>0)
+	{
+		// smoothed, so one slow frame doesn't halve the next
+		float cost=(float)(now.QuadPart-picked.QuadPart)/mTimerFreq.QuadPart/count;
+		mCostPerUpdate=(mCostPerUpdate>0)? mCostPerUpdate*0.9f+cost*0.1f : cost;
+	}
+}
@@ -0,0 +1,134 @@
+/*==============================================
+ * AI Scheduler
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#pragma once
+
+#include <vector>
+#include "Enemy.h"
+#include "JobPool.h"
+#include "Perception.h"
+
+/** Decides which enemies think each frame, & updates them (in parallel if it has a CJobPool).
+Enemies near the player, or after the player (see Enemy::IsEngaged()), are updated every frame.
+Ones further away are updated less often: 10 times a second, then 5, down to 2 for the far ones.
+Each is given the time since its own last update as its dt, so they still move at the right speed.
+The enemies wait in a queue by when they are next due (worked out when they are updated),
+so each frame only looks at the ones which are due, not at every enemy.
+As the interval is decided when an enemy is updated, one which is hit (see Wake()) or hears a noise
+is moved to the front, rather than waiting out an interval it no longer deserves.
+
+There is also a budget: each frame takes the enemies which have been due the longest first,
+& stops when the budget is spent. So the AI costs about the same however many monsters there are,
+& the ones left over are first in line next frame (no one is starved).
+The budget is a time (see SetBudget()), unless the scheduler has been seeded, then its a number of updates
+(see SetMaxUpdates()), as how long they take is different every run.
+
+The enemies only read the world (SEnemyWorld) & write themselves, so they can be updated at the same time.
+What they do to the world is collected up afterwards: the damage they do to the player is added up (in order)
+for GetPlayerDamage(). The noises posted with Alert() are handed out before they are updated,
+to the enemies within Enemy::HEARING_DISTANCE (found with a CHearingGrid, so each noise only looks at the ones nearby).
+Each enemy has its own random numbers, seeded from Seed() & its Enemy::mId, so the same seed gives the same game
+(whichever thread updates which enemy, & in whatever order they were first updated).
+\code
+mAI.SetJobPool(&mpParticles->GetJobPool());
+mAI.Seed(1);
+mAI.SetMaxUpdates(2000);	// (the budget for a seeded game)
+...
+mAI.Alert(playerPos);	// when the player fires
+...
+mAI.Update(mEnemies,playerPos,dt);	// (a CEnemyStore) rather than each mEnemies[i]->Update(...)
+mPlayer.Damage(mAI.GetPlayerDamage());
+\endcode
+*/
+class CAIScheduler
+{
+public:
+	/** Constructor.
+	\param budget the most time for Update() in seconds (0 for no limit)
+	*/
+	CAIScheduler(float budget=0.002f);
+	/// sets the most time for Update() in seconds (0 for no limit), not used once seeded
+	void SetBudget(float budget){mBudget=budget;}
+	/// sets the most enemies updated in one Update() (0 for no limit), used whether seeded or not
+	void SetMaxUpdates(int count){mMaxUpdates=count;}
+	/// sets the pool to update the enemies on (NULL to update them one after another on this thread)
+	void SetJobPool(CJobPool* pPool){mpPool=pPool;}
+	/** Seeds the enemies' random numbers & makes the game repeatable.
+	Each enemy is seeded from this & its Enemy::mId when it is first updated.
+	From now on the time budget is not used (only SetMaxUpdates()), so the same seed gives the same game.
+	*/
+	void Seed(unsigned seed);
+	/// whether Seed() has been called (so the budget is the number of updates, not the time)
+	bool IsSeeded(){return mSeeded;}
+
+	/// the player has made a noise (eg. fired), enemies close enough will hear it on their next update
+	void Alert(const D3DXVECTOR3& pos);
+	/// the enemy has been disturbed (eg. hit by the player), so update it on the next Update()
+	void Wake(Enemy* pEnemy);
+	/// updates the living enemies which are due (if there is the time)
+	void Update(CEnemyStore& enemies,const D3DXVECTOR3& playerPos,float dt);
+	/// the damage the enemies did to the player in the last Update()
+	float GetPlayerDamage(){return mPlayerDamage;}
+	/** How long to leave between updates of an enemy.
+	\param pEnemy the enemy
+	\param playerPos where the player is
+	\return the time in seconds (0 for every frame)
+	*/
+	static float GetInterval(Enemy* pEnemy,const D3DXVECTOR3& playerPos);
+
+	/// number of enemies updated in the last Update()
+	int GetUpdated(){return (int)mDue.size();}
+	/// whether the last Update() ran out of time before it got round them all
+	bool WasOverBudget(){return mOverBudget;}
+	/// how long the last Update() took in seconds
+	float GetUpdateTime(){return mUpdateTime;}
+private:
+	/// \internal an enemy to update this frame
+	struct SDue
+	{
+		Enemy* pEnemy;
+		float Dt;
+		float LastUpdate;	// what to set its mLastUpdate to afterwards
+	};
+	/// \internal an enemy waiting in mQueue
+	struct SQueued
+	{
+		float Due;	// when its next due (the same as its mNextDue, unless its been moved since)
+		unsigned Id;	// its mId (its space may be reused by another enemy once its removed)
+		Enemy* pEnemy;
+		/// for the heap: the one due soonest at the front (by id if they are the same, so the order is repeatable)
+		bool operator<(const SQueued& other) const{return Due>other.Due || (Due==other.Due && Id>other.Id);}
+	};
+	/// \internal the job which updates mDue[begin..end)
+	static void UpdateChunk(void* pData,int begin,int end);
+	/// \internal tells the enemies near the new noises they heard them
+	void Hear(std::vector<Enemy*>& enemies);
+	/// \internal puts the enemy in the queue, due at this time
+	void Schedule(Enemy* pEnemy,float due);
+	/// \internal queues the enemies added to the store since the last Update()
+	void AddNew(std::vector<Enemy*>& enemies);
+	/// \internal picks the enemies to update into mDue
+	void PickDue(float dt);
+
+	float mBudget;	// max time for Update (0 for none)
+	float mCostPerUpdate;	// how long each update has been taking (for the budget)
+	float mClock;	// the time since the scheduler started (for Enemy::mLastUpdate)
+	std::vector<SQueued> mQueue;	// the enemies by when they are due (a heap)
+	unsigned mNextId;	// the first Enemy::mId which isn't queued yet
+	int mMaxUpdates;	// max enemies per Update (0 for no limit)
+	unsigned mSeed;
+	bool mSeeded;	// whether Seed has been called (no time budget)
+	bool mOverBudget;
+	float mUpdateTime;
+	float mPlayerDamage;
+	std::vector<SDue> mDue;
+	std::vector<D3DXVECTOR3> mNewNoises;	// noises since the last Update
+	CHearingGrid mHearing;	// the living enemies, when there are noises to hear
+	std::vector<int> mHeard;	// the enemies near a noise
+	SEnemyWorld mWorld;	// what the enemies see this frame
+	CJobPool* mpPool;
+	LARGE_INTEGER mTimerFreq;
+};
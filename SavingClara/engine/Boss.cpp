@@ -4,6 +4,11 @@
 #include "ConsoleOutput.h"
 #include <sstream>
 
+//  where the boss waits for the player
+static const D3DXVECTOR3 HOME(-165,0,125);
+
+const float Boss::COS_AIMED = cosf(D2R(Boss::ROTSPEED*1.5f));
+
 Boss::Boss()
 {
 	counter = 1.0f;
@@ -14,50 +19,56 @@ Boss::Boss()
 
 void Boss::Update(CMeshNode* _player,float dt)
 {
-	float yaw = GetHpr().x;
-	D3DXVECTOR3 pPos = _player->GetPos();
-	D3DXVECTOR3 myPos = GetPos();
-	float delta=GetDirection(pPos-myPos);
 	NormalizeRotation(this);
+	//  where the player is, worked out once for all the checks below
+	D3DXVECTOR3 right, up, forward;
+	GetBasis(right, up, forward);
+	SPerception see;
+	Perceive(mPos, forward, right, _player->GetPos(), see);
+	bool inAttackRange = InRange(see, ATTACK_DISTANCE);
+	bool inDetectRange = InRange(see, DETECT_DISTANCE);
 	switch(_state)
 	{
 	case IDLE:
-		d = GetDirection(D3DXVECTOR3(-165,0,125)-myPos);
-		if(GetDistance(D3DXVECTOR3(-165,0,125),myPos)>=SPEED)
 		{
-			RotateTowardsTarget(yaw,d);
-			Move(D3DXVECTOR3(0,0,D2R(1*SPEED)));  //  walking
+			SPerception home;
+			Perceive(mPos, forward, right, HOME, home);
+			if(!InRange(home, SPEED))  //  (not quite there)
+			{
+				RotateTowardsTarget(home);
+				Move(D3DXVECTOR3(0,0,D2R(1*SPEED)));  //  walking
+			}
 		}
-		if (GetDistance(_player->GetPos(),mPos)<=ATTACK_DISTANCE)  //  within attack distance
+		if (inAttackRange)  //  within attack distance
 		{
 			_state = ATTACKING;
 		}
-		if (GetDistance(_player->GetPos(),mPos)<=DETECT_DISTANCE)  //  within radius
+		if (inDetectRange)  //  within radius
 		{
 			_state = CHASING;
 		}
 		break;
 	case CHASING:
-		if (GetDistance(_player->GetPos(),mPos)<=ATTACK_DISTANCE)  //  within attack distance
+		if (inAttackRange)  //  within attack distance
 		{
 			_state = ATTACKING;
 		}
-		if (GetDistance(_player->GetPos(),mPos)>DETECT_DISTANCE)  //  out of radius
+		if (!inDetectRange)  //  out of radius
 		{
 			_state = IDLE;
 		}
-		PlayerInSight(yaw,delta);
+		PlayerInSight(see);
 		break;
 	case ATTACKING:
-		if (GetDistance(_player->GetPos(),mPos)>ATTACK_DISTANCE)  //  out of attacking distance
+		if (!inAttackRange)  //  out of attacking distance
 		{
 			_state = CHASING;
 		}
-		if (GetDistance(_player->GetPos(),mPos)>DETECT_DISTANCE)  //  out of radius
+		if (!inDetectRange)  //  out of radius
 		{
 			_state = IDLE;
 		}
-		RotateTowardsTarget(yaw,delta);
+		RotateTowardsTarget(see);
 		if(counter > 1)
 		{
 			counter -= 1.0f;
@@ -69,26 +80,26 @@ void Boss::Update(CMeshNode* _player,float dt)
 }
 
 //  to make the enemy rotate and face you
-void Boss::RotateTowardsTarget(float dira,float dirb)
+void Boss::RotateTowardsTarget(const SPerception& see)
 {
-	if(NormalizeAngle(dira-dirb) > 0)
+	if(see.Side < 0)
 		Yaw(D2R(-1*ROTSPEED));
-	else if(NormalizeAngle(dira-dirb) < 0)
+	else if(see.Side > 0)
+		Yaw(D2R(1*ROTSPEED));
+	else if(see.CosAngle < 0)  //  (right behind it)
 		Yaw(D2R(1*ROTSPEED));
 }
 
 //  to check if the player can be seen
-void Boss::PlayerInSight(float yaw, float delta)
+void Boss::PlayerInSight(const SPerception& see)
 {
 	//if(myNum == 210) // enable to test single enemy
 	//{ // enable to test single enemy
-	//float delta = atan2(pPos.x - myPos.x,pPos.z - myPos.z);
-	if(!(GetDeltaDirection(yaw , delta) < D2R(ROTSPEED*1.5)))  //  threshold to prevent enemy from vibrating while walking
+	if(!InCone(see, COS_AIMED))  //  threshold to prevent enemy from vibrating while walking
 	{
-		RotateTowardsTarget(yaw,delta);
+		RotateTowardsTarget(see);
 	}
 	Move(D3DXVECTOR3(0,0,D2R(1*SPEED)));  //  walking
-	//std::cout << "delta: " << delta << "    yaw: " << yaw << std::endl;
 	//} // enable to test single enemy
 }
 
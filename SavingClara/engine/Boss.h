@@ -2,6 +2,7 @@
 #include "Node.h"
 #include "Collision.h"
 #include "GameUtils.h"
+#include "Perception.h"
 
 class Boss: public CMeshNode
 {
@@ -11,6 +12,7 @@ class Boss: public CMeshNode
 	static const int ATTACK_DISTANCE = 10;  //  radius when the enemy is in attack range
 	static const int ROTSPEED = 3.0f;
 	static const int SPEED = 3.0f;
+	static const float COS_AIMED;  //  cosine of the angle it doesn't bother turning within
 
 	float counter;
 public:
@@ -21,11 +23,10 @@ public:
 	float Dmg();
 	void SetDmgMultiplier(float dmgMultiplier);
 private:
-	void PlayerInSight(float yaw, float delta);
-	void RotateTowardsTarget(float dira,float dirb);
+	void PlayerInSight(const SPerception& see);
+	void RotateTowardsTarget(const SPerception& see);
 	state _state;
 	bool shoot;
 	float _dmgMultiplier;
-	float d;
 	//int myNum; //enable to test single enemy
 };
\ No newline at end of file
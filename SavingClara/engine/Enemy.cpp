@@ -2,46 +2,67 @@
 #pragma once
 #include "Enemy.h"
 #include "ConsoleOutput.h"
+#include "Transform.h"
 #include <sstream>
+#include <new>	// placement new
 
-static bool alerted;  //  if the ball hits the enemy
+// the speeds & chances were worked out per frame at 60 fps, so they are scaled by the number of those frames in dt
+static const float FRAME_RATE = 60.0f;
+
+const float Enemy::COS_SIGHT = cosf(D2R(Enemy::ENEMYSIGHT));
+const float Enemy::COS_AIMED = cosf(D2R(Enemy::ROTSPEED*1.5f));
 
 Enemy::Enemy()
 {
-	damage = false;
+	playerDamage = 0;
 	counter = 1;
 	timer = 0;
-	alerted = false;
+	mId = 0;
+	mLastUpdate = -1;
+	mNextDue = -1;
+	mRandom.Seed(0);  //  (the CAIScheduler gives each a different seed)
+	mHeardNoise = false;
+	direction = false;
 	attacking = false;
 	_state = LOOKING;  //  enemies start rotating and looking around their surroundings
 	//myNum = enemyNum; // enable to test single enemy
 	//enemyNum++; // enable to test single enemy
 }
 
-void Enemy::Update(CMeshNode* _player,float dt)
+void Enemy::Update(const SEnemyWorld& world,float dt)
 {
 	float damageMin = 0.0f;
 	float damageMax = 10.0f;
-	float yaw = GetHpr().x;
-	D3DXVECTOR3 pPos = _player->GetPos();
-	D3DXVECTOR3 myPos = GetPos();
-	float delta=GetDirection(pPos-myPos);
+	float steps = dt*FRAME_RATE;	// number of 60 fps frames
 	NormalizeRotation(this);
+	if (mHeardNoise)  //  the player has fired nearby (see CAIScheduler)
+	{
+		_state = ALERTED;
+		timer = 0;
+		mHeardNoise = false;
+	}
+	//  where the player is, worked out once for all the checks below
+	D3DXVECTOR3 right, up, forward;
+	GetBasis(right, up, forward);
+	SPerception see;
+	Perceive(mPos, forward, right, world.PlayerPos, see);
+	bool inAttackRange = InRange(see, ATTACK_DISTANCE);
+	bool inDetectRange = InRange(see, DETECT_DISTANCE);
 	switch(_state)
 	{
 	case PATROLLING:  //  enemies atart walking around
 		attacking = false;
-		if (rand()%1000 < 10)  //  percentage chance to stop walking and start looking around
+		if (mRandom.NextFloat()*1000 < 10*steps)  //  percentage chance to stop walking and start looking around
 		{
 			_state = LOOKING;
-			direction = randi(2);
+			direction = (mRandom.Next()&1)!=0;
 		}
-		Move(D3DXVECTOR3(0,0,D2R(1*SPEED)));  //  walking
-		if (GetDistance(_player->GetPos(),mPos)<=ATTACK_DISTANCE)  //  within attack distance
+		Move(D3DXVECTOR3(0,0,D2R(1*SPEED)*steps));  //  walking
+		if (inAttackRange)  //  within attack distance
 		{
 			_state = ATTACKING;
 		}
-		if (GetDistance(_player->GetPos(),mPos)<=DETECT_DISTANCE)  //  within radius
+		if (inDetectRange)  //  within radius
 		{
 			_state = CHASING;
 		}
@@ -49,116 +70,101 @@ void Enemy::Update(CMeshNode* _player,float dt)
 	case LOOKING:  //  enemies start looking around
 		attacking = false;
 		if(direction)
-			Yaw(D2R(-1*ROTSPEED));
+			Yaw(D2R(-1*ROTSPEED)*steps);
 		else
-			Yaw(D2R(1*ROTSPEED));
-		if (rand()%1000 < 10)
+			Yaw(D2R(1*ROTSPEED)*steps);
+		if (mRandom.NextFloat()*1000 < 10*steps)
 			_state = PATROLLING;
-		if (GetDistance(_player->GetPos(),mPos)<=ATTACK_DISTANCE)  //  within attack distance
+		if (inAttackRange)  //  within attack distance
 		{
 			_state = ATTACKING;
 		}
-		if (GetDistance(_player->GetPos(),mPos)<=DETECT_DISTANCE)  //  within radius
+		if (inDetectRange)  //  within radius
 		{
 			_state = CHASING;
 		}
 		break;
 	case CHASING:  //  enemy chases you
 		attacking = true;
-		if (GetDistance(_player->GetPos(),mPos)<=ATTACK_DISTANCE)  //  within attack distance
+		if (inAttackRange)  //  within attack distance
 		{
 			_state = ATTACKING;
 		}
-		if (GetDistance(_player->GetPos(),mPos)>DETECT_DISTANCE)  //  out of radius
+		if (!inDetectRange)  //  out of radius
 		{
 			_state = PATROLLING;
 		}
-		PlayerInSight(yaw,delta);
+		PlayerInSight(see,steps);
 		break;
 	case ATTACKING:  //  enemy attacks you
 		attacking = true;
-		if (GetDistance(_player->GetPos(),mPos)>ATTACK_DISTANCE)  //  out of attacking distance
+		if (!inAttackRange)  //  out of attacking distance
 		{
 			_state = CHASING;
 		}
-		if (GetDistance(_player->GetPos(),mPos)>DETECT_DISTANCE)  //  out of radius
+		if (!inDetectRange)  //  out of radius
 		{
 			_state = PATROLLING;
 		}
-		RotateTowardsTarget(yaw,delta);
+		RotateTowardsTarget(see,steps);
 		if(counter > 1)
 		{
 			counter -= 1.0f;
-			_player->Damage(randf(damageMin,damageMax));
-			damage = true;
+			playerDamage += mRandom.NextFloat(damageMin,damageMax);  //  (added to the player afterwards, see CAIScheduler)
 		}
 		counter += dt;
-		//std::cout << "life: " << _player->mLife << std::endl;
 		break;
 	case ALERTED:
-		if (GetDistance(_player->GetPos(),mPos)<=ATTACK_DISTANCE)  //  within attack distance
+		if (inAttackRange)  //  within attack distance
 		{
 			_state = ATTACKING;
-			alerted = false;
 			timer = 0;
 		}
-		RotateTowardsTarget(yaw,delta);
-		Move(D3DXVECTOR3(0,0,D2R(1*SPEED)));  //  walking
+		RotateTowardsTarget(see,steps);
+		Move(D3DXVECTOR3(0,0,D2R(1*SPEED)*steps));  //  walking
 		if(timer >= 10)
 		{
-			alerted = false;
 			_state = PATROLLING;
 			timer = 0;
 		}
 		timer += dt;
 		break;
 	}
-	if(alerted)  //  if enemy is hit by attack
-	{
-		if (GetDistance(_player->GetPos(),mPos)<=HEARING_DISTANCE)  //  within detection distance
-		{
-			_state = ALERTED;
-		}
-	}
 }
 
 //  to make the enemy rotate and face you
-void Enemy::RotateTowardsTarget(float dira,float dirb)
+void Enemy::RotateTowardsTarget(const SPerception& see,float steps)
 {
-	if(NormalizeAngle(dira-dirb) > 0)
-		Yaw(D2R(-1*ROTSPEED));
-	else if(NormalizeAngle(dira-dirb) < 0)
-		Yaw(D2R(1*ROTSPEED));
+	if(see.CosAngle >= 1)	return;  //  (already facing it)
+	float turn = D2R(1*ROTSPEED)*steps;
+	if(cosf(turn) < see.CosAngle)	turn = acosf(see.CosAngle);	//  (a long dt would turn it past the target)
+	if(see.Side < 0)
+		Yaw(-turn);
+	else
+		Yaw(turn);
 }
 
 //  to check if the player can be seen
-void Enemy::PlayerInSight(float yaw, float delta)
+void Enemy::PlayerInSight(const SPerception& see, float steps)
 {
 	//if(myNum == 210) // enable to test single enemy
 	//{ // enable to test single enemy
-	//float delta = atan2(pPos.x - myPos.x,pPos.z - myPos.z);
-	if(GetDeltaDirection(yaw , delta) < D2R(ENEMYSIGHT))  //  field of vision of the enemy(angle of enemy can see you)
+	if(InCone(see, COS_SIGHT))  //  field of vision of the enemy(angle of enemy can see you)
 	{
-		if(!(GetDeltaDirection(yaw , delta) < D2R(ROTSPEED*1.5)))  //  threshold to prevent enemy from vibrating while walking
+		if(!InCone(see, COS_AIMED))  //  threshold to prevent enemy from vibrating while walking
 		{
-			RotateTowardsTarget(yaw,delta);
+			RotateTowardsTarget(see,steps);
 		}
 	}
-	Move(D3DXVECTOR3(0,0,D2R(1*SPEED)));  //  walking
-	//std::cout << "delta: " << delta << "    yaw: " << yaw << std::endl;
+	Move(D3DXVECTOR3(0,0,D2R(1*SPEED)*steps));  //  walking
 	//} // enable to test single enemy
 }
 
-//  when u shoot, enemy hear u shooting and chase u
-void Enemy::Alerted()
-{
-	alerted = true;
-}
-
 //  when ur attack hits the enemy, he comes chase u
 void Enemy::Alerted(CMeshNode* _player)
 {
-	if (GetDistance(_player->GetPos(),mPos)<=DETECTION_DISTANCE)
+	D3DXVECTOR3 diff = _player->GetPos()-mPos;
+	if (D3DXVec3LengthSq(&diff)<=DETECTION_DISTANCE*DETECTION_DISTANCE)
 	{
 		_state = ALERTED;
 	}
@@ -170,45 +176,102 @@ bool Enemy::IsAttacking()
 	return attacking;
 }
 
-void DeleteEnemy(std::vector<Enemy*>& e)
-{
-	for(int i = (int)e.size()-1; i>=0; i--)
-	{
-		delete e[i];
-	}
-	e.clear();
-}
-
 void DrawEnemy(const std::vector<Enemy*>& e,CMeshNode* mPlayer)
 {
+	// find the ones in view & work out their world matrices together
+	static std::vector<Enemy*> visible;
+	static CTransformBatch batch;
+	visible.clear();
+	batch.Clear();
 	for(int i=0; i<e.size(); i++)
 	{
 		if(e[i]->IsAlive())
 		{
 			if(CollisionSphereSphere(e[i]->GetPos(),1.0f,mPlayer->GetPos(),50.0f))
 				if(GetDeltaDirection(mPlayer->GetHpr().x,GetDirection(e[i]->GetPos()-mPlayer->GetPos()))<D2R(40))
-					e[i]->Draw();
+				{
+					visible.push_back(e[i]);
+					batch.Add(e[i]->mPos,e[i]->mHpr,e[i]->mScale);
+				}
 		}
 	}
+	batch.Build();
+	// then each mesh once, with all the enemies which use it
+	// (there are only a few kinds of enemy, so a search is fine)
+	static std::vector<D3DXMATRIX> worlds;
+	for(int i=0; i<(int)visible.size(); i++)
+	{
+		if (visible[i]==NULL)	continue;	// (already drawn)
+		CXMesh* pMesh=visible[i]->mpMesh;
+		worlds.clear();
+		for(int j=i; j<(int)visible.size(); j++)
+		{
+			if (visible[j]==NULL || visible[j]->mpMesh!=pMesh)	continue;
+			worlds.push_back(batch.GetMatrix(j));
+			visible[j]=NULL;
+		}
+		pMesh->DrawInstanced(&worlds[0],(int)worlds.size());
+	}
 }
 
-void DeleteDeadEnemy(std::vector<Enemy*>& e)
+CEnemyStore::CEnemyStore(int capacity)
+:mCapacity(capacity),mNextId(0),mHighWater(0),mOverflows(0)
 {
-	// this is a bit tricky, so here it is in full
-	for(int i=(int)e.size()-1;i>=0;i--)
+	mpPool=new Enemy[capacity];	// (the only new)
+	mEnemies.reserve(capacity);
+	mFree.reserve(capacity);
+	for(int i=capacity-1;i>=0;i--)
+		mFree.push_back(&mpPool[i]);	// (backwards, so they are handed out in order)
+}
+
+CEnemyStore::~CEnemyStore()
+{
+	delete[] mpPool;
+}
+
+Enemy* CEnemyStore::Add(CXMesh* pMesh,const D3DXVECTOR3& pos,int life)
+{
+	if (mFree.empty())
 	{
-		if (e[i]->IsAlive()==false)
-		{
-			delete e[i];	// deletes the object
-			// removed item at index 'i', by shifting down the items
-			e.erase(e.begin()+i);
-		}
+		mOverflows++;
+		return NULL;
 	}
+	Enemy* pEnemy=mFree.back();
+	mFree.pop_back();
+	// start afresh, it may have been used by an enemy which died
+	pEnemy->~Enemy();
+	new(pEnemy) Enemy();
+	pEnemy->Init(pMesh,pos,D3DXVECTOR3(0,0,0),1,life);
+	pEnemy->mId=mNextId++;
+	mEnemies.push_back(pEnemy);
+	if ((int)mEnemies.size()>mHighWater)	mHighWater=(int)mEnemies.size();
+	return pEnemy;
+}
+
+void CEnemyStore::RemoveDead()
+{
+	// as RemoveDead() in Node.h, but the dead go back in the pool rather than being delete'd
+	size_t alive=0;
+	for(size_t i=0;i<mEnemies.size();i++)
+	{
+		if (mEnemies[i]->IsAlive())
+			mEnemies[alive++]=mEnemies[i];	// keep it
+		else
+			mFree.push_back(mEnemies[i]);
+	}
+	mEnemies.resize(alive);
+}
+
+void CEnemyStore::Clear()
+{
+	for(int i=(int)mEnemies.size()-1;i>=0;i--)
+		mFree.push_back(mEnemies[i]);
+	mEnemies.clear();
 }
 
-bool Enemy::Dmg()
+float Enemy::TakePlayerDamage()
 {
-	bool a = damage;
-	damage = false;
+	float a = playerDamage;
+	playerDamage = 0;
 	return a;
 }
\ No newline at end of file
@@ -2,6 +2,17 @@
 #include "Node.h"
 #include "Collision.h"
 #include "GameUtils.h"
+#include "Random.h"
+#include "Perception.h"
+
+/** What an enemy can see of the world while its updated.
+The enemies may be updated in parallel, so this is all they read (apart from themselves)
+& none of it is changed during the update.
+*/
+struct SEnemyWorld
+{
+	D3DXVECTOR3 PlayerPos;
+};
 
 class Enemy: public CMeshNode
 {
@@ -9,7 +20,6 @@ class Enemy: public CMeshNode
 	enum state {CHASING, LOOKING, ATTACKING, PATROLLING, ALERTED};
 	static const int DETECT_DISTANCE = 10;  //  radius when the enemy is in sight
 	static const int ATTACK_DISTANCE = 2;  //  radius when the enemy is in attack range
-	static const int HEARING_DISTANCE = 15;  //  radius when the enemy can hear you shooting
 	static const int DETECTION_DISTANCE = 20;  //  radius when the enemy can detect you when your attack hits them
 	static const int ROTSPEED = 3.0f;
 	static const int SPEED = 4.0f;
@@ -18,26 +28,105 @@ class Enemy: public CMeshNode
 	//when setting this value, take note that the value is 2 times.
 	//eg. if u set ENEMYSIGHT = 35; the enemy can see 70degrees. 35 towards the left and 35 towards the right.
 	static const int ENEMYSIGHT = 35;
-	int timer;
+	static const float COS_SIGHT;  //  cosine of ENEMYSIGHT (so the player is in sight if the cosine of the angle to them is more)
+	static const float COS_AIMED;  //  cosine of the angle it doesn't bother turning within
+	float timer;
 	float counter;
 public:
+	//  radius when the enemy can hear you shooting
+	//  (across the ground since the CHearingGrid, it used to be the full 3D distance, so ones above or below now hear further)
+	static const int HEARING_DISTANCE = 15;
 	Enemy();
-	void Update(CMeshNode* _player,float dt);
+	/** Moves & thinks.
+	Only changes this enemy, so different enemies can be updated at the same time.
+	It calls GetBasis() once (for Perceive()), which works out the basis again if it has turned since.
+	\param world what it can see
+	\param dt the time since it was last updated (which may be several frames, see CAIScheduler)
+	*/
+	void Update(const SEnemyWorld& world,float dt);
 	state GetState(){return _state;}
-	void Alerted();
+	/// whether its after the player (chasing, attacking or alerted), rather than wandering about
+	bool IsEngaged(){return _state==CHASING || _state==ATTACKING || _state==ALERTED;}
+	unsigned mId;	///< its number, the CEnemyStore numbers them in the order they are added
+	float mLastUpdate;	///< when it was last updated, by the CAIScheduler's clock (<0 for never)
+	float mNextDue;	///< when the CAIScheduler will next update it (<0 for not yet scheduled)
+	CRandom mRandom;	///< its own random numbers (so it gives the same results whichever thread updates it)
+	bool mHeardNoise;	///< set when the player fires within HEARING_DISTANCE (see CAIScheduler::Alert), it is alerted on its next update
 	bool IsAttacking();
 	void Alerted(CMeshNode* _player);
-	bool Dmg();
+	/// the damage it has done to the player since last asked (see CAIScheduler::TakePlayerDamage)
+	float TakePlayerDamage();
 private:
 	bool direction;
-	void PlayerInSight(float yaw, float delta);
-	void RotateTowardsTarget(float dira,float dirb);
+	void PlayerInSight(const SPerception& see, float steps);
+	void RotateTowardsTarget(const SPerception& see, float steps);
 	state _state;
 	bool attacking;
-	bool damage;
+	float playerDamage;
 	//int myNum; //enable to test single enemy
 };
 
-void DeleteEnemy(std::vector<Enemy*>& e);
-void DrawEnemy(const std::vector<Enemy*>& e,CMeshNode* mPlayer);
-void DeleteDeadEnemy(std::vector<Enemy*>& e);
\ No newline at end of file
+/// how many enemies a CEnemyStore holds, unless told otherwise
+const int DEFAULT_ENEMY_CAPACITY=256;
+
+/** A pool of enemies, all kept in one block.
+Rather than new'ing each enemy (so they end up all over the heap), the store makes all of them at once
+& hands them out, so going through the enemies goes through memory in order.
+Adding & removing them never touches the heap, if its full Add() fails (see GetHighWater()).
+
+The enemies are still used through pointers (eg. by the CAIScheduler),
+which stay good until the enemy is removed by RemoveDead().
+New enemies go on the end, & each is given the next Enemy::mId, so they are always in mId order
+(the CAIScheduler uses this to find the new ones without looking through them all).
+\code
+Enemy* pEnemy=mEnemies.Add(pMesh,pos,100);
+...
+for(int i=0;i<mEnemies.GetCount();i++)
+	mEnemies[i]->Damage(10);
+mEnemies.RemoveDead();
+\endcode
+*/
+class CEnemyStore
+{
+public:
+	/// \param capacity the most enemies there can be at once
+	CEnemyStore(int capacity=DEFAULT_ENEMY_CAPACITY);
+	~CEnemyStore();
+	/** Adds a new enemy (just made, as if new'ed).
+	\param pMesh,pos,life as CMeshNode::Init()
+	\return the enemy, or NULL if the store is full
+	*/
+	Enemy* Add(CXMesh* pMesh,const D3DXVECTOR3& pos,int life=100);
+	/// removes the dead enemies (their space is reused), the ones left stay in the same order
+	void RemoveDead();
+	/// removes all the enemies
+	void Clear();
+
+	int GetCount(){return (int)mEnemies.size();}
+	Enemy* operator[](int index){return mEnemies[index];}
+	/// the enemies in the store, in the order they were added
+	std::vector<Enemy*>& GetEnemies(){return mEnemies;}
+
+	/// \defgroup EnemyStats Pool statistics
+	/// @{
+	int GetCapacity(){return mCapacity;}
+	/// the most enemies there have been at once
+	int GetHighWater(){return mHighWater;}
+	/// number of times Add() failed because the store was full
+	int GetOverflows(){return mOverflows;}
+	/// @}
+private:
+	CEnemyStore(const CEnemyStore&); // no copying
+	void operator=(const CEnemyStore&); // no copying
+
+	Enemy* mpPool;	// all the enemies, in use or not
+	int mCapacity;
+	std::vector<Enemy*> mEnemies;	// the ones in use
+	std::vector<Enemy*> mFree;	// the ones not in use (the next to be used at the back)
+	unsigned mNextId;	// the mId for the next enemy added
+	int mHighWater;
+	int mOverflows;
+};
+
+/// draws the enemies in front of the player (all the ones with the same mesh in one go, see CXMesh::DrawInstanced)
+void DrawEnemy(const std::vector<Enemy*>& e,CMeshNode* mPlayer);
\ No newline at end of file
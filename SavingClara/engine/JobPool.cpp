@@ -0,0 +1,138 @@
+/*==============================================
+ * Job pool for GDEV Engine
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#include "JobPool.h"
+#include "Fail.h"
+
+// parameters for each worker thread
+struct SWorker
+{
+	CJobPool* pPool;
+	int Queue;
+};
+
+CJobPool::CJobPool(int threads)
+{
+	if (threads<=0)
+	{
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		threads=(int)info.dwNumberOfProcessors-1;
+	}
+	mPending=0;
+	mNext=0;
+	mQuit=0;
+	mWork=CreateSemaphore(NULL,0,0x7FFFFFFF,NULL);
+	if (mWork==NULL)	FAIL("CreateSemaphore() - FAILED","CJobPool");
+	for(int i=0;i<=threads;i++)
+	{
+		SQueue* pQueue=new SQueue();
+		InitializeCriticalSection(&pQueue->Lock);
+		mQueues.push_back(pQueue);
+	}
+	for(int i=1;i<=threads;i++)
+	{
+		SWorker* pWorker=new SWorker();	// deleted by the thread
+		pWorker->pPool=this;
+		pWorker->Queue=i;
+		HANDLE thread=CreateThread(NULL,0,ThreadProc,pWorker,0,NULL);
+		if (thread==NULL)	FAIL("CreateThread() - FAILED","CJobPool");
+		mThreads.push_back(thread);
+	}
+}
+
+CJobPool::~CJobPool()
+{
+	Wait();	// finish off anything left
+	InterlockedExchange(&mQuit,1);
+	ReleaseSemaphore(mWork,(LONG)mThreads.size(),NULL);	// wake them all up to quit
+	for(unsigned i=0;i<mThreads.size();i++)
+	{
+		WaitForSingleObject(mThreads[i],INFINITE);
+		CloseHandle(mThreads[i]);
+	}
+	for(unsigned i=0;i<mQueues.size();i++)
+	{
+		DeleteCriticalSection(&mQueues[i]->Lock);
+		delete mQueues[i];
+	}
+	CloseHandle(mWork);
+}
+
+void CJobPool::Add(void (*function)(void* pData,int begin,int end),void* pData,int begin,int end)
+{
+	SJob job;
+	job.Function=function;
+	job.pData=pData;
+	job.Begin=begin;
+	job.End=end;
+	// spread the jobs over all the queues
+	SQueue* pQueue=mQueues[(unsigned)InterlockedIncrement(&mNext)%mQueues.size()];
+	InterlockedIncrement(&mPending);
+	EnterCriticalSection(&pQueue->Lock);
+	pQueue->Jobs.push_back(job);
+	LeaveCriticalSection(&pQueue->Lock);
+	if (mThreads.empty()==false)
+		ReleaseSemaphore(mWork,1,NULL);
+}
+
+bool CJobPool::RunJob(int q)
+{
+	SJob job;
+	bool found=false;
+	// own queue first, newest job (its the most likely to be in the cache)
+	SQueue* pQueue=mQueues[q];
+	EnterCriticalSection(&pQueue->Lock);
+	if (pQueue->Jobs.empty()==false)
+	{
+		job=pQueue->Jobs.back();
+		pQueue->Jobs.pop_back();
+		found=true;
+	}
+	LeaveCriticalSection(&pQueue->Lock);
+	// otherwise steal the oldest job from someone else
+	for(unsigned i=1;i<mQueues.size() && !found;i++)
+	{
+		pQueue=mQueues[(q+i)%mQueues.size()];
+		EnterCriticalSection(&pQueue->Lock);
+		if (pQueue->Jobs.empty()==false)
+		{
+			job=pQueue->Jobs.front();
+			pQueue->Jobs.pop_front();
+			found=true;
+		}
+		LeaveCriticalSection(&pQueue->Lock);
+	}
+	if (!found)	return false;
+	job.Function(job.pData,job.Begin,job.End);
+	InterlockedDecrement(&mPending);
+	return true;
+}
+
+void CJobPool::Wait()
+{
+	while(mPending>0)
+	{
+		if (!RunJob(0))
+			SwitchToThread();	// the last few are running on the other threads
+	}
+}
+
+DWORD WINAPI CJobPool::ThreadProc(LPVOID pParam)
+{
+	SWorker* pWorker=(SWorker*)pParam;
+	CJobPool* pPool=pWorker->pPool;
+	int q=pWorker->Queue;
+	delete pWorker;
+	while(true)
+	{
+		WaitForSingleObject(pPool->mWork,INFINITE);
+		if (pPool->mQuit)	break;
+		// the job for this signal may have been taken by someone else, that's fine
+		while(pPool->RunJob(q));
+	}
+	return 0;
+}
@@ -0,0 +1,71 @@
+/*==============================================
+ * Job pool for GDEV Engine
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#pragma once
+
+/** \file JobPool.h A pool of worker threads for running small jobs in parallel.
+Each worker has its own queue of jobs, when it runs out it steals jobs from the other queues
+(work stealing), so the load is spread evenly even if the jobs are different sizes.
+
+The thread which calls Wait() helps out running jobs, so no time is wasted while waiting.
+
+\note the jobs must not touch anything which another job might be changing at the same time
+(eg. don't give two jobs the same range of an array)
+*/
+
+#include <windows.h>
+#include <deque>
+#include <vector>
+
+/// A job: calls Function(pData,Begin,End)
+struct SJob
+{
+	void (*Function)(void* pData,int begin,int end);
+	void* pData;
+	int Begin,End;
+};
+
+/** The pool of worker threads.
+Typical use:
+\code
+for(int i=0;i<count;i+=CHUNK)
+	pool.Add(UpdateChunk,&data,i,min(i+CHUNK,count));
+pool.Wait();	// all the jobs are done after this
+\endcode
+*/
+class CJobPool
+{
+public:
+	/** Constructor.
+	\param threads number of worker threads (0 for one per processor, less one for the main thread)
+	*/
+	CJobPool(int threads=0);
+	~CJobPool();
+
+	/// adds a job (it may start at once)
+	void Add(void (*function)(void* pData,int begin,int end),void* pData,int begin,int end);
+	/// runs jobs until all the added jobs are done
+	void Wait();
+	/// number of threads working on the jobs (including the one calling Wait)
+	int GetThreadCount(){return (int)mThreads.size()+1;}
+private:
+	/// a queue of jobs, one per thread
+	struct SQueue
+	{
+		CRITICAL_SECTION Lock;
+		std::deque<SJob> Jobs;
+	};
+	/// runs a job from queue q, or steals one from another queue, returns false if there were none
+	bool RunJob(int q);
+	static DWORD WINAPI ThreadProc(LPVOID pParam);
+
+	std::vector<SQueue*> mQueues;	// [0] is the main thread, [1..] the workers
+	std::vector<HANDLE> mThreads;
+	HANDLE mWork;	// semaphore, signalled once per job added
+	volatile LONG mPending;	// jobs added but not yet finished
+	volatile LONG mNext;	// which queue to add the next job to
+	volatile LONG mQuit;	// set to stop the workers
+};
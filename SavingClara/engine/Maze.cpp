@@ -3,86 +3,213 @@
 *
 * Written by Marcus Khoo
 *==============================================*/
-#include <fstream>  // file IO
-#include <algorithm>  // for reverse
+#include <windows.h>	// file IO
+#include <intrin.h>	// _BitScanForward
+#include <emmintrin.h>	// SSE2
+#include <cstring>	// memchr
 #include "Maze.h"
 #include "Fail.h"
 #include "GameUtils.h"
 #include "ConsoleOutput.h"
 using namespace std;
 
+// files bigger than this are memory mapped rather than read into a buffer
+const LONGLONG MAZE_MAP_SIZE=1024*1024;
+
 CMaze::CMaze(CXMesh* pBlock, CXMesh* hBlock)
 {
 	mpBlock=pBlock;
 	hotBlock = hBlock;
+	mDepth=0;
+	mRowWords=0;
 }
 
 bool CMaze::Init(const char* name)
 {
-	mMaze.clear();
-	// this is standard file reading code using C++
-	// if you have not seen this before, you might want to study it
-	ifstream in(name);	// the file
-	if (!in)	FAIL(name,"Unable to load maze file");
-	while(in.eof()==false)	// until the end of file
+	mDepth=0;
+	mRowWords=0;
+	mSolid.clear();
+	mHot.clear();
+	mRowLength.clear();
+
+	// read the whole file in one go
+	HANDLE file=CreateFile(name,GENERIC_READ,FILE_SHARE_READ,NULL,OPEN_EXISTING,FILE_FLAG_SEQUENTIAL_SCAN,NULL);
+	if (file==INVALID_HANDLE_VALUE)	FAIL(name,"Unable to load maze file");
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file,&size))
+	{
+		CloseHandle(file);
+		FAIL(name,"Unable to load maze file");
+	}
+	const char* data=NULL;
+	HANDLE mapping=NULL;
+	vector<char> buffer;
+	if (size.QuadPart>=MAZE_MAP_SIZE)
+	{
+		mapping=CreateFileMapping(file,NULL,PAGE_READONLY,0,0,NULL);
+		if (mapping!=NULL)
+			data=(const char*)MapViewOfFile(mapping,FILE_MAP_READ,0,0,0);
+		if (data==NULL)
+		{
+			if (mapping!=NULL)	CloseHandle(mapping);
+			CloseHandle(file);
+			FAIL(name,"Unable to load maze file");
+		}
+	}
+	else if (size.QuadPart>0)
+	{
+		buffer.resize((size_t)size.QuadPart);
+		DWORD read=0;
+		if (!ReadFile(file,&buffer[0],(DWORD)buffer.size(),&read,NULL) || read!=buffer.size())
+		{
+			CloseHandle(file);
+			FAIL(name,"Unable to load maze file");
+		}
+		data=&buffer[0];
+	}
+	size_t length=(size_t)size.QuadPart;
+
+	// find the lines (in place), skipping the empty ones
+	vector<const char*> lines;
+	vector<int> lengths;
+	int width=0;
+	const char* p=data;
+	const char* end=data+length;
+	while(p<end)
+	{
+		const char* eol=(const char*)memchr(p,'\n',end-p);
+		if (eol==NULL)	eol=end;
+		int len=(int)(eol-p);
+		if (len>0 && p[len-1]=='\r')	len--;
+		if (len>1)	// skip empty lines
+		{
+			lines.push_back(p);
+			lengths.push_back(len);
+			if (len>width)	width=len;
+		}
+		p=eol+1;
+	}
+
+	// work out the row size: whole SSE registers, with at least one bit of padding
+	// so that a scan along the row always stops
+	mDepth=(int)lines.size();
+	mRowWords=((width+1+127)/128)*4;
+	mSolid.assign(mDepth*mRowWords,0);
+	mHot.assign(mDepth*mRowWords,0);
+	mRowLength.resize(mDepth);
+	for(int i=0;i<mDepth;i++)
 	{
-		string s;
-		getline(in,s);	// gets the line
-		if (s.length()>1)	// skip empty lines
-			mMaze.push_back(s);	// add to the list
+		// the rows are reversed, making it look as the screen
+		int z=mDepth-1-i;
+		const char* line=lines[i];
+		int len=lengths[i];
+		mRowLength[z]=len;
+		unsigned* solid=&mSolid[z*mRowWords];
+		unsigned* hot=&mHot[z*mRowWords];
+		for(int x=0;x<len;x++)
+		{
+			if (line[x]!='.')	solid[x>>5]|=1u<<(x&31);
+			if (line[x]=='%')	hot[x>>5]|=1u<<(x&31);
+		}
+		// the padding after the end of the row counts as wall
+		for(int x=len;x<mRowWords*32;x++)
+			solid[x>>5]|=1u<<(x&31);
 	}
-	// this chunk of code will reverse the order of the maze, making it look as the screen
-	std::reverse(mMaze.begin(),mMaze.end());
+
+	if (mapping!=NULL)
+	{
+		UnmapViewOfFile(data);
+		CloseHandle(mapping);
+	}
+	CloseHandle(file);
 	return true;
 }
 
 void CMaze::Draw()
 {
-	for(int z = 0; z < mMaze.size(); z++)
+	for(int z = 0; z < mDepth; z++)
 	{
-		for(int x = 0; x < mMaze[z].size(); x++)
+		// skip straight from one block to the next
+		for(int x = FindWall(z,0); x < mRowLength[z]; x = FindWall(z,x+1))
 		{
-			if(mMaze[z][x] == '#')
-			{
-				mpBlock->Draw(D3DXVECTOR3(x,0,z));
-				
-			}
-			else if(mMaze[z][x] == '%')
-			{
+			if(TestBit(mHot,z,x))
 				hotBlock->Draw(D3DXVECTOR3(x,0,z));
-			}
+			else
+				mpBlock->Draw(D3DXVECTOR3(x,0,z));
 		}
 	}
-	//		if (....)
-	//			mpBlock->Draw(....)
 	// PS: display should be on the XZ plane, not XY
 	// you should swap the XY around to make it look right
 }
 
 char CMaze::GetCell(D3DXVECTOR3 pos)
 {
-	// Hint: convert the x,z to integer
-	// NOTE: this is floating point values, you will need to round nearest number
-	// look up the functi	on floor() as this will help you
+	// convert the x,z to integer, rounding to the nearest cell
 	// check if its outside the size of the array & return '\0'
-	// otherwise return the data
-	// remember the XY are reverse
 	int x, z;
 
 	x = floor(pos.x+0.5);
 	z = floor(pos.z+0.5);
 
-	//if(x > mMaze.
-	if(z >= mMaze.size() || x >= mMaze[0].size() || z < 0 || x < 0)
+	if(z >= mDepth || z < 0 || x < 0 || x >= mRowLength[z])
 	{
 		return '\0';
 	}
-	else
+	if (TestBit(mHot,z,x))	return '%';
+	if (TestBit(mSolid,z,x))	return '#';
+	return '.';
+}
+
+int CMaze::Scan(const std::vector<unsigned>& plane,bool invert,int z,int x)
+{
+	if (z<0 || z>=mDepth || x>=mRowWords*32)	return -1;
+	if (x<0)	x=0;
+	const unsigned* row=&plane[z*mRowWords];
+	const unsigned flip=invert?0xFFFFFFFFu:0;
+	unsigned long bit;
+	// the first word may be partial, so mask off the cells before x
+	int w=x>>5;
+	unsigned bits=(row[w]^flip)&(0xFFFFFFFFu<<(x&31));
+	if (_BitScanForward(&bit,bits))	return (w<<5)+(int)bit;
+	// then scalar up to the next 4 word boundary
+	for(w++;(w&3)!=0;w++)
+		if (_BitScanForward(&bit,row[w]^flip))	return (w<<5)+(int)bit;
+	// then 128 cells at a time, looking for any word which is not all 'empty'
+	const __m128i empty=_mm_set1_epi32(0);
+	const __m128i flip4=_mm_set1_epi32((int)flip);
+	for(;w<mRowWords;w+=4)
 	{
-		return mMaze[z][x];
+		__m128i v=_mm_xor_si128(_mm_loadu_si128((const __m128i*)(row+w)),flip4);
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(v,empty))==0xFFFF)
+			continue;
+		for(int i=0;i<4;i++)
+			if (_BitScanForward(&bit,row[w+i]^flip))	return ((w+i)<<5)+(int)bit;
 	}
+	return -1;
+}
+
+int CMaze::FindWall(int z,int x)
+{
+	// off the map is a wall (as in IsBlocked())
+	if (z<0 || z>=mDepth || x<0 || x>=mRowLength[z])	return x;
+	// the padding is always solid, so this always finds something at or before the end of the row
+	int found=Scan(mSolid,false,z,x);
+	if (found<0 || found>mRowLength[z])	return mRowLength[z];
+	return found;
+}
+
+int CMaze::FindClear(int z,int x)
+{
+	int found=Scan(mSolid,true,z,x);
+	if (found<0 || found>=mRowLength[z])	return -1;	// the padding is never clear, but just in case
+	return found;
+}
 
+int CMaze::FindHot(int z,int x)
+{
+	return Scan(mHot,false,z,x);
 }
+
 bool CMaze::IsClear(D3DXVECTOR3 pos)
 {
 	// this is easy, just call GetCell
@@ -123,23 +250,154 @@ bool CMaze::IsTouchingHot(D3DXVECTOR3 pos,float radius)
 
 D3DXVECTOR3 CMaze::WallSlide(D3DXVECTOR3 oldPos,D3DXVECTOR3 newPos,float radius)
 {
+	D3DXVECTOR3 move=newPos-oldPos;
+	move.y=0;
+	SSweepResult sweep;
+	if (SweepCircle(oldPos,move,radius,sweep)==false)
+		return newPos;	// nothing in the way
+
+	// hit a wall: use up the rest of the move sliding along it
+	// (if that hits another wall we are in a corner, so stop there)
+	// (copied, as SweepCircle() clears the result before it reads the move)
+	D3DXVECTOR3 pos=sweep.Pos;
+	D3DXVECTOR3 slide=sweep.Slide;
+	SweepCircle(pos,slide,radius,sweep);
+	pos=sweep.Pos;
+	pos.y=newPos.y;
+	return pos;
+}
+
+void CMaze::WallSlide(const D3DXVECTOR3* oldPos,const D3DXVECTOR3* newPos,const float* radius,
+					D3DXVECTOR3* result,int count)
+{
+	for(int i=0;i<count;i++)
+		result[i]=WallSlide(oldPos[i],newPos[i],radius[i]);
+}
+
+// converts a coordinate into a cell index (same rounding as GetCell)
+inline int CellIndex(float v){return (int)floor(v+0.5f);}
+
+// how far the square is shrunk by when working out which cells it covers
+// (so an object touching a wall is not considered to be in it)
+const float SWEEP_EPSILON=0.0001f;
+// how far from a wall the object is stopped
+const float SWEEP_SKIN=0.001f;
+
+bool CMaze::SweepCircle(const D3DXVECTOR3& pos,const D3DXVECTOR3& move,float radius,SSweepResult& result)
+{
+	result.Hit=false;
+	result.Time=1;
+	result.Pos=pos+move;
+	result.Normal=D3DXVECTOR3(0,0,0);
+	result.Slide=D3DXVECTOR3(0,0,0);
 
-	if(IsClear(newPos, radius))
+	// Each cell i covers i-0.5 .. i+0.5, so the boundaries are at i+0.5.
+	// For each axis work out the next boundary the leading edge of the square crosses,
+	// the time (0..1) it gets there & the column/row which it enters.
+	// Then keep stepping to whichever boundary comes first, checking the new cells as we go.
+	int stepX=(move.x>0)?1:((move.x<0)?-1:0);
+	int stepZ=(move.z>0)?1:((move.z<0)?-1:0);
+	float edgeX=0,edgeZ=0;	// the boundary position
+	float tNextX=FLT_MAX,tNextZ=FLT_MAX;	// time of the next crossing
+	float tDeltaX=FLT_MAX,tDeltaZ=FLT_MAX;	// time to cross one whole cell
+	int cellX=0,cellZ=0;	// the column/row entered
+	if (stepX!=0)
 	{
-		return newPos;
+		float lead=pos.x+stepX*radius;
+		edgeX=(stepX>0)? ceil(lead-0.5f)+0.5f : floor(lead+0.5f)-0.5f;
+		cellX=CellIndex(edgeX+stepX*0.5f);
+		tNextX=(edgeX-lead)/move.x;
+		tDeltaX=1.0f/fabs(move.x);
 	}
-	else
+	if (stepZ!=0)
+	{
+		float lead=pos.z+stepZ*radius;
+		edgeZ=(stepZ>0)? ceil(lead-0.5f)+0.5f : floor(lead+0.5f)-0.5f;
+		cellZ=CellIndex(edgeZ+stepZ*0.5f);
+		tNextZ=(edgeZ-lead)/move.z;
+		tDeltaZ=1.0f/fabs(move.z);
+	}
+
+	while(true)
 	{
-		if(IsClear(D3DXVECTOR3(newPos.x, 0, oldPos.z), radius))
+		bool alongX=(tNextX<=tNextZ);
+		float t=alongX?tNextX:tNextZ;
+		if (t>1)	return false;	// made it all the way
+
+		// the cells the square covers on the other axis at time t
+		float cx=pos.x+move.x*t, cz=pos.z+move.z*t;
+		bool blocked;
+		if (alongX)
 		{
-			oldPos.x = newPos.x;
+			int z0=CellIndex(cz-radius+SWEEP_EPSILON), z1=CellIndex(cz+radius-SWEEP_EPSILON);
+			if (tNextZ<=t+SWEEP_EPSILON)	// crossing exactly on a corner: include the diagonal cell
+			{
+				z0=min(z0,cellZ);
+				z1=max(z1,cellZ);
+			}
+			blocked=IsAreaBlocked(cellX,cellX,z0,z1);
 		}
-		else if(IsClear(D3DXVECTOR3(oldPos.x, 0, newPos.z), radius))
+		else
 		{
-			oldPos.z = newPos.z;
+			int x0=CellIndex(cx-radius+SWEEP_EPSILON), x1=CellIndex(cx+radius-SWEEP_EPSILON);
+			if (tNextX<=t+SWEEP_EPSILON)
+			{
+				x0=min(x0,cellX);
+				x1=max(x1,cellX);
+			}
+			blocked=IsAreaBlocked(x0,x1,cellZ,cellZ);
+		}
+
+		if (blocked)
+		{
+			result.Hit=true;
+			result.Time=t;
+			result.Pos=pos+move*t;
+			// the rest of the move, without the bit going into the wall
+			result.Slide=move*(1-t);
+			if (alongX)
+			{
+				result.Pos.x=edgeX-stepX*(radius+SWEEP_SKIN);
+				result.Normal.x=(float)-stepX;
+				result.Slide.x=0;
+			}
+			else
+			{
+				result.Pos.z=edgeZ-stepZ*(radius+SWEEP_SKIN);
+				result.Normal.z=(float)-stepZ;
+				result.Slide.z=0;
+			}
+			result.Slide.y=0;
+			return true;
+		}
+
+		// move onto the next boundary
+		if (alongX)
+		{
+			edgeX+=stepX;
+			cellX+=stepX;
+			tNextX+=tDeltaX;
+		}
+		else
+		{
+			edgeZ+=stepZ;
+			cellZ+=stepZ;
+			tNextZ+=tDeltaZ;
 		}
-		return oldPos;
 	}
+}
 
+bool CMaze::IsBlocked(int x,int z)
+{
+	if (z<0 || z>=mDepth || x<0 || x>=mRowLength[z])
+		return true;	// off the map
+	return TestBit(mSolid,z,x);
+}
 
-}
\ No newline at end of file
+bool CMaze::IsAreaBlocked(int x0,int x1,int z0,int z1)
+{
+	if (x0<0 || z0<0 || z1>=mDepth)	return true;	// off the map
+	for(int z=z0;z<=z1;z++)
+		if (FindWall(z,x0)<=x1)	return true;	// (includes the end of the row)
+	return false;
+}
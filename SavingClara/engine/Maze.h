@@ -6,11 +6,30 @@
 #pragma once
 
 #include <vector>
-#include <string>
 #include <d3dx9math.h>	// D3DXVECTOR3
 #include "XMesh.h"	// the mesh class
 
+/** The result of sweeping an object through the maze.
+\see CMaze::SweepCircle()
+*/
+struct SSweepResult
+{
+	bool Hit;	///< whether the move was stopped by a wall
+	float Time;	///< how much of the move (0..1) was completed before the contact
+	D3DXVECTOR3 Pos;	///< where the object ends up (the contact point, or the end of the move)
+	D3DXVECTOR3 Normal;	///< the normal of the wall which was hit (zero if no hit)
+	D3DXVECTOR3 Slide;	///< the remaining move, with the part going into the wall removed
+};
+
 /** The CMaze class provides a simple 2D maze and basic collision detection.
+
+The maze is stored as two bit planes, one bit per cell in each:
+- solid: the cell is not clear (a wall '#', a hot block '%', or anything else)
+- hot: the cell is a hot block '%'
+
+Each row is padded out to a multiple of 128 bits, with the padding marked solid,
+so a row can be scanned a whole SSE register at a time.
+\note any character other than '.', '#' & '%' in the maze file is loaded as a wall
 */
 class CMaze
 {
@@ -22,6 +41,7 @@ public:
 	CMaze(CXMesh* pBlock, CXMesh* hBlock);
     /** init function,loads the maze.
 	If you wish, you may call init a second time to reset the maze
+	\note the file is read in one go (and memory mapped if it is large)
 	*/
 	bool Init(const char* name);
 
@@ -47,6 +67,23 @@ public:
 	bool IsClear(D3DXVECTOR3 pos,float radius);
 
 	bool IsTouchingHot(D3DXVECTOR3 pos,float radius);
+
+	int GetDepth(){return mDepth;}	///< number of rows
+	int GetRowLength(int z){return (z<0 || z>=mDepth)? 0 : mRowLength[z];}	///< number of cells in row z (0 off the map)
+	/// \defgroup MazeRow Row span queries
+	/// These skip over whole runs of cells at a time, so use them rather than
+	/// looping over GetCell() if you are looking along a row.
+	/// @{
+	/** Finds the first cell in row z, at or after x, which is not clear.
+	Cells off the map count as walls (as they do for IsClear()), so if z or x is off the map this is x.
+	\return the cell's x, or GetRowLength(z) if the rest of the row is clear
+	*/
+	int FindWall(int z,int x);
+	/// Finds the first clear cell in row z, at or after x (or -1 if there is none)
+	int FindClear(int z,int x);
+	/// Finds the first hot cell in row z, at or after x (or -1 if there is none)
+	int FindHot(int z,int x);
+	/// @}
 	/** returns a position which will slide along the walls
 	\param oldPos a position for which IsClear() is true
 	\param newPos the desired positon fo move to (may or may not pass IsClear)
@@ -54,8 +91,44 @@ public:
 	\returns a point for which IsClear will be valid
 	*/
 	D3DXVECTOR3 WallSlide(D3DXVECTOR3 oldPos,D3DXVECTOR3 newPos,float radius);
+	/** WallSlide() for a whole group of objects.
+	This is only a convenience loop: each object is swept on its own, nothing is shared between them.
+	\param oldPos,newPos,radius arrays of count elements, as per WallSlide()
+	\param [out]result array of count elements which is filled with the new positions
+	\param count number of objects
+	*/
+	void WallSlide(const D3DXVECTOR3* oldPos,const D3DXVECTOR3* newPos,const float* radius,
+					D3DXVECTOR3* result,int count);
+	/** Sweeps a moving object through the maze, stopping at the first wall it touches.
+	The cells are visited in the order the object enters them (a DDA grid walk),
+	so a fast object cannot jump over a wall, however far it moves in one cycle.
+	\param pos the start position, IsClear(pos,radius) should be true
+	\param move how far the object moves (y value not considered)
+	\param radius the radius parameter for IsClear()
+	\param [out]result the contact time, position, wall normal & the slide vector
+	(it is cleared first, so don't pass in pos or move from it)
+	\return if a wall was hit
+	\note like IsClear(), the object is tested as a square of half-width radius
+	*/
+	bool SweepCircle(const D3DXVECTOR3& pos,const D3DXVECTOR3& move,float radius,SSweepResult& result);
+private:
+	/// returns if the cell is not clear (anything off the map is not clear)
+	bool IsBlocked(int x,int z);
+	/// returns if any cell in the range x0..x1, z0..z1 (inclusive) is not clear
+	bool IsAreaBlocked(int x0,int x1,int z0,int z1);
+	/// returns the bit for cell x,z in a bit plane (no range checking)
+	bool TestBit(const std::vector<unsigned>& plane,int z,int x)
+	{return (plane[z*mRowWords+(x>>5)]>>(x&31))&1;}
+	/** finds the first set bit in row z of a bit plane, at or after x (or -1 if none).
+	\param invert look for the first clear bit instead
+	*/
+	int Scan(const std::vector<unsigned>& plane,bool invert,int z,int x);
 private:
-	std::vector<std::string> mMaze;	// the data
+	int mDepth;	// number of rows
+	int mRowWords;	// 32 bit words per row, in each bit plane
+	std::vector<unsigned> mSolid;	// bit set if a cell is not clear
+	std::vector<unsigned> mHot;	// bit set if a cell is hot
+	std::vector<int> mRowLength;	// cells in each row (rows may be different lengths)
     CXMesh* mpBlock;
 	CXMesh* hotBlock;
 };
@@ -8,33 +8,127 @@
 #include "Collision.h"
 #include "QDraw.h"
 #include "Shot.h"
+#include "Transform.h"
+#include "RenderQueue.h"
 #include "Fail.h"
 
+int CNode::sParentChanges=0;
+
 CNode::CNode(const D3DXVECTOR3& pos,const D3DXVECTOR3& hpr)
-:mPos(pos),mHpr(hpr)
+:mPos(pos),mHpr(hpr),mpParent(NULL),mLocalDirty(true),mBasisDirty(true)
 {}
 
 void CNode::Match(const CNode& other)
 {
 	mPos=other.mPos;
-	mHpr=other.mHpr;
+	SetHpr(other.mHpr);
 }
 
-D3DXVECTOR3 CNode::RotateVector(const D3DXVECTOR3& vec)
+void CNode::ComputeBasis()
 {
-	// rotate vec by the nodes rotation matrix, then return it
+	// the rows of the rotation matrix are where X,Y & Z end up
 	D3DXMATRIX rot;
 	D3DXMatrixRotationYawPitchRoll(&rot, mHpr.x, mHpr.y, mHpr.z);
+	mRight=D3DXVECTOR3(rot._11,rot._12,rot._13);
+	mUp=D3DXVECTOR3(rot._21,rot._22,rot._23);
+	mForward=D3DXVECTOR3(rot._31,rot._32,rot._33);
+	mBasisHpr=mHpr;
+	mBasisDirty=false;
+}
+
+void CNode::SetParent(CNode* pParent,const D3DXVECTOR3& localPos,const D3DXVECTOR3& localHpr)
+{
+	mpParent=pParent;
+	mLocalPos=localPos;
+	mLocalHpr=localHpr;
+	mLocalDirty=true;
+	sParentChanges++;
+	UpdateWorld();
+}
+
+void CNode::UpdateWorld()
+{
+	if (mpParent==NULL)	return;
+	mpParent->UpdateWorld();	// (parents first)
+	UpdateFromParent();
+}
+
+void CNode::UpdateFromParent()
+{
+	// nothing to do, unless something has moved since last time
+	if (mpParent==NULL)	return;
+	if (!mLocalDirty && mpParent->mPos==mParentPos && mpParent->mHpr==mParentHpr)	return;
+	mParentPos=mpParent->mPos;
+	mParentHpr=mpParent->mHpr;
+	mLocalDirty=false;
+
+	mPos=mpParent->OffsetPos(mLocalPos);
+	if (mLocalHpr==D3DXVECTOR3(0,0,0))
+	{
+		SetHpr(mParentHpr);	// the usual case
+		return;
+	}
+	// turn by the local rotation, then the parent's
+	D3DXMATRIX local,parent,world;
+	D3DXMatrixRotationYawPitchRoll(&local,mLocalHpr.x,mLocalHpr.y,mLocalHpr.z);
+	D3DXMatrixRotationYawPitchRoll(&parent,mParentHpr.x,mParentHpr.y,mParentHpr.z);
+	world=local*parent;
+	// & get the angles back out (see D3DXMatrixRotationYawPitchRoll for the parts of the matrix)
+	SetHpr(atan2f(world._31,world._33),asinf(-world._32),atan2f(world._12,world._22));
+}
+
+void CNodeHierarchy::Add(CNode* pNode)
+{
+	mNodes.push_back(pNode);
+	mParentChanges=-1;	// needs sorting
+}
 
-	D3DXVECTOR3 rvec;	// rotated vec
-	D3DXVec3TransformCoord(&rvec, &vec, &rot);
-	return rvec;
+void CNodeHierarchy::Remove(CNode* pNode)
+{
+	for(unsigned i=0;i<mNodes.size();i++)
+	{
+		if (mNodes[i]==pNode)
+		{
+			mNodes.erase(mNodes.begin()+i);	// (keeps the order)
+			return;
+		}
+	}
+}
+
+void CNodeHierarchy::Sort()
+{
+	// how deep is each node?
+	std::vector<int> depth(mNodes.size());
+	int deepest=0;
+	for(unsigned i=0;i<mNodes.size();i++)
+	{
+		depth[i]=0;
+		for(CNode* p=mNodes[i]->mpParent;p;p=p->mpParent)
+			depth[i]++;
+		if (depth[i]>deepest)	deepest=depth[i];
+	}
+	// then all the ones at each depth in turn
+	std::vector<CNode*> sorted;
+	sorted.reserve(mNodes.size());
+	for(int d=0;d<=deepest;d++)
+	{
+		for(unsigned i=0;i<mNodes.size();i++)
+		{
+			if (depth[i]==d)	sorted.push_back(mNodes[i]);
+		}
+	}
+	mNodes.swap(sorted);
+	mParentChanges=CNode::sParentChanges;
 }
 
-D3DXVECTOR3 CNode::OffsetPos(const D3DXVECTOR3& offset)
+void CNodeHierarchy::Update()
 {
-	return mPos + RotateVector(offset);
+	if (mParentChanges!=CNode::sParentChanges)	Sort();
+	// parents are always before their children, so one pass does it
+	for(unsigned i=0;i<mNodes.size();i++)
+		mNodes[i]->UpdateFromParent();
 }
+
 void CNode::Move(const D3DXVECTOR3& vec)
 {
 	// use RotateVector to change the mPos
@@ -45,8 +139,9 @@ void CNode::Move(const D3DXVECTOR3& vec)
 void CNode::MoveGround(const D3DXVECTOR3& delta)
 {
 	// use RotateVector to change the mPos
-	mPos.x += RotateVector(delta).x;
-	mPos.z += RotateVector(delta).z;
+	D3DXVECTOR3 move=RotateVector(delta);
+	mPos.x += move.x;
+	mPos.z += move.z;
 	// but make sure you don't change Y value
 }
 
@@ -68,7 +163,7 @@ void CNode::SetLookDirection(const D3DXVECTOR3& dir)
 	yaw = atan2(dir.x, dir.z);
 	pitch = -asin(dir.y/len);
 
-	mHpr = D3DXVECTOR3(yaw,pitch,0);
+	SetHpr(yaw,pitch,0);
 	// you will need to use an atan2() and an asin()
 	// (look them up in your C++ reference)
 }
@@ -85,7 +180,7 @@ void CMeshNode::Init(CXMesh* pMesh,const D3DXVECTOR3& pos,
 	mScale=scale;
 	mLife=life;
 	mPos=pos;
-	mHpr=turn;
+	SetHpr(turn);
 }
 
 void CMeshNode::Damage(float dam){mLife-=dam;}
@@ -94,16 +189,30 @@ void CMeshNode::Destroy(){mLife=0;}
 
 float CMeshNode::GetBoundingRadius(){return mpMesh->GetRadius() * mScale;}
 
+void CMeshNode::GetWorldMatrix(D3DXMATRIX& world)
+{
+	// scale * rotation * translation, straight from the basis
+	D3DXVECTOR3 right, up, fore;
+	GetBasis(right, up, fore);
+	right*=mScale;	up*=mScale;	fore*=mScale;
+	world=D3DXMATRIX(	right.x,	right.y,	right.z,	0,
+						up.x,		up.y,		up.z,		0,
+						fore.x,		fore.y,		fore.z,		0,
+						mPos.x,		mPos.y,		mPos.z,		1);
+}
+
 void CMeshNode::Draw()
 {
-	D3DXMATRIX trans, scale, rot, world;
-	D3DXMatrixTranslation(&trans, mPos.x, mPos.y, mPos.z);
-	D3DXMatrixScaling(&scale, mScale, mScale, mScale);
-	D3DXMatrixRotationYawPitchRoll(&rot, mHpr.x, mHpr.y, mHpr.z);
-	world = scale * rot * trans;
+	D3DXMATRIX world;
+	GetWorldMatrix(world);
 	mpMesh->Draw(world);
-	// setup the matrixes and multiply them together
-	// then call the mesh's draw function
+}
+
+void CMeshNode::Submit(CRenderQueue& queue,int layer)
+{
+	D3DXMATRIX world;
+	GetWorldMatrix(world);
+	queue.Add(mpMesh,world,layer);
 }
 
 void CMeshNode::DrawBounds(IDirect3DDevice9* pDev,float factor)
@@ -121,7 +230,7 @@ void CCameraNode::Init(const D3DXVECTOR3& pos,const D3DXVECTOR3& turn,
 			float fov, float aspect,float nearDist,float farDist)
 {
 	mPos=pos;
-	mHpr=turn;
+	SetHpr(turn);
 	mFov=fov;
 	mAspect=aspect;
 	mNear=nearDist;
@@ -170,16 +279,8 @@ void CCameraNode::GetProjectionMatrix( D3DXMATRIX& outMatrix )
 
 void CCameraNode::GetViewMatrix( D3DXMATRIX& outMatrix )
 {
-	const D3DXVECTOR3 FORWARD(0,0,1), UP(0,1,0), RIGHT(1,0,0);
-
-	D3DXMATRIX rot;
-	D3DXMatrixRotationYawPitchRoll(&rot, mHpr.x, mHpr.y, mHpr.z);
-
 	D3DXVECTOR3 fore, up, right;
-
-	D3DXVec3TransformCoord(&fore, &FORWARD, &rot);
-	D3DXVec3TransformCoord(&up, &UP, &rot);
-	D3DXVec3TransformCoord(&right, &RIGHT, &rot);
+	GetBasis(right, up, fore);
 
 	float theX = -D3DXVec3Dot(&right,&mPos);
 	float theY = -D3DXVec3Dot(&up, &mPos);
@@ -211,16 +312,27 @@ void CCameraNode::GetViewMatrix( D3DXMATRIX& outMatrix )
 	// get the rotation matrix
 }
 
-void DrawMeshNodes(const std::vector<CMeshNode*>& nodes)
+void DrawMeshNodes(const std::vector<CMeshNode*>& nodes,CRenderQueue* pQueue)
 {
+	// work out all the world matrices together
+	static CTransformBatch batch;
+	batch.Clear();
 	for(int i=0; i<nodes.size(); i++)
 	{
 		if(nodes[i]->IsAlive())
-		{
-			nodes[i]->Draw();
-		}
+			batch.Add(nodes[i]->mPos, nodes[i]->mHpr, nodes[i]->mScale);
+	}
+	batch.Build();
+	// then for each node, if its alive, draw it
+	int b=0;
+	for(int i=0; i<(int)nodes.size(); i++)
+	{
+		if(nodes[i]->IsAlive()==false)	continue;
+		if (pQueue)
+			pQueue->Add(nodes[i]->mpMesh,batch.GetMatrix(b++));
+		else
+			nodes[i]->mpMesh->Draw(batch.GetMatrix(b++));
 	}
-	// for each node, if its alive, draw it
 }
 
 void DrawMeshNodeBounds(const std::vector<CMeshNode*>& nodes,IDirect3DDevice9* pDev)
@@ -268,16 +380,7 @@ void UpdateMeshNodes(const std::vector<CMeshNode*>& nodes,float dt)
 
 void DeleteDeadMeshNodes(std::vector<CMeshNode*>& vec)
 {
-	// this is a bit tricky, so here it is in full
-	for(int i=(int)vec.size()-1;i>=0;i--)
-	{
-		if (vec[i]->IsAlive()==false)
-		{
-			delete vec[i];	// deletes the object
-			// removed item at index 'i', by shifting down the items
-			vec.erase(vec.begin()+i);
-		}
-	}
+	RemoveDead(vec);	// see Node.h
 }
 
 void DeleteMeshNodes(std::vector<CMeshNode*>& vec)
@@ -9,6 +9,8 @@
 #include <d3dx9.h>
 #include "XMesh.h"
 
+class CRenderQueue;
+
 /** The CNode class is the basic (position & orientation) class.
 It provides basic movement capabilities & little else.
 Its derived classes are the main things to use:
@@ -22,7 +24,7 @@ class CNode
 public:	// data is public, though not often used
 	D3DXVECTOR3 mPos;	///< position
 	D3DXVECTOR3 mOldPos;
-	D3DXVECTOR3 mHpr;	///< turning (yaw/heading, pitch, roll in radians)
+	D3DXVECTOR3 mHpr;	///< turning (yaw/heading, pitch, roll in radians), use SetHpr() to change it
 public:
 
 	CNode(const D3DXVECTOR3& pos=D3DXVECTOR3(0,0,0),
@@ -43,8 +45,8 @@ public:
 	if you roll 90 degrees counter clockwise, then pitch up, you just pitch up.
 	*/
 	const D3DXVECTOR3& GetHpr(){return mHpr;}
-	void SetHpr(const D3DXVECTOR3& hpr){mHpr=hpr;}
-	void SetHpr(float h, float p, float r){mHpr=D3DXVECTOR3(h,p,r);}
+	void SetHpr(const D3DXVECTOR3& hpr){mHpr=hpr;mBasisDirty=true;}
+	void SetHpr(float h, float p, float r){mHpr=D3DXVECTOR3(h,p,r);mBasisDirty=true;}
 
 	/// Sets this nodes position & orientation to match the other
 	void Match(const CNode& other);
@@ -65,8 +67,14 @@ public:
 							node.GetPos();
 	\endcode
 	\see OffsetPos to get the direction+ the current position
+	\note the rotation is worked out once & kept until the orientation changes,
+	so this is cheap to call lots of times.
 	*/
-	D3DXVECTOR3 RotateVector(const D3DXVECTOR3& vec);
+	D3DXVECTOR3 RotateVector(const D3DXVECTOR3& vec)
+	{
+		UpdateBasis();
+		return vec.x*mRight+vec.y*mUp+vec.z*mForward;
+	}
 
 	/** returns a position offset from the Node, based upon its orientation.
 	This is very useful for getting a positon infront of behind the node.
@@ -81,7 +89,14 @@ public:
 	\endcode
 	\see RotateVector to get just the direction
 	*/
-	D3DXVECTOR3 OffsetPos(const D3DXVECTOR3& offset);
+	D3DXVECTOR3 OffsetPos(const D3DXVECTOR3& offset){return mPos + RotateVector(offset);}
+
+	/// returns the node's right (+X), up (+Y) & forward (+Z) directions
+	void GetBasis(D3DXVECTOR3& right,D3DXVECTOR3& up,D3DXVECTOR3& forward)
+	{
+		UpdateBasis();
+		right=mRight;	up=mUp;	forward=mForward;
+	}
 
 	/// \defgroup NodeMove Movement code for CNode,CMeshNode & CCamera
 	/// @{
@@ -120,13 +135,13 @@ public:
 	/// \see Move() for full details
 	void MoveGround(const D3DXVECTOR3& delta);
 	/// Yaws the by the amount of radians, this is turning right
-	void Yaw(float amount){mHpr.x+=amount;}
+	void Yaw(float amount){mHpr.x+=amount;mBasisDirty=true;}
 	/// Pitches the by the amount of radians, this is turning down
-	void Pitch(float amount){mHpr.y+=amount;}
+	void Pitch(float amount){mHpr.y+=amount;mBasisDirty=true;}
 	/// Rolls the by the amount of radians, this is counter clockwise (left down,right up)
-	void Roll(float amount){mHpr.z+=amount;}
+	void Roll(float amount){mHpr.z+=amount;mBasisDirty=true;}
 	/// Turns (yaw,pitch,roll) the the specfied amount
-	void Turn(const D3DXVECTOR3& turn){mHpr+=turn;}
+	void Turn(const D3DXVECTOR3& turn){mHpr+=turn;mBasisDirty=true;}
 
 	/// @}
 	/** makes the node look at the a point in space.
@@ -169,9 +184,86 @@ public:
 	\see LookAt for information on looking AT a position 
 	*/
 	void SetLookDirection(const D3DXVECTOR3& dir);
+
+	/// \defgroup NodeParent Attaching nodes to other nodes
+	/// A node can be attached to a parent (eg. a wand to the player's hand), so it moves & turns with it.
+	/// Its position & orientation are then set relative to the parent (SetLocalPos(), SetLocalHpr())
+	/// & mPos/mHpr are worked out from them by UpdateWorld() (or by a CNodeHierarchy).
+	/// This is only done if the parent (or the local position) has changed since last time,
+	/// so a node attached to a parent which is standing still costs nothing.
+	/// @{
+	/** Attaches the node to a parent (or detaches it).
+	\param pParent the node to follow (NULL to detach, the node then stays where it is)
+	\param localPos the position relative to the parent (as in OffsetPos())
+	\param localHpr the orientation relative to the parent
+	*/
+	void SetParent(CNode* pParent,const D3DXVECTOR3& localPos=D3DXVECTOR3(0,0,0),
+					const D3DXVECTOR3& localHpr=D3DXVECTOR3(0,0,0));
+	CNode* GetParent(){return mpParent;}
+	const D3DXVECTOR3& GetLocalPos(){return mLocalPos;}
+	void SetLocalPos(const D3DXVECTOR3& pos){mLocalPos=pos;mLocalDirty=true;}
+	const D3DXVECTOR3& GetLocalHpr(){return mLocalHpr;}
+	void SetLocalHpr(const D3DXVECTOR3& hpr){mLocalHpr=hpr;mLocalDirty=true;}
+	/// turns the node relative to its parent
+	void TurnLocal(const D3DXVECTOR3& turn){mLocalHpr+=turn;mLocalDirty=true;}
+	/// works out mPos & mHpr from the parent (& its parent & so on), if anything has changed
+	void UpdateWorld();
+	/// @}
+protected:
+	/// \internal works out mRight,mUp & mForward, if the orientation has changed
+	/// (mHpr is public, so its checked as well, in case someone changed it directly)
+	void UpdateBasis()
+	{
+		if (mBasisDirty || mHpr!=mBasisHpr)	ComputeBasis();
+	}
+	/// \internal always works out mRight,mUp & mForward
+	void ComputeBasis();
+	/// \internal works out mPos & mHpr, assuming the parent is up to date
+	void UpdateFromParent();
 private:
+	friend class CNodeHierarchy;
 	CNode(const CNode&); // no copying
 	void operator=(const CNode&); // no copying
+
+	// the parent & where this is relative to it
+	CNode* mpParent;
+	D3DXVECTOR3 mLocalPos,mLocalHpr;
+	D3DXVECTOR3 mParentPos,mParentHpr;	// where the parent was, when mPos & mHpr were last worked out
+	bool mLocalDirty;	// set when the local position or orientation changes
+	static int sParentChanges;	// goes up each time any node changes its parent
+
+	// the rotation for mHpr (the rows of its matrix), worked out when its needed
+	D3DXVECTOR3 mRight,mUp,mForward;
+	D3DXVECTOR3 mBasisHpr;	// the mHpr they were worked out for
+	bool mBasisDirty;	// set when mHpr changes
+};
+
+/** A set of attached nodes, which are updated together.
+The nodes are kept in breadth first order (the roots, then their children, then theirs & so on),
+so Update() is one pass down the list: each node's parent is always done before it.
+\code
+mWand.SetParent(&mPlayer,D3DXVECTOR3(0.1f,-0.1f,0.1f));
+mAttachments.Add(&mWand);
+...
+// after the player has moved
+mAttachments.Update();
+\endcode
+*/
+class CNodeHierarchy
+{
+public:
+	CNodeHierarchy():mParentChanges(-1){}
+	/// adds a node (its parent does not need to be added, unless it has a parent of its own)
+	void Add(CNode* pNode);
+	void Remove(CNode* pNode);
+	/// works out the position & orientation of all the attached nodes (which need it)
+	void Update();
+private:
+	/// \internal puts the nodes into breadth first order
+	void Sort();
+
+	std::vector<CNode*> mNodes;
+	int mParentChanges;	// CNode::sParentChanges when they were last sorted
 };
 
 /** CMeshNode is the basic actor class with a mesh & life.
@@ -229,6 +321,10 @@ public:
 	  But it does not check to see if the object is alive (caller is expected to do that)
 	*/
 	virtual void Draw();
+	/// adds the object to the render queue, rather than drawing it now
+	void Submit(CRenderQueue& queue,int layer=0);
+	/// works out the world matrix (scale * rotation * translation)
+	void GetWorldMatrix(D3DXMATRIX& world);
 	/** Draws the objects bounding sphere.
 	\see CollisionMeshNode() for information on the factor
 	*/
@@ -279,8 +375,11 @@ void UpdateMeshNodes(const std::vector<CMeshNode*>& nodes,float dt);
 /** Draws all living members of the group.
 This code can be though of as: (foreach living object: call Draw)
 \param nodes the vector of CMeshNodes
+\param pQueue the render queue to add them to (NULL to draw them now)
+\note the world matrices are all worked out together (see CTransformBatch), then each mesh is drawn.
+	So if a derived class overrides Draw(), draw those yourself.
 */
-void DrawMeshNodes(const std::vector<CMeshNode*>& nodes);
+void DrawMeshNodes(const std::vector<CMeshNode*>& nodes,CRenderQueue* pQueue=NULL);
 
 /** Draws the bounds of all living members of the group.
 This code can be though of as: (foreach living object: call Draw)
@@ -330,6 +429,47 @@ DeleteDeadMeshNodes(vec); // remove dead ones
 */
 void DeleteDeadMeshNodes(std::vector<CMeshNode*>& vec);
 
+/** Deletes all the dead nodes in the vector, in a single pass.
+This is what DeleteDeadMeshNodes() does, but for a vector of any CMeshNode derived class
+(eg. std::vector<Enemy*>).
+Rather than erase()'ing each dead node (which moves everything after it, every time),
+the living nodes are moved down over the dead ones in one go, so killing lots at once is still quick.
+\param vec the vector of nodes
+\param keepOrder if true the living nodes stay in the same order.
+	If false each dead node is replaced by the last one instead, which moves fewer nodes but mixes up the order.
+\warning as DeleteDeadMeshNodes(), DO NOT call this inside a loop over the vector.
+*/
+template<class T>
+void RemoveDead(std::vector<T*>& vec,bool keepOrder=true)
+{
+	if (keepOrder)
+	{
+		size_t alive=0;
+		for(size_t i=0;i<vec.size();i++)
+		{
+			if (vec[i]->IsAlive())
+				vec[alive++]=vec[i];	// keep it
+			else
+				delete vec[i];
+		}
+		vec.resize(alive);
+	}
+	else
+	{
+		for(size_t i=0;i<vec.size();)
+		{
+			if (vec[i]->IsAlive())
+				i++;
+			else
+			{
+				delete vec[i];
+				vec[i]=vec.back();	// the last one fills the gap (& is checked next)
+				vec.pop_back();
+			}
+		}
+	}
+}
+
 void NormalizeRotation(CMeshNode* nodes);
 
 ///@}
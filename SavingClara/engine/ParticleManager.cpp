@@ -0,0 +1,207 @@
+/*==============================================
+ * Particle Manager
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#include <math.h>
+#include "ParticleManager.h"
+
+// particles per job: enough to make the job worth handing out
+const int DEFAULT_CHUNK_SIZE=2048;
+// emit budget when there is no limit
+const int NO_BUDGET=0x7FFFFFFF;
+// how quickly the emission is cut down & restored per frame
+const float BUDGET_CUT=0.5f,BUDGET_RESTORE=0.05f;
+// below this the emission is cut off altogether
+const float MIN_EMIT_SCALE=0.05f;
+// restore once its below this fraction of the budget (so it doesn't flicker over & under)
+const float BUDGET_SLACK=0.75f;
+
+CParticleManager::CParticleManager(int threads):
+	mPool(threads)
+{
+	mChunkSize=DEFAULT_CHUNK_SIZE;
+	mpCamera=NULL;
+	mMaxParticles=0;
+	mMaxTime=0;
+	mEmitBudget=NO_BUDGET;
+	mUpdateTime=0;
+	QueryPerformanceFrequency(&mTimerFreq);
+}
+
+CParticleManager::~CParticleManager()
+{
+	mRecorder.Stop();	// (before the systems go)
+	for(unsigned i=0;i<mSystems.size();i++)
+		delete mSystems[i];
+	mSystems.clear();
+}
+
+void CParticleManager::UpdateChunk(void* pData,int begin,int end)
+{
+	SChunkJob* pJob=(SChunkJob*)pData;
+	pJob->pSystem->UpdateRange(begin,end,pJob->DeltaTime);
+}
+
+bool CParticleManager::StartRecording(const char* filename)
+{
+	if (!mRecorder.Start(filename))	return false;
+	for(unsigned i=0;i<mSystems.size();i++)
+		mRecorder.Add(mSystems[i]);
+	return true;
+}
+
+void CParticleManager::SetBudget(int maxParticles,float maxTime)
+{
+	mMaxParticles=maxParticles;
+	mMaxTime=maxTime;
+	mEmitBudget=(mMaxParticles>0)? mMaxParticles-GetBudgetedCount() : NO_BUDGET;
+}
+
+int CParticleManager::GetTotalCount()
+{
+	int total=0;
+	for(unsigned i=0;i<mSystems.size();i++)
+		total+=mSystems[i]->GetCount();
+	return total;
+}
+
+int CParticleManager::GetBudgetedCount()
+{
+	int total=0;
+	for(unsigned i=0;i<mSystems.size();i++)
+	{
+		if (mSystems[i]->IsBudgeted())
+			total+=mSystems[i]->GetCount();
+	}
+	return total;
+}
+
+void CParticleManager::UpdateLod()
+{
+	if (mpCamera==NULL)	return;
+	// zoom relative to the normal 45 degree view, so zooming in gives more detail
+	float zoom=tanf(D3DX_PI/8)/tanf(mpCamera->GetFov()/2);
+	for(unsigned i=0;i<mSystems.size();i++)
+		mSystems[i]->SetLodView(mpCamera->GetPos(),zoom);
+}
+
+void CParticleManager::UpdateBudget()
+{
+	int total=GetBudgetedCount();
+	// (if the emit budget ran out, someone probably went without)
+	bool over=(mMaxParticles>0 && (total>mMaxParticles || mEmitBudget<=0)) ||
+				(mMaxTime>0 && mUpdateTime>mMaxTime);
+	bool under=(mMaxParticles<=0 || total<mMaxParticles*BUDGET_SLACK) &&
+				(mMaxTime<=0 || mUpdateTime<mMaxTime*BUDGET_SLACK);
+	CParticleSystem* pPick=NULL;
+	if (over)
+	{
+		// cut down the lowest priority which is still emitting
+		// (the top priority is never cut, its only held to the emit budget)
+		int top=0;
+		bool first=true;
+		for(unsigned i=0;i<mSystems.size();i++)
+		{
+			if (!mSystems[i]->IsBudgeted())	continue;
+			if (first || mSystems[i]->GetSettings().Priority>top)
+				top=mSystems[i]->GetSettings().Priority;
+			first=false;
+		}
+		for(unsigned i=0;i<mSystems.size();i++)
+		{
+			CParticleSystem* pSys=mSystems[i];
+			if (pSys->IsBudgeted() && pSys->GetEmitScale()>0 && pSys->GetSettings().Priority<top &&
+				(pPick==NULL || pSys->GetSettings().Priority<pPick->GetSettings().Priority))
+				pPick=pSys;
+		}
+		if (pPick)
+		{
+			float scale=pPick->GetEmitScale()*BUDGET_CUT;
+			pPick->SetEmitScale(scale<MIN_EMIT_SCALE? 0 : scale);
+		}
+	}
+	else if (under)
+	{
+		// restore the highest priority which was cut down
+		for(unsigned i=0;i<mSystems.size();i++)
+		{
+			CParticleSystem* pSys=mSystems[i];
+			if (pSys->GetEmitScale()<1 &&
+				(pPick==NULL || pSys->GetSettings().Priority>pPick->GetSettings().Priority))
+				pPick=pSys;
+		}
+		if (pPick)
+		{
+			float scale=pPick->GetEmitScale()+BUDGET_RESTORE;
+			pPick->SetEmitScale(scale>1? 1 : scale);
+		}
+	}
+	// what is left can be emitted before the next update
+	mEmitBudget=(mMaxParticles>0)? mMaxParticles-total : NO_BUDGET;
+}
+
+void CParticleManager::Update(float inDeltaTime)
+{
+	LARGE_INTEGER start,end;
+	QueryPerformanceCounter(&start);
+	UpdateLod();
+
+	// new particles are added on this thread (emitters use the nodes & random numbers)
+	for(unsigned i=0;i<mSystems.size();i++)
+		mSystems[i]->BeginUpdate(inDeltaTime);
+	// (the moves are recorded after all of that, so each is followed by its ground heights & nothing else)
+	for(unsigned i=0;i<mSystems.size();i++)
+	{
+		if (mSystems[i]->GetRecorder())
+			mSystems[i]->GetRecorder()->RecordMove(mSystems[i],inDeltaTime);
+	}
+
+	// then share the moving out between all the threads
+	mJobs.resize(mSystems.size());
+	for(unsigned i=0;i<mSystems.size();i++)
+	{
+		mJobs[i].pSystem=mSystems[i];
+		mJobs[i].DeltaTime=inDeltaTime;
+		int count=mSystems[i]->GetCount();
+		for(int begin=0;begin<count;begin+=mChunkSize)
+		{
+			int end=begin+mChunkSize;
+			if (end>count)	end=count;
+			mPool.Add(UpdateChunk,&mJobs[i],begin,end);
+		}
+	}
+	mPool.Wait();
+
+	// & tidy up
+	for(unsigned i=0;i<mSystems.size();i++)
+	{
+		if (mSystems[i]->GetRecorder())
+			mSystems[i]->GetRecorder()->RecordGround(mSystems[i]);
+		mSystems[i]->EndUpdate(inDeltaTime);
+	}
+
+	QueryPerformanceCounter(&end);
+	mUpdateTime=(float)(end.QuadPart-start.QuadPart)/mTimerFreq.QuadPart;
+	UpdateBudget();
+	mRecorder.EndFrame();
+}
+
+void CParticleManager::Draw(const D3DXMATRIX& world)
+{
+	for(unsigned i=0;i<mSystems.size();i++)
+		mSystems[i]->Draw(world);
+}
+
+void CParticleManager::OnLostDevice()
+{
+	for(unsigned i=0;i<mSystems.size();i++)
+		mSystems[i]->OnLostDevice();
+}
+
+void CParticleManager::OnResetDevice()
+{
+	for(unsigned i=0;i<mSystems.size();i++)
+		mSystems[i]->OnResetDevice();
+}
@@ -0,0 +1,121 @@
+/*==============================================
+ * Particle Manager
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#pragma once
+
+#include <vector>
+#include "ParticleSystem.h"
+#include "JobPool.h"
+#include "ParticleRecorder.h"
+#include "Node.h"
+
+/** Owns & updates all the particle systems.
+All the systems are updated together on a CJobPool: each system's particles are split into
+chunks & the chunks are shared out between the threads.
+Update() does not return until they are all done, so its safe to draw afterwards.
+
+It also keeps the particles within a budget (see SetBudget()): far away effects emit less
+(see SParticleSetting::LodDistance) & when its over budget the lowest priority systems are cut down first
+(see SParticleSetting::Priority), so a big fight cannot make the frame time run away.
+
+\code
+mpParticles=new CParticleManager();
+mpFire=mpParticles->Add(new CParticleSystem());
+...
+mpParticles->Update(dt);
+mpParticles->Draw(IDENTITY_MAT);
+...
+SAFE_DELETE(mpParticles);	// deletes mpFire as well
+\endcode
+*/
+class CParticleManager
+{
+public:
+	/** Constructor.
+	\param threads number of worker threads (0 for one per processor, less one for the main thread)
+	*/
+	CParticleManager(int threads=0);
+	/// deletes all the particle systems
+	~CParticleManager();
+
+	/// adds a particle system (the manager will delete it)
+	template<class T>
+	T* Add(T* pSystem)
+	{
+		if (pSystem->IsBudgeted())
+			pSystem->SetEmitBudget(&mEmitBudget);
+		mSystems.push_back(pSystem);
+		mRecorder.Add(pSystem);	// (if its recording)
+		return pSystem;
+	}
+
+	/// updates all the particle systems (in parallel)
+	void Update(float inDeltaTime);
+	/// draws all the particle systems (in the order they were added)
+	void Draw(const D3DXMATRIX& world);
+
+	// helpers for deling with resetting of the screen
+	void OnLostDevice();	// called just before reset device
+	void OnResetDevice();	// called just after reset device
+
+	/// sets the camera, for the level of detail (NULL for none)
+	void SetCamera(CCameraNode* pCamera){mpCamera=pCamera;}
+	/** Sets the particle budget.
+	If there are more than maxParticles particles, or Update() takes longer than maxTime,
+	the emission of the lowest priority system is cut down, a bit more each frame until its under budget
+	(the top priority systems are never cut down, but are still held to the budget).
+	Its restored slowly (highest priority first) once there is room again.
+	The particles emitted between updates are also limited so the total stays under maxParticles.
+	Systems which aren't budgeted (see CParticleSystem::IsBudgeted(), eg. the precipitation) are left out
+	& don't count towards maxParticles, so size it for the rest.
+	\param maxParticles the max particles in all the systems (0 for no limit)
+	\param maxTime the max time for Update() in seconds (0 for no limit)
+	*/
+	void SetBudget(int maxParticles,float maxTime);
+	/// number of particles in all the systems
+	int GetTotalCount();
+	/// number of particles in the systems which are held to the budget
+	int GetBudgetedCount();
+	/// how long the last Update() took in seconds
+	float GetUpdateTime(){return mUpdateTime;}
+
+	/** Starts recording all the systems to a file, for CParticlePlayer.
+	A frame is recorded for each Update().
+	\return false if the file could not be opened
+	*/
+	bool StartRecording(const char* filename);
+	void StopRecording(){mRecorder.Stop();}
+	bool IsRecording(){return mRecorder.IsRecording();}
+
+	/// sets how many particles are given to each job (rounded up to a multiple of 4, at least 4)
+	void SetChunkSize(int size){mChunkSize=(size<4)? 4 : (size+3)&~3;}
+	CJobPool& GetJobPool(){return mPool;}
+private:
+	/// \internal the job which updates one chunk of a system
+	static void UpdateChunk(void* pData,int begin,int end);
+	/// \internal passes the camera to the systems
+	void UpdateLod();
+	/// \internal cuts down or restores the systems' emission, depending upon the budget
+	void UpdateBudget();
+	/// \internal what UpdateChunk needs to know
+	struct SChunkJob
+	{
+		CParticleSystem* pSystem;
+		float DeltaTime;
+	};
+
+	std::vector<CParticleSystem*> mSystems;
+	std::vector<SChunkJob> mJobs;	// one per system
+	CJobPool mPool;
+	int mChunkSize;
+	CCameraNode* mpCamera;
+	int mMaxParticles;	// the budget (0 for none)
+	float mMaxTime;	// max time for Update (0 for none)
+	int mEmitBudget;	// particles which may still be emitted, shared with the systems
+	float mUpdateTime;	// how long the last Update took
+	LARGE_INTEGER mTimerFreq;
+	CParticleRecorder mRecorder;
+};
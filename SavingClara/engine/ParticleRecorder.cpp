@@ -0,0 +1,533 @@
+/*==============================================
+ * Particle Recorder & Player
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#include <stdio.h>
+#include <string.h>
+#include "ParticleRecorder.h"
+#include "JobPool.h"
+#include "Random.h"
+
+// start of the file: 'PREC' & the version
+const unsigned RECORD_MAGIC=0x43455250;
+const int RECORD_VERSION=2;
+// the most systems a recording can have (an id past this means its corrupt)
+const int MAX_RECORDED_SYSTEMS=0x10000;
+
+// the events in the file, each is followed by the system's id & then the details
+enum
+{
+	EVENT_INIT,	// type, settings, ramps (& the box for precipitation)
+	EVENT_ADD,	// AddParticle()
+	EVENT_EMIT,	// Emit() (after the level of detail)
+	EVENT_EXPLODE,	// CExplosion::Explode() (after the level of detail)
+	EVENT_MOVE,	// delta time, count & centre: the particles are moved
+	EVENT_FRAME,	// end of the frame (no id)
+	EVENT_GROUND,	// count & the ground height under each particle (after its MOVE)
+	EVENT_CUT	// count: the particles are cut down to this many
+};
+
+//*****************************************************************************
+// Recorder
+//***************
+
+CParticleRecorder::CParticleRecorder()
+{
+}
+
+CParticleRecorder::~CParticleRecorder()
+{
+	Stop();
+}
+
+bool CParticleRecorder::Start(const char* filename)
+{
+	Stop();
+	mFile.open(filename,std::ios::out|std::ios::binary|std::ios::trunc);
+	if (!mFile.is_open())	return false;
+	Write(RECORD_MAGIC);
+	Write(RECORD_VERSION);
+	return true;
+}
+
+void CParticleRecorder::Stop()
+{
+	for(unsigned i=0;i<mSystems.size();i++)
+		mSystems[i]->SetRecorder(NULL,0);
+	mSystems.clear();
+	if (mFile.is_open())
+		mFile.close();
+}
+
+void CParticleRecorder::Add(CParticleSystem* pSystem)
+{
+	if (!IsRecording())	return;
+	pSystem->SetRecorder(this,(int)mSystems.size());
+	mSystems.push_back(pSystem);
+
+	int type=RECORDED_PARTICLE_SYSTEM;
+	if (dynamic_cast<CPrecipitation*>(pSystem))	type=RECORDED_PRECIPITATION;
+	if (dynamic_cast<CExplosion*>(pSystem))	type=RECORDED_EXPLOSION;
+	WriteEvent(EVENT_INIT,pSystem);
+	Write(type);
+	Write(pSystem->mSettings);
+	// the ramps it has already (the rest will be made again as the particles are added)
+	int keys=(int)pSystem->mRampKeys.size();
+	Write(keys);
+	for(int i=0;i<keys;i++)
+		Write(pSystem->mRampKeys[i]);
+	if (type==RECORDED_PRECIPITATION)
+		Write(((CPrecipitation*)pSystem)->GetDimension());
+	if (type==RECORDED_EXPLOSION)
+		Write(((CExplosion*)pSystem)->mRandomRamps);
+}
+
+void CParticleRecorder::EndFrame()
+{
+	if (!IsRecording())	return;
+	Write((unsigned char)EVENT_FRAME);
+}
+
+void CParticleRecorder::RecordAdd(CParticleSystem* pSystem,const D3DXVECTOR3& pos,const D3DXVECTOR3& vel,
+								const D3DXCOLOR& startCol,const D3DXCOLOR& endCol,float lifeTime)
+{
+	WriteEvent(EVENT_ADD,pSystem);
+	Write(pos);	Write(vel);
+	Write(startCol);	Write(endCol);
+	Write(lifeTime);
+}
+
+void CParticleRecorder::RecordEmit(CParticleSystem* pSystem,int count,const D3DXVECTOR3& pos,const D3DXVECTOR3& dir,
+								float angle,float minSpeed,float maxSpeed,
+								const D3DXCOLOR& startCol,const D3DXCOLOR& endCol,float lifeTime)
+{
+	WriteEvent(EVENT_EMIT,pSystem);
+	WriteRandom();
+	Write(count);
+	Write(pos);	Write(dir);
+	Write(angle);	Write(minSpeed);	Write(maxSpeed);
+	Write(startCol);	Write(endCol);
+	Write(lifeTime);
+}
+
+void CParticleRecorder::RecordExplode(CParticleSystem* pSystem,const D3DXVECTOR3& pos,
+								const D3DXCOLOR* startCol,const D3DXCOLOR* endCol,float speed,int number)
+{
+	WriteEvent(EVENT_EXPLODE,pSystem);
+	WriteRandom();
+	Write(pos);
+	Write(speed);
+	Write(number);
+	bool coloured=(startCol!=NULL);
+	Write(coloured);
+	if (coloured)
+	{
+		Write(*startCol);
+		Write(*endCol);
+	}
+}
+
+void CParticleRecorder::RecordMove(CParticleSystem* pSystem,float inDeltaTime)
+{
+	WriteEvent(EVENT_MOVE,pSystem);
+	Write(inDeltaTime);
+	Write(pSystem->mCount);
+	// precipitation moves about
+	D3DXVECTOR3 centre(0,0,0);
+	CPrecipitation* pPrecipitation=dynamic_cast<CPrecipitation*>(pSystem);
+	if (pPrecipitation)	centre=pPrecipitation->GetCentre();
+	Write(centre);
+}
+
+void CParticleRecorder::RecordGround(CParticleSystem* pSystem)
+{
+	if (!pSystem->CollidesWithGround())	return;
+	WriteEvent(EVENT_GROUND,pSystem);
+	int count=pSystem->mCount;
+	Write(count);
+	if (count>0)
+		mFile.write((const char*)&pSystem->mGroundHeight[0],count*sizeof(float));
+}
+
+void CParticleRecorder::RecordCut(CParticleSystem* pSystem)
+{
+	WriteEvent(EVENT_CUT,pSystem);
+	Write(pSystem->mCount);
+}
+
+void CParticleRecorder::WriteEvent(int type,CParticleSystem* pSystem)
+{
+	Write((unsigned char)type);
+	Write(pSystem->GetRecordId());
+}
+
+void CParticleRecorder::WriteRandom()
+{
+	unsigned state[4];
+	CRandom::Get().GetState(state);
+	mFile.write((const char*)state,sizeof(state));
+}
+
+//*****************************************************************************
+// Player
+//***************
+
+/// makes the normal particle systems
+static CParticleSystem* CreateSystem(ERecordedSystem type)
+{
+	switch(type)
+	{
+	case RECORDED_PRECIPITATION:	return new CPrecipitation();
+	case RECORDED_EXPLOSION:	return new CExplosion();
+	default:	return new CParticleSystem();
+	}
+}
+
+CParticlePlayer::CParticlePlayer()
+{
+	mPos=0;
+	mCreate=NULL;
+	mChecksum=0;
+	mMismatches=0;
+	mCorrupt=false;
+}
+
+CParticlePlayer::~CParticlePlayer()
+{
+	Clear();
+}
+
+void CParticlePlayer::Clear()
+{
+	for(unsigned i=0;i<mSystems.size();i++)
+		delete mSystems[i];
+	mSystems.clear();
+	mMoves.clear();
+}
+
+bool CParticlePlayer::Load(const char* filename)
+{
+	mData.clear();
+	std::ifstream file(filename,std::ios::in|std::ios::binary);
+	if (!file.is_open())	return false;
+	file.seekg(0,std::ios::end);
+	size_t size=(size_t)file.tellg();
+	file.seekg(0,std::ios::beg);
+	if (size<sizeof(unsigned)+sizeof(int))	return false;
+	mData.resize(size);
+	file.read(&mData[0],size);
+
+	unsigned magic;
+	int version;
+	mPos=0;
+	mCorrupt=false;
+	Read(magic);
+	Read(version);
+	if (magic!=RECORD_MAGIC || version!=RECORD_VERSION)
+	{
+		mData.clear();
+		return false;
+	}
+	return true;
+}
+
+bool CParticlePlayer::ReadBytes(void* pData,size_t size)
+{
+	// (mPos never passes the end, so the subtraction is safe)
+	if (mCorrupt || size>mData.size()-mPos)
+	{
+		memset(pData,0,size);	// (so nothing uninitialised gets used)
+		Corrupt();
+		return false;
+	}
+	memcpy(pData,&mData[mPos],size);
+	mPos+=size;
+	return true;
+}
+
+void CParticlePlayer::Corrupt()
+{
+	if (mCorrupt)	return;
+	mCorrupt=true;
+	mMismatches++;
+}
+
+void CParticlePlayer::ReadRandom()
+{
+	unsigned state[4];
+	if (Read(state))
+		CRandom::Get().SetState(state);
+}
+
+void CParticlePlayer::PlayInit()
+{
+	int id,type;
+	SParticleSetting settings;
+	Read(id);
+	Read(type);
+	Read(settings);
+	if (mCorrupt)	return;
+	if (id<0 || id>=MAX_RECORDED_SYSTEMS)
+	{
+		Corrupt();
+		return;
+	}
+	settings.LodDistance=0;	// the recording is after the level of detail
+	CParticleSystem* pSystem=mCreate? mCreate((ERecordedSystem)type) : CreateSystem((ERecordedSystem)type);
+	pSystem->CParticleSystem::Init(NULL,NULL,settings);
+	if ((int)mSystems.size()<=id)	mSystems.resize(id+1,NULL);
+	delete mSystems[id];
+	mSystems[id]=pSystem;
+
+	// put the ramps back, in the same order
+	int keys;
+	Read(keys);
+	for(int i=0;i+1<keys;i+=2)
+	{
+		D3DXCOLOR start,end;
+		Read(start);
+		if (!Read(end))	return;
+		pSystem->FindOrAddRamp(start,end);
+	}
+	if (type==RECORDED_PRECIPITATION)
+	{
+		D3DXVECTOR3 dim;
+		Read(dim);
+		((CPrecipitation*)pSystem)->SetDimension(dim);
+	}
+	if (type==RECORDED_EXPLOSION)
+		Read(((CExplosion*)pSystem)->mRandomRamps);
+}
+
+void CParticlePlayer::MoveChunk(void* pData,int begin,int end)
+{
+	SMove* pMove=(SMove*)pData;
+	pMove->pSystem->UpdateRange(begin,end,pMove->DeltaTime);
+}
+
+void CParticlePlayer::PlayMoves(CJobPool* pPool,int chunkSize)
+{
+	if (mMoves.empty())	return;
+	for(unsigned i=0;i<mMoves.size();i++)
+	{
+		int count=mMoves[i].pSystem->GetCount();
+		mMoves[i].pSystem->mpReplayGround=mMoves[i].pGround;
+		if (pPool==NULL)
+		{
+			mMoves[i].pSystem->UpdateRange(0,count,mMoves[i].DeltaTime);
+			continue;
+		}
+		for(int begin=0;begin<count;begin+=chunkSize)
+		{
+			int end=begin+chunkSize;
+			if (end>count)	end=count;
+			pPool->Add(MoveChunk,&mMoves[i],begin,end);
+		}
+	}
+	if (pPool)	pPool->Wait();
+	for(unsigned i=0;i<mMoves.size();i++)
+	{
+		mMoves[i].pSystem->EndUpdate(mMoves[i].DeltaTime);
+		mMoves[i].pSystem->mpReplayGround=NULL;	// (it points into this frame of the recording)
+	}
+	mMoves.clear();
+}
+
+bool CParticlePlayer::Play(CJobPool* pPool,int chunkSize)
+{
+	Clear();
+	mFrames.clear();
+	mMismatches=0;
+	mCorrupt=false;
+	mPos=sizeof(unsigned)+sizeof(int);	// after the header
+	chunkSize=(chunkSize+3)&~3;
+	if (chunkSize<=0)	chunkSize=4;
+
+	LARGE_INTEGER freq,start,now;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&start);
+	while(mPos<mData.size() && !mCorrupt)
+	{
+		unsigned char event;
+		Read(event);
+		if (event==EVENT_FRAME)
+		{
+			PlayMoves(pPool,chunkSize);
+			QueryPerformanceCounter(&now);
+			SReplayFrame frame;
+			frame.UpdateTime=(float)(now.QuadPart-start.QuadPart)/freq.QuadPart;
+			frame.Count=0;
+			for(unsigned i=0;i<mSystems.size();i++)
+				if (mSystems[i])	frame.Count+=mSystems[i]->GetCount();
+			mFrames.push_back(frame);
+			QueryPerformanceCounter(&start);	// (not counting the above)
+			continue;
+		}
+
+		int id;
+		if (!Read(id))	break;
+		if (event==EVENT_INIT)
+		{
+			mPos-=sizeof(id);	// (PlayInit reads it again)
+			PlayInit();
+			continue;
+		}
+		if (id<0 || id>=(int)mSystems.size() || mSystems[id]==NULL)
+		{
+			Corrupt();
+			break;
+		}
+		CParticleSystem* pSystem=mSystems[id];
+
+		if (event==EVENT_MOVE)
+		{
+			SMove move;
+			int count;
+			D3DXVECTOR3 centre;
+			move.pSystem=pSystem;
+			move.pGround=NULL;
+			Read(move.DeltaTime);
+			Read(count);
+			if (!Read(centre))	break;
+			CPrecipitation* pPrecipitation=dynamic_cast<CPrecipitation*>(pSystem);
+			if (pPrecipitation)	pPrecipitation->SetCentre(centre);
+			if (count!=pSystem->mCount)	mMismatches++;
+			mMoves.push_back(move);
+			continue;
+		}
+		if (event==EVENT_GROUND)
+		{
+			// the heights go with this system's move (which is still waiting)
+			int count;
+			if (!Read(count))	break;
+			if (count<0 || (size_t)count>(mData.size()-mPos)/sizeof(float))
+			{
+				Corrupt();
+				break;
+			}
+			const float* pGround=(const float*)&mData[mPos];
+			mPos+=count*sizeof(float);
+			SMove* pMove=NULL;
+			for(unsigned i=0;i<mMoves.size();i++)
+			{
+				if (mMoves[i].pSystem==pSystem)	pMove=&mMoves[i];
+			}
+			if (pMove==NULL)
+			{
+				Corrupt();
+				break;
+			}
+			// (if the count is off it was counted at the move, & the heights are no use)
+			if (count==pSystem->mCount)	pMove->pGround=pGround;
+			continue;
+		}
+
+		// anything else must happen after the moves so far
+		PlayMoves(pPool,chunkSize);
+		if (event==EVENT_CUT)
+		{
+			int count;
+			if (!Read(count))	break;
+			if (count<=pSystem->mCount)
+				pSystem->mCount=count;
+			else
+				mMismatches++;
+		}
+		else if (event==EVENT_ADD)
+		{
+			D3DXVECTOR3 pos,vel;
+			D3DXCOLOR startCol,endCol;
+			float lifeTime;
+			Read(pos);	Read(vel);
+			Read(startCol);	Read(endCol);
+			if (!Read(lifeTime))	break;
+			pSystem->AddParticle(pos,vel,startCol,endCol,lifeTime);
+		}
+		else if (event==EVENT_EMIT)
+		{
+			int count;
+			D3DXVECTOR3 pos,dir;
+			float angle,minSpeed,maxSpeed,lifeTime;
+			D3DXCOLOR startCol,endCol;
+			ReadRandom();
+			Read(count);
+			Read(pos);	Read(dir);
+			Read(angle);	Read(minSpeed);	Read(maxSpeed);
+			Read(startCol);	Read(endCol);
+			if (!Read(lifeTime))	break;
+			pSystem->EmitCone(count,pos,dir,angle,minSpeed,maxSpeed,startCol,endCol,lifeTime);
+		}
+		else if (event==EVENT_EXPLODE)
+		{
+			D3DXVECTOR3 pos;
+			float speed;
+			int number;
+			bool coloured;
+			ReadRandom();
+			Read(pos);
+			Read(speed);
+			Read(number);
+			if (!Read(coloured))	break;
+			// (the level of detail is off, so it makes all of them)
+			if (coloured)
+			{
+				D3DXCOLOR startCol,endCol;
+				Read(startCol);
+				if (!Read(endCol))	break;
+				((CExplosion*)pSystem)->Explode(pos,startCol,endCol,speed,number);
+			}
+			else
+				((CExplosion*)pSystem)->Explode(pos,speed,number);
+		}
+		else
+		{
+			Corrupt();
+			break;
+		}
+	}
+	PlayMoves(pPool,chunkSize);
+	mChecksum=Checksum(mSystems);
+	return !mCorrupt;
+}
+
+unsigned CParticlePlayer::Checksum(const std::vector<CParticleSystem*>& systems)
+{
+	// FNV-1a over all the particles
+	unsigned hash=2166136261u;
+	for(unsigned s=0;s<systems.size();s++)
+	{
+		CParticleSystem* pSystem=systems[s];
+		if (pSystem==NULL)	continue;
+		const SParticleArrays& p=pSystem->mParticles;
+		const float* arrays[]={p.PosX,p.PosY,p.PosZ,p.VelX,p.VelY,p.VelZ,p.Age,p.InvLife};
+		int count=pSystem->GetCount();
+		const unsigned char* bytes=(const unsigned char*)&count;
+		for(int b=0;b<(int)sizeof(count);b++)
+			hash=(hash^bytes[b])*16777619u;
+		const int NUM_ARRAYS=sizeof(arrays)/sizeof(arrays[0]);
+		for(int a=0;a<NUM_ARRAYS;a++)
+		{
+			bytes=(const unsigned char*)arrays[a];
+			for(int b=0;b<count*(int)sizeof(float);b++)
+				hash=(hash^bytes[b])*16777619u;
+		}
+		for(int i=0;i<count;i++)
+			hash=(hash^p.Ramp[i])*16777619u;
+	}
+	return hash;
+}
+
+bool CParticlePlayer::WriteReport(const char* filename)
+{
+	std::ofstream file(filename);
+	if (!file.is_open())	return false;
+	file<<"frame,time_ms,particles\n";
+	for(unsigned i=0;i<mFrames.size();i++)
+		file<<i<<","<<mFrames[i].UpdateTime*1000<<","<<mFrames[i].Count<<"\n";
+	file<<"checksum,"<<mChecksum<<"\n";
+	file<<"mismatches,"<<mMismatches<<"\n";
+	file<<"corrupt,"<<(mCorrupt?1:0)<<"\n";
+	return true;
+}
@@ -0,0 +1,180 @@
+/*==============================================
+ * Particle Recorder & Player
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#pragma once
+
+/** \file ParticleRecorder.h Recording & replaying particle systems.
+CParticleRecorder records everything which is done to some particle systems into a file:
+the particles added, the explosions, the emissions & the updates (with their delta times).
+The random number state is recorded with each emission, so the replay comes out the same.
+The ground under the particles is recorded with each update (for the systems which collide with it),
+so the ground collision is replayed without a terrain.
+
+CParticlePlayer plays the file back without a device (or a game), timing each frame.
+This lets frame spikes be looked at again & again, & different ways of storing or updating
+the particles be compared on real gameplay.
+*/
+
+#include <fstream>
+#include <vector>
+#include "ParticleSystem.h"
+
+class CJobPool;
+
+/// the type of particle system in a recording
+enum ERecordedSystem
+{
+	RECORDED_PARTICLE_SYSTEM,
+	RECORDED_PRECIPITATION,
+	RECORDED_EXPLOSION
+};
+
+/** Records particle systems to a file.
+\code
+recorder.Start("particles.rec");
+recorder.Add(mpFire);	// after its Init()
+...
+mpFire->Update(dt);
+recorder.EndFrame();
+...
+recorder.Stop();
+\endcode
+CParticleManager has one built in, see CParticleManager::StartRecording().
+*/
+class CParticleRecorder
+{
+public:
+	CParticleRecorder();
+	/// stops the recording
+	~CParticleRecorder();
+
+	/// opens the file & starts recording, returns false if the file could not be opened
+	bool Start(const char* filename);
+	/// stops recording & closes the file (the systems are not recorded any more)
+	void Stop();
+	bool IsRecording(){return mFile.is_open();}
+	/// starts recording a particle system (call after its Init())
+	void Add(CParticleSystem* pSystem);
+	/// marks the end of a frame, call after all the systems have been updated
+	void EndFrame();
+
+	/// \defgroup Record Recording
+	/// Called by the particle systems themselves.
+	/// @{
+	void RecordAdd(CParticleSystem* pSystem,const D3DXVECTOR3& pos,const D3DXVECTOR3& vel,
+					const D3DXCOLOR& startCol,const D3DXCOLOR& endCol,float lifeTime);
+	void RecordEmit(CParticleSystem* pSystem,int count,const D3DXVECTOR3& pos,const D3DXVECTOR3& dir,
+					float angle,float minSpeed,float maxSpeed,
+					const D3DXCOLOR& startCol,const D3DXCOLOR& endCol,float lifeTime);
+	/// (startCol & endCol are NULL for a multicoloured explosion)
+	void RecordExplode(CParticleSystem* pSystem,const D3DXVECTOR3& pos,
+					const D3DXCOLOR* startCol,const D3DXCOLOR* endCol,float speed,int number);
+	/// after BeginUpdate(), before the particles are moved
+	void RecordMove(CParticleSystem* pSystem,float inDeltaTime);
+	/// after the particles are moved (UpdateRange()), before EndUpdate(): the ground heights it used
+	void RecordGround(CParticleSystem* pSystem);
+	/// the particle count has been cut down (CPrecipitation over its budget)
+	void RecordCut(CParticleSystem* pSystem);
+	/// @}
+private:
+	/// \internal writes the start of an event
+	void WriteEvent(int type,CParticleSystem* pSystem);
+	/// \internal writes the random number state for this thread
+	void WriteRandom();
+	/// \internal writes some plain data
+	template<class T>
+	void Write(const T& data){mFile.write((const char*)&data,sizeof(T));}
+
+	std::ofstream mFile;
+	std::vector<CParticleSystem*> mSystems;	// the id is the index
+};
+
+/// the results of one frame of a replay
+struct SReplayFrame
+{
+	float UpdateTime;	// how long the frame took to replay (seconds)
+	int Count;	// number of particles after the frame
+};
+
+/** Plays back a recording from CParticleRecorder, without any device.
+\code
+CParticlePlayer player;
+player.Load("particles.rec");
+player.Play();
+player.WriteReport("report.csv");
+\endcode
+*/
+class CParticlePlayer
+{
+public:
+	/// makes a particle system of the given type (so other versions of the particle systems can be tried)
+	typedef CParticleSystem* (*CreateFunc)(ERecordedSystem type);
+
+	CParticlePlayer();
+	/// deletes the particle systems
+	~CParticlePlayer();
+
+	/// loads a recording into memory, returns false if it could not be read
+	bool Load(const char* filename);
+	/** Plays the recording from the start.
+	If the recording is cut short or corrupt it stops there (counted as a mismatch, see IsCorrupt()).
+	\param pPool the job pool to move the particles on (NULL to do it all on this thread)
+	\param chunkSize how many particles to give each job
+	\return false if the recording was corrupt
+	*/
+	bool Play(CJobPool* pPool=NULL,int chunkSize=2048);
+	/// sets the function to make the particle systems (NULL for the normal ones)
+	void SetCreateFunc(CreateFunc func){mCreate=func;}
+
+	/// the results of each frame of the last Play()
+	const std::vector<SReplayFrame>& GetFrames(){return mFrames;}
+	/// a checksum of all the particles at the end of the last Play() (the same if the particles are the same)
+	unsigned GetChecksum(){return mChecksum;}
+	/// number of times the particle count did not match the recording (should be 0, otherwise the checksum means nothing)
+	int GetMismatches(){return mMismatches;}
+	/// whether the last Play() stopped early, as the recording was cut short or corrupt
+	bool IsCorrupt(){return mCorrupt;}
+	/// writes the results to a CSV file (frame, time in ms, particle count), returns false on failure
+	bool WriteReport(const char* filename);
+	/// a checksum of the particles in some systems (eg. the live ones, to compare with GetChecksum())
+	static unsigned Checksum(const std::vector<CParticleSystem*>& systems);
+private:
+	/// \internal reads some plain data, returns false (& zeroes it) if it would run off the end (see ReadBytes)
+	template<class T>
+	bool Read(T& data){return ReadBytes(&data,sizeof(T));}
+	/// \internal reads size bytes, unless there aren't that many left (then the recording is corrupt)
+	bool ReadBytes(void* pData,size_t size);
+	/// \internal marks the recording as corrupt (once), so Play() stops
+	void Corrupt();
+	/// \internal reads & sets the random number state for this thread
+	void ReadRandom();
+	/// \internal replays an INIT event
+	void PlayInit();
+	/// \internal moves all the systems in mMoves
+	void PlayMoves(CJobPool* pPool,int chunkSize);
+	/// \internal the job which moves part of one system
+	static void MoveChunk(void* pData,int begin,int end);
+	/// \internal deletes the systems
+	void Clear();
+
+	/// \internal a system waiting to be moved
+	struct SMove
+	{
+		CParticleSystem* pSystem;
+		float DeltaTime;
+		const float* pGround;	// the recorded ground heights (NULL if it doesn't collide)
+	};
+
+	std::vector<char> mData;	// the whole recording
+	size_t mPos;	// where we are in it
+	CreateFunc mCreate;
+	std::vector<CParticleSystem*> mSystems;
+	std::vector<SMove> mMoves;	// the moves in this frame, so far
+	std::vector<SReplayFrame> mFrames;
+	unsigned mChecksum;
+	int mMismatches;
+	bool mCorrupt;	// the recording ran out or made no sense
+};
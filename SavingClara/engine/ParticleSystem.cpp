@@ -7,21 +7,66 @@
  * Desc: A generic Particle system and some specialist systems
  *
  *==============================================*/
+#include <malloc.h>	// _aligned_malloc
+#include <math.h>	// fmodf
+#include <stddef.h>	// offsetof
+#include <new>	// placement new
+#include <xmmintrin.h>	// SSE
+#include <emmintrin.h>	// SSE2 (for the colours)
 #include "ParticleSystem.h"
+#include "Random.h"
+#include "Node.h"
+#include "Terrain.h"
+#include "ParticleRecorder.h"
 #include "Fail.h"
 
 // inline function that converts a float to a DWORD value
 inline DWORD FLOAT_TO_DWORD( FLOAT f ) { return *((DWORD*)&f); }
 
+// number of float arrays in SParticleArrays (all but the ramp)
+const int NUM_FLOAT_ARRAYS=offsetof(SParticleArrays,Ramp)/sizeof(float*);
+
 CParticleSystem::CParticleSystem() :
 	mpDevice( NULL ),
 	mpVertexBuffer( NULL ),
-	mpTexture( NULL )
+	mpTexture( NULL ),
+	mpParticleMemory( NULL ),
+	mCapacity( 0 ),
+	mCount( 0 ),
+	mReplace( 0 ),
+	mLodEye( 0,0,0 ),
+	mLodZoom( 1 ),
+	mEmitScale( 1 ),
+	mpEmitBudget( NULL ),
+	mpTerrain( NULL ),
+	mpReplayGround( NULL ),
+	mpRecorder( NULL ),
+	mRecordId( 0 )
+{
+	memset(&mParticles,0,sizeof(mParticles));
+}
+
+CParticleEmitter::CParticleEmitter(const SEmitterSetting& settings,CMeshNode* pNode)
 {
+	Reset(settings,pNode);
+}
+
+void CParticleEmitter::Reset(const SEmitterSetting& settings,CMeshNode* pNode)
+{
+	mSettings=settings;
+	mpNode=pNode;
+	mPos=D3DXVECTOR3(0,0,0);
+	mAccumulator=0;
+	mAlive=true;
 }
 
 CParticleSystem::~CParticleSystem()
 {
+	ClearEmitters();
+	for(unsigned i=0;i<mFreeEmitters.size();i++)
+		delete mFreeEmitters[i];
+	mFreeEmitters.clear();
+
 	if( mpVertexBuffer )
 	{
 		mpVertexBuffer->Release( );
@@ -33,43 +78,74 @@ CParticleSystem::~CParticleSystem()
 		mpTexture->Release( );
 		mpTexture = NULL;
 	}
+
+	if( mpParticleMemory )
+	{
+		_aligned_free( mpParticleMemory );
+		mpParticleMemory = NULL;
+	}
 }
 
 bool CParticleSystem::Init( IDirect3DDevice9* inDevice, const char* inTextureFilename,
 							const SParticleSetting& settings)
 {
 	mSettings=settings;
-	mpVertexBufferSize=mSettings.MaxParticles;
+	// room for several frames, so its a while before we need to wait for the card
+	mpVertexBufferSize=mSettings.MaxParticles*PARTICLE_VB_FRAMES;
+	mpVertexBufferOffset=0;
 
 	mpDevice = inDevice; // save a ptr to the device
 
 	HRESULT hr = 0;
 
-	//TODO("Create the vertex buffer for storing particles");
-	hr = mpDevice->CreateVertexBuffer(mpVertexBufferSize * sizeof(SPointSprite),
-							D3DUSAGE_DYNAMIC | D3DUSAGE_WRITEONLY | D3DUSAGE_POINTS,
-							D3DFVF_POINTSPRITE, D3DPOOL_DEFAULT, 
-							&mpVertexBuffer, NULL);//, you will need to fill mpVertexBuffer
-	
-	if( FAILED( hr ) )
+	// no device is fine if its never drawn (eg. replaying a recording)
+	if( mpDevice )
 	{
-		FAIL( "CreateVertexBuffer() - FAILED", "CParticleSystem");
-		return false;
-	}
+		//TODO("Create the vertex buffer for storing particles");
+		hr = mpDevice->CreateVertexBuffer(mpVertexBufferSize * sizeof(SPointSprite),
+								D3DUSAGE_DYNAMIC | D3DUSAGE_WRITEONLY | D3DUSAGE_POINTS,
+								D3DFVF_POINTSPRITE, D3DPOOL_DEFAULT, 
+								&mpVertexBuffer, NULL);//, you will need to fill mpVertexBuffer
+
+		if( FAILED( hr ) )
+		{
+			FAIL( "CreateVertexBuffer() - FAILED", "CParticleSystem");
+			return false;
+		}
+
+		//TODO("load the texture");
+		// texture
+		hr=D3DXCreateTextureFromFile(mpDevice, inTextureFilename, &mpTexture);
 
-	//TODO("load the texture");
-	// texture
-	hr=D3DXCreateTextureFromFile(mpDevice, inTextureFilename, &mpTexture);
+		if( FAILED( hr ) )
+		{
+			FAIL( inTextureFilename,"D3DXCreateTextureFromFile() - FAILED");
+			return false;
+		}
+	}
 
-	if( FAILED( hr ) )
+	// allocate the arrays, all in one block
+	// each array is padded to a multiple of 4, so Update never has to deal with a partial group
+	if( mpParticleMemory )
+		_aligned_free( mpParticleMemory );
+	mCapacity=(mSettings.MaxParticles+3)&~3;
+	size_t bytes=NUM_FLOAT_ARRAYS*mCapacity*sizeof(float)+mCapacity;	// (+ the ramps)
+	mpParticleMemory=(float*)_aligned_malloc(bytes,16);
+	if( mpParticleMemory==NULL )
 	{
-		FAIL( inTextureFilename,"D3DXCreateTextureFromFile() - FAILED");
+		FAIL( "Out of memory", "CParticleSystem");
 		return false;
 	}
-
-	// resize ready for the capacity
-	mParticles.resize(mSettings.MaxParticles);
-	mParticles.clear();
+	// zero it, so the unused slots which Update touches are sensible numbers
+	memset(mpParticleMemory,0,bytes);
+	float** arrays=(float**)&mParticles;
+	for(int i=0;i<NUM_FLOAT_ARRAYS;i++)
+		arrays[i]=mpParticleMemory+i*mCapacity;
+	mParticles.Ramp=(unsigned char*)(mpParticleMemory+NUM_FLOAT_ARRAYS*mCapacity);
+	mCount=mReplace=0;
+	mGroundHeight.resize(mCapacity);
+	mRampKeys.clear();
+	mRamps.clear();
 
 	return true;
 }
@@ -81,43 +157,319 @@ void CParticleSystem::AddParticle(D3DXVECTOR3 pos,D3DXVECTOR3 vel)
 
 void CParticleSystem::AddParticle(D3DXVECTOR3 pos,D3DXVECTOR3 vel,D3DXCOLOR startCol,D3DXCOLOR endCol,float lifeTime)
 {
-	if (mParticles.size()>=mSettings.MaxParticles)	// it full, remove oldest
-		mParticles.pop_front();
+	if (mCapacity==0)	return;	// not initialised
+	if (mpRecorder)	mpRecorder->RecordAdd(this,pos,vel,startCol,endCol,lifeTime);
+	SetParticle(NewParticle(),pos,vel,lifeTime,FindOrAddRamp(startCol,endCol));
+}
+
+void CParticleSystem::SetParticle(int i,const D3DXVECTOR3& pos,const D3DXVECTOR3& vel,float lifeTime,int ramp)
+{
+	mParticles.PosX[i]=pos.x;	mParticles.PosY[i]=pos.y;	mParticles.PosZ[i]=pos.z;
+	mParticles.VelX[i]=vel.x;	mParticles.VelY[i]=vel.y;	mParticles.VelZ[i]=vel.z;
+	mParticles.Age[i]=0;
+	mParticles.InvLife[i]=GetInvLife(lifeTime);
+	mParticles.Ramp[i]=(unsigned char)ramp;
+}
+
+float CParticleSystem::GetInvLife(float lifeTime)
+{
+	// (a lifetime of FLT_MAX is forever, zero or less dies at once)
+	if (lifeTime>=FLT_MAX)	return 0;
+	if (lifeTime<=0)	return FLT_MAX;
+	return 1/lifeTime;
+}
+
+int CParticleSystem::FindOrAddRamp(const D3DXCOLOR& start,const D3DXCOLOR& end)
+{
+	int best=0;
+	float bestDist=FLT_MAX;
+	int count=(int)mRampKeys.size()/2;
+	for(int i=0;i<count;i++)
+	{
+		D3DXCOLOR ds=mRampKeys[i*2]-start,de=mRampKeys[i*2+1]-end;
+		float dist=ds.r*ds.r+ds.g*ds.g+ds.b*ds.b+ds.a*ds.a+de.r*de.r+de.g*de.g+de.b*de.b+de.a*de.a;
+		if (dist==0)	return i;	// got it
+		if (dist<bestDist)
+		{
+			best=i;
+			bestDist=dist;
+		}
+	}
+	if (count>=MAX_PARTICLE_RAMPS)	return best;	// no room: use the closest
+
+	// add it
+	mRampKeys.push_back(start);
+	mRampKeys.push_back(end);
+	for(int i=0;i<PARTICLE_RAMP_SIZE;i++)
+	{
+		D3DXCOLOR col;
+		D3DXColorLerp(&col,&start,&end,i/(float)(PARTICLE_RAMP_SIZE-1));
+		mRamps.push_back((D3DCOLOR)col);
+	}
+	return count;
+}
+
+int CParticleSystem::NewParticle()
+{
+	if (mCount<(int)mSettings.MaxParticles)
+		return mCount++;
+	// its full, so replace one: working through them in turn is a cheap way to pick
+	// one of the older ones (the order is lost as soon as anything dies)
+	if (mReplace>=mCount)	mReplace=0;
+	return mReplace++;
+}
+
+void CParticleSystem::Emit(int count,const D3DXVECTOR3& pos,const D3DXVECTOR3& dir,float angle,float minSpeed,float maxSpeed)
+{
+	Emit(count,pos,dir,angle,minSpeed,maxSpeed,mSettings.StartColor,mSettings.EndColor,mSettings.LifeTime);
+}
+
+void CParticleSystem::Emit(int count,const D3DXVECTOR3& pos,const D3DXVECTOR3& dir,float angle,float minSpeed,float maxSpeed,
+							const D3DXCOLOR& startCol,const D3DXCOLOR& endCol,float lifeTime)
+{
+	if (mCapacity==0)	return;	// not initialised
+	EmitCone(ScaleCount(count,pos),pos,dir,angle,minSpeed,maxSpeed,startCol,endCol,lifeTime);
+}
 
-	SAttribute attrib;
-//	attrib.mAcceleration=D3DXVECTOR3(0,0,0);
-	attrib.mAge=0;
-	attrib.mIsAlive=true;
-	attrib.mLifeTime=lifeTime;
-	attrib.mPosition=pos;
-	attrib.mVelocity=vel;
-	attrib.mColor=startCol;
-	attrib.mColorFade=(endCol-startCol)/mSettings.LifeTime;
+void CParticleSystem::EmitCone(int count,const D3DXVECTOR3& pos,const D3DXVECTOR3& dir,float angle,float minSpeed,float maxSpeed,
+							const D3DXCOLOR& startCol,const D3DXCOLOR& endCol,float lifeTime)
+{
+	if (mCapacity==0 || count<=0)	return;	// not initialised
+	if (mpRecorder)	mpRecorder->RecordEmit(this,count,pos,dir,angle,minSpeed,maxSpeed,startCol,endCol,lifeTime);
+	CRandom& rnd=CRandom::Get();
+	D3DXVECTOR3 axis;
+	D3DXVec3Normalize(&axis,&dir);
+	CConeSampler cone(axis,angle);
+	int ramp=FindOrAddRamp(startCol,endCol);
+
+	// as many as will fit are written straight into the arrays
+	int i0=mCount;
+	int n=(int)mSettings.MaxParticles-mCount;
+	if (n>count)	n=count;
+	if (n<0)	n=0;
+	cone.Generate(rnd,n,mParticles.VelX+i0,mParticles.VelY+i0,mParticles.VelZ+i0);
+	mCount+=n;
+	// (the arrays are copied out, so the compiler knows the stores don't change them or the generator)
+	const SParticleArrays p=mParticles;
+	const float invLife=GetInvLife(lifeTime);
+	for(int i=i0;i<i0+n;i++)
+	{
+		float speed=rnd.NextFloat(minSpeed,maxSpeed);
+		p.PosX[i]=pos.x;	p.PosY[i]=pos.y;	p.PosZ[i]=pos.z;
+		p.VelX[i]*=speed;	p.VelY[i]*=speed;	p.VelZ[i]*=speed;
+		p.Age[i]=0;
+		p.InvLife[i]=invLife;
+	}
+	memset(p.Ramp+i0,ramp,n);
+	// its full, so the rest replace existing ones
+	for(int k=n;k<count;k++)
+	{
+		int i=NewParticle();
+		D3DXVECTOR3 vel=cone.Generate(rnd);
+		SetParticle(i,pos,vel*rnd.NextFloat(minSpeed,maxSpeed),lifeTime,ramp);
+	}
+}
 
-	mParticles.push_back( attrib );
+CParticleEmitter* CParticleSystem::AddEmitter(const SEmitterSetting& settings,CMeshNode* pNode)
+{
+	CParticleEmitter* pEmitter;
+	if (mFreeEmitters.empty())
+		pEmitter=new CParticleEmitter(settings,pNode);
+	else
+	{
+		pEmitter=mFreeEmitters.back();
+		mFreeEmitters.pop_back();
+		pEmitter->Reset(settings,pNode);
+	}
+	mEmitters.push_back(pEmitter);
+	return pEmitter;
+}
+
+void CParticleSystem::ClearEmitters()
+{
+	for(unsigned i=0;i<mEmitters.size();i++)
+	{
+		mEmitters[i]->mAlive=false;
+		mFreeEmitters.push_back(mEmitters[i]);
+	}
+	mEmitters.clear();
+}
+
+void CParticleSystem::ReserveEmitters(int count)
+{
+	mEmitters.reserve(count);
+	mFreeEmitters.reserve(count);
+	for(int i=(int)(mEmitters.size()+mFreeEmitters.size());i<count;i++)
+		mFreeEmitters.push_back(new CParticleEmitter(SEmitterSetting(),NULL));
+}
+
+void CParticleSystem::UpdateEmitters(float inDeltaTime)
+{
+	for(int e=(int)mEmitters.size()-1;e>=0;e--)
+	{
+		CParticleEmitter* pEmitter=mEmitters[e];
+		// remove the dead (or those following a dead node)
+		if (pEmitter->mAlive && pEmitter->mpNode && pEmitter->mpNode->IsAlive()==false)
+			pEmitter->mAlive=false;
+		if (pEmitter->mAlive==false)
+		{
+			mFreeEmitters.push_back(pEmitter);	// (to be reused)
+			mEmitters[e]=mEmitters.back();
+			mEmitters.pop_back();
+			continue;
+		}
+
+		const SEmitterSetting& set=pEmitter->mSettings;
+		D3DXVECTOR3 pos=pEmitter->mPos,dir=set.Direction;
+		if (pEmitter->mpNode)
+		{
+			pos=pEmitter->mpNode->OffsetPos(set.Offset);
+			if (set.LocalDirection)
+				dir=pEmitter->mpNode->RotateVector(dir);
+		}
+
+		// work out how many this frame, keeping the fraction for next time
+		pEmitter->mAccumulator+=set.Rate*inDeltaTime*GetLodScale(pos);
+		int count=(int)pEmitter->mAccumulator;
+		pEmitter->mAccumulator-=count;
+		count=TakeBudget(count);
+		if (count<=0)	continue;
+
+		float life=(set.LifeTime>0)? set.LifeTime : mSettings.LifeTime;
+		if (set.UseColors)
+			EmitCone(count,pos,dir,set.Angle,set.MinSpeed,set.MaxSpeed,set.StartColor,set.EndColor,life);
+		else
+			EmitCone(count,pos,dir,set.Angle,set.MinSpeed,set.MaxSpeed,mSettings.StartColor,mSettings.EndColor,life);
+	}
+}
+
+float CParticleSystem::GetLodScale(const D3DXVECTOR3& pos)
+{
+	float scale=mEmitScale;
+	if (mSettings.LodDistance>0)
+	{
+		// the area on screen goes down with the square of the distance
+		D3DXVECTOR3 diff=pos-mLodEye;
+		float dist=D3DXVec3Length(&diff)/mLodZoom;
+		if (dist>mSettings.LodDistance)
+			scale*=(mSettings.LodDistance*mSettings.LodDistance)/(dist*dist);
+	}
+	return scale;
+}
+
+int CParticleSystem::TakeBudget(int count)
+{
+	if (mpEmitBudget==NULL || count<=0)	return count;
+	if (count>*mpEmitBudget)	count=*mpEmitBudget;
+	if (count<0)	count=0;
+	*mpEmitBudget-=count;
+	return count;
+}
+
+int CParticleSystem::ScaleCount(int count,const D3DXVECTOR3& pos)
+{
+	float want=count*GetLodScale(pos);
+	int n=(int)want;
+	// keep the fraction by chance, so lots of small bursts are not all lost
+	if (want>n && CRandom::Get().NextFloat()<want-n)
+		n++;
+	return TakeBudget(n);
+}
+
+/** Moves & ages the particles in array indexes begin..end-1, 4 at a time.
+begin & end must be multiples of 4.
+The padding at the end is updated as well (its quicker than checking), but is never used.
+*/
+static void IntegrateParticles(const SParticleArrays& p,int begin,int end,float dt)
+{
+	const __m128 t=_mm_set1_ps(dt);
+	for(int i=begin;i<end;i+=4)
+	{
+		_mm_store_ps(p.PosX+i,_mm_add_ps(_mm_load_ps(p.PosX+i),_mm_mul_ps(_mm_load_ps(p.VelX+i),t)));
+		_mm_store_ps(p.PosY+i,_mm_add_ps(_mm_load_ps(p.PosY+i),_mm_mul_ps(_mm_load_ps(p.VelY+i),t)));
+		_mm_store_ps(p.PosZ+i,_mm_add_ps(_mm_load_ps(p.PosZ+i),_mm_mul_ps(_mm_load_ps(p.VelZ+i),t)));
+		_mm_store_ps(p.Age+i,_mm_add_ps(_mm_load_ps(p.Age+i),_mm_mul_ps(_mm_load_ps(p.InvLife+i),t)));
+	}
 }
 
 void CParticleSystem::Update( float inDeltaTime )
 {
-	std::deque<SAttribute>::iterator theIterator = mParticles.begin( );
-	std::deque<SAttribute>::iterator theEnd = mParticles.end( );
-	for( ; theIterator != theEnd; ++theIterator )
+	BeginUpdate(inDeltaTime);
+	if (mpRecorder)	mpRecorder->RecordMove(this,inDeltaTime);
+	UpdateRange(0,mCount,inDeltaTime);
+	if (mpRecorder)	mpRecorder->RecordGround(this);
+	EndUpdate(inDeltaTime);
+}
+
+void CParticleSystem::BeginUpdate( float inDeltaTime )
+{
+	UpdateEmitters(inDeltaTime);
+}
+
+void CParticleSystem::UpdateRange( int begin, int end, float inDeltaTime )
+{
+	// the arrays are padded, so always do whole groups of 4
+	IntegrateParticles(mParticles,begin,(end+3)&~3,inDeltaTime);
+	if (CollidesWithGround())
+		CollideWithTerrain(begin,end);
+}
+
+bool CParticleSystem::CollidesWithGround()
+{
+	return (mpTerrain || mpReplayGround) && mSettings.GroundCollision!=SParticleSetting::PASS_THROUGH;
+}
+
+void CParticleSystem::GetGroundHeights(int begin,int end)
+{
+	// (each thread has its own part of mGroundHeight, so this is safe)
+	if (mpReplayGround)
+		memcpy(&mGroundHeight[begin],mpReplayGround+begin,(end-begin)*sizeof(float));
+	else
+		mpTerrain->GetHeights(mParticles.PosX+begin,mParticles.PosZ+begin,&mGroundHeight[begin],end-begin);
+}
+
+void CParticleSystem::CollideWithTerrain(int begin,int end)
+{
+	// all the heights in one go
+	GetGroundHeights(begin,end);
+	const float* pGround=&mGroundHeight[0];
+	for(int i=begin;i<end;i++)
 	{
-		// only do those alive
-		if (theIterator->mIsAlive)
+		if (mParticles.PosY[i]>=pGround[i])	continue;	// above ground
+		switch(mSettings.GroundCollision)
 		{
-			// default behaviour: move, change colour, age, die if needed
-//			theIterator->mVelocity += theIterator->mAcceleration * inDeltaTime;
-			theIterator->mPosition += theIterator->mVelocity * inDeltaTime;
-			theIterator->mColor+= theIterator->mColorFade * inDeltaTime;
-			theIterator->mAge+=inDeltaTime;
-			if (theIterator->mAge > theIterator->mLifeTime)
-				theIterator->mIsAlive=false;
+		case SParticleSetting::KILL:
+			mParticles.Age[i]=2;	// dead, EndUpdate will remove it
+			break;
+		case SParticleSetting::BOUNCE:
+			mParticles.PosY[i]=pGround[i];
+			if (mParticles.VelY[i]<0)
+				mParticles.VelY[i]=-mParticles.VelY[i]*mSettings.Bounce;
+			break;
+		case SParticleSetting::STICK:
+			mParticles.PosY[i]=pGround[i];
+			mParticles.VelX[i]=mParticles.VelY[i]=mParticles.VelZ[i]=0;
+			break;
+		default:
+			break;
 		}
 	}
+}
+
+void CParticleSystem::EndUpdate( float inDeltaTime )
+{
 	RemoveDeadParticles();	// get rid of the corpses
 }
 
+void CParticleSystem::CopyParticle(int dest,int src)
+{
+	// all the arrays are the same size & one after the other
+	float* p=mpParticleMemory;
+	for(int i=0;i<NUM_FLOAT_ARRAYS;i++,p+=mCapacity)
+		p[dest]=p[src];
+	mParticles.Ramp[dest]=mParticles.Ramp[src];
+}
+
 void CParticleSystem::PreDraw()
 {
 	mpDevice->SetRenderState(D3DRS_ZWRITEENABLE, false);
@@ -163,10 +515,130 @@ void CParticleSystem::PostDraw()
 *	This process continues until all the particles have been drawn.  The benefit
 *	of this method is that we keep the video card and the CPU busy.  
 */
+/// the colour of particle i
+static inline D3DCOLOR ParticleColour(const SParticleArrays& p,const D3DCOLOR* ramps,int i)
+{
+	float age=p.Age[i];
+	if (age>1)	age=1;	// (just in case its dead, so it stays in its own ramp)
+	return ramps[p.Ramp[i]*PARTICLE_RAMP_SIZE+(int)(age*(PARTICLE_RAMP_SIZE-1))];
+}
+
+void PackPointSprites(const SParticleArrays& particles,const D3DCOLOR* ramps,const int* order,int count,SPointSprite* out)
+{
+	int i=0;
+	if (order==NULL)
+	{
+		// 4 at a time: load 4 x's, 4 y's, 4 z's & 4 colours, then turn them around into 4 sprites
+		for(;i+4<=count;i+=4,out+=4)
+		{
+			__m128 x=_mm_load_ps(particles.PosX+i);
+			__m128 y=_mm_load_ps(particles.PosY+i);
+			__m128 z=_mm_load_ps(particles.PosZ+i);
+			__m128 c=_mm_castsi128_ps(_mm_set_epi32(ParticleColour(particles,ramps,i+3),ParticleColour(particles,ramps,i+2),
+													ParticleColour(particles,ramps,i+1),ParticleColour(particles,ramps,i)));
+			_MM_TRANSPOSE4_PS(x,y,z,c);
+			// (the vertex buffer may not be aligned)
+			_mm_storeu_ps((float*)(out+0),x);
+			_mm_storeu_ps((float*)(out+1),y);
+			_mm_storeu_ps((float*)(out+2),z);
+			_mm_storeu_ps((float*)(out+3),c);
+		}
+	}
+	// the rest (or all of them, if they are sorted) one at a time
+	for(;i<count;i++,out++)
+	{
+		int p=order? order[i] : i;
+		out->position.x=particles.PosX[p];
+		out->position.y=particles.PosY[p];
+		out->position.z=particles.PosZ[p];
+		out->color=ParticleColour(particles,ramps,p);
+	}
+}
+
+/** Sorts count indexes by their 16 bit keys, smallest first (the order of equal keys is kept).
+This is a radix sort: two passes, one for each byte of the key.
+\param keys the key for each particle
+\param index [in,out] the particles to sort
+\param temp scratch space, the same size as index
+*/
+static void RadixSortIndexes(const unsigned short* keys,int count,int* index,int* temp)
+{
+	int counts[2][256];
+	memset(counts,0,sizeof(counts));
+	// count both bytes at once
+	for(int i=0;i<count;i++)
+	{
+		unsigned key=keys[index[i]];
+		counts[0][key&0xFF]++;
+		counts[1][key>>8]++;
+	}
+	int* src=index;
+	int* dest=temp;
+	for(int pass=0;pass<2;pass++)
+	{
+		// turn the counts into where each bucket starts
+		int total=0;
+		for(int b=0;b<256;b++)
+		{
+			int c=counts[pass][b];
+			counts[pass][b]=total;
+			total+=c;
+		}
+		int shift=pass*8;
+		for(int i=0;i<count;i++)
+		{
+			int p=src[i];
+			dest[counts[pass][(keys[p]>>shift)&0xFF]++]=p;
+		}
+		int* swap=src;	src=dest;	dest=swap;
+	}
+	// (two passes, so its back in index)
+}
+
+void CParticleSystem::SortByDepth(const D3DXMATRIX& worldView)
+{
+	if ((int)mSortIndex.size()<mCount)
+	{
+		mSortDepth.resize(mCapacity);
+		mSortKey.resize(mCapacity);
+		mSortIndex.resize(mCapacity);
+		mSortTemp.resize(mCapacity);
+	}
+
+	// the view space z of each particle
+	float nearest=FLT_MAX,furthest=-FLT_MAX;
+	for(int i=0;i<mCount;i++)
+	{
+		float z=mParticles.PosX[i]*worldView._13+mParticles.PosY[i]*worldView._23+
+				mParticles.PosZ[i]*worldView._33+worldView._43;
+		mSortDepth[i]=z;
+		if (z<nearest)	nearest=z;
+		if (z>furthest)	furthest=z;
+		mSortIndex[i]=i;
+	}
+	// spread them over the 16 bits, furthest first
+	float scale=(furthest>nearest)? 65535.0f/(furthest-nearest) : 0;
+	for(int i=0;i<mCount;i++)
+		mSortKey[i]=(unsigned short)((furthest-mSortDepth[i])*scale);
+
+	RadixSortIndexes(&mSortKey[0],mCount,&mSortIndex[0],&mSortTemp[0]);
+}
+
 void CParticleSystem::Draw(const D3DXMATRIX& world)
 {
-	if( !mParticles.empty() )
+	if( mCount>0 )
 	{
+		// back to front, if needed
+		const int* pOrder=NULL;
+		if (mSettings.DepthSort)
+		{
+			D3DXMATRIX view,worldView;
+			mpDevice->GetTransform(D3DTS_VIEW,&view);
+			D3DXMatrixMultiply(&worldView,&world,&view);
+			SortByDepth(worldView);
+			pOrder=&mSortIndex[0];
+		}
+
 		mpDevice->SetTransform(D3DTS_WORLD,&world);
 		// set Render states
 		PreDraw();
@@ -175,86 +647,26 @@ void CParticleSystem::Draw(const D3DXMATRIX& world)
 		mpDevice->SetFVF( D3DFVF_POINTSPRITE );
 		mpDevice->SetStreamSource( 0, mpVertexBuffer, 0, sizeof( SPointSprite ) );
 
-		// Render batches one by one
-
-		// start at beginning if we're at the end of the vb
-		if( mpVertexBufferOffset >= mpVertexBufferSize )
+		// all the particles go in one block of the vertex buffer, after last frame's
+		// if it won't fit, start again at the beginning (discarding the old contents)
+		DWORD theCount = (DWORD)mCount;
+		if( mpVertexBufferOffset + theCount > mpVertexBufferSize )
 			mpVertexBufferOffset = 0;
 
+		// NOOVERWRITE tells the card we won't touch anything it may still be drawing
 		SPointSprite* theParticleVertex = NULL;
-
-		mpVertexBuffer->Lock(	mpVertexBufferOffset * sizeof( SPointSprite ),
-								mpVertexBufferSize * sizeof( SPointSprite ),
-								(void**)&theParticleVertex,
-								mpVertexBufferOffset ? D3DLOCK_NOOVERWRITE : D3DLOCK_DISCARD);
-
-		DWORD theNumParticlesInBatch = 0;
-
-		//
-		// Until all particles have been rendered.
-		//
-		std::deque<SAttribute>::iterator theIterator = mParticles.begin();
-		for( ; theIterator != mParticles.end(); ++theIterator )
+		if( SUCCEEDED( mpVertexBuffer->Lock(	mpVertexBufferOffset * sizeof( SPointSprite ),
+												theCount * sizeof( SPointSprite ),
+												(void**)&theParticleVertex,
+												mpVertexBufferOffset ? D3DLOCK_NOOVERWRITE : D3DLOCK_DISCARD ) ) )
 		{
-			if( theIterator->mIsAlive )
-			{
-				// Copy a batch of the living particles to the
-				// next vertex buffer segment
-				theParticleVertex->position = theIterator->mPosition;
-				theParticleVertex->color    = (D3DCOLOR) theIterator->mColor;
-				++theParticleVertex; // next element;
-
-				++theNumParticlesInBatch; //increase batch counter
-
-				// if this batch full?
-				if( theNumParticlesInBatch == mpVertexBufferSize ) 
-				{
-					// Draw the last batch of particles that was
-					// copied to the vertex buffer. 
-					mpVertexBuffer->Unlock();
-
-					mpDevice->DrawPrimitive(	D3DPT_POINTLIST,
-												mpVertexBufferOffset,
-												mpVertexBufferSize);
-
-					// While that batch is drawing, start filling the
-					// next batch with particles.
-
-					// move the offset to the start of the next batch
-					mpVertexBufferOffset += mpVertexBufferSize; 
-
-					// don't offset into memory thats outside the vb's range.
-					// If we're at the end, start at the beginning.
-					if( mpVertexBufferOffset >= mpVertexBufferSize ) 
-						mpVertexBufferOffset = 0;       
-
-					mpVertexBuffer->Lock(	mpVertexBufferOffset * sizeof( SPointSprite ),
-											mpVertexBufferSize * sizeof( SPointSprite ),
-											(void**)&theParticleVertex,
-											mpVertexBufferOffset ? D3DLOCK_NOOVERWRITE : D3DLOCK_DISCARD );
-
-					theNumParticlesInBatch = 0; // Reset for new batch
-				}	
-			}
-		}
+			PackPointSprites( mParticles, mRamps.empty()? NULL : &mRamps[0], pOrder, mCount, theParticleVertex );
+			mpVertexBuffer->Unlock();
 
-		mpVertexBuffer->Unlock();
-
-		// its possible that the LAST batch being filled never 
-		// got rendered because the condition 
-		// (theNumParticlesInBatch == mpVertexBufferSize) would not have
-		// been satisfied.  We draw the last partially filled batch now.
-		
-		if( theNumParticlesInBatch )
-		{
-			mpDevice->DrawPrimitive( D3DPT_POINTLIST,
-										mpVertexBufferOffset,
-										theNumParticlesInBatch );
+			mpDevice->DrawPrimitive( D3DPT_POINTLIST, mpVertexBufferOffset, theCount );
+			mpVertexBufferOffset += theCount;
 		}
 
-		// next block
-		mpVertexBufferOffset += mpVertexBufferSize; 
-
 		// Reset Render states
 		PostDraw();
 	}
@@ -262,18 +674,16 @@ void CParticleSystem::Draw(const D3DXMATRIX& world)
 
 bool CParticleSystem::IsEmpty()
 {
-	return mParticles.empty();
+	return mCount==0;
 }
 
 bool CParticleSystem::IsDead()
 {
-	std::deque<SAttribute>::iterator theIterator = mParticles.begin( );
-	std::deque<SAttribute>::iterator theEnd = mParticles.end( );
-	for( ; theIterator != theEnd; ++theIterator )
+	for( int n = 0; n < mCount; ++n )
 	{
 		// is there at least one living particle?  If yes,
 		// the system is not dead.
-		if( theIterator->mIsAlive )
+		if( IsAlive(n) )
 			return false;
 	}
 	// no living particles found, the system must be dead.
@@ -282,9 +692,17 @@ bool CParticleSystem::IsDead()
 
 void CParticleSystem::RemoveDeadParticles()
 {
-	// remove all corpses at the front:
-	while(mParticles.empty()==false && mParticles.front().mIsAlive==false)
-		mParticles.pop_front();
+	// swap each corpse with the last particle & shrink the list
+	for(int i=0;i<mCount;)
+	{
+		if (IsAlive(i))
+			i++;
+		else
+		{
+			mCount--;
+			if (i<mCount)	CopyParticle(i,mCount);	// (then check the one moved in)
+		}
+	}
 }
 void CParticleSystem::OnLostDevice()
 {
@@ -293,6 +711,7 @@ void CParticleSystem::OnLostDevice()
 }
 void CParticleSystem::OnResetDevice()
 {
+	mpVertexBufferOffset=0;
 	// recreate the device
 	if (FAILED(mpDevice->CreateVertexBuffer(	mpVertexBufferSize * sizeof(SPointSprite),
 											D3DUSAGE_DYNAMIC | D3DUSAGE_POINTS | D3DUSAGE_WRITEONLY,
@@ -310,11 +729,7 @@ void CParticleSystem::OnResetDevice()
 */
 float CParticleSystem::GetRandomFloat( float inLowBound, float inHighBound )
 {
-	// get random float in [0, 1] interval
-	float theRandomFloat = (rand() % 10000) * 0.0001f; 
-
-	// return float in [inLowBound, inHighBound] interval. 
-	return ( theRandomFloat * ( inHighBound - inLowBound ) ) + inLowBound; 
+	return CRandom::Get().NextFloat(inLowBound,inHighBound);
 }
 
 /**
@@ -327,25 +742,40 @@ D3DXVECTOR3 CParticleSystem::GetRandomVector( const D3DXVECTOR3& inMin, const D3
 							GetRandomFloat( inMin.y, inMax.y ),
 							GetRandomFloat( inMin.z, inMax.z ));
 }
+// a cone the size of the whole sphere, for GetRandomDirection() (set up once at startup & never changed)
+static const CConeSampler sSphereCone(D3DXVECTOR3(0,1,0),D3DX_PI);
+
+// VaryDirection() is normally asked for the same cone over & over, so each thread keeps the last one.
+// (a thread local can't have a constructor, so the sampler is built in place in plain memory)
+static __declspec(thread) bool tVaryCached=false;
+static __declspec(thread) float tVaryKey[4];	// the axis & angle of the cached cone
+static __declspec(thread) union
+{
+	float Align;
+	char Bytes[sizeof(CConeSampler)];
+} tVaryCone;
+
 D3DXVECTOR3 CParticleSystem::GetRandomDirection()
 {
-	D3DXVECTOR3 v(GetRandomFloat(-1,1),GetRandomFloat(-1,1),GetRandomFloat(-1,1));
-	D3DXVec3Normalize(&v,&v);
-	return v;
+	return sSphereCone.Generate(CRandom::Get());
 }
 
 D3DXVECTOR3 CParticleSystem::VaryDirection(const D3DXVECTOR3& vec, float angRad)
 {
-	D3DXMATRIX rot;
-	D3DXMatrixRotationYawPitchRoll(&rot,GetRandomFloat(-angRad,angRad),GetRandomFloat(-angRad,angRad),GetRandomFloat(-angRad,angRad));
-	D3DXVECTOR3 result;
-	D3DXVec3TransformCoord(&result,&vec,&rot);
-	return result;
+	CConeSampler* pCone=(CConeSampler*)tVaryCone.Bytes;
+	if (!tVaryCached || tVaryKey[0]!=vec.x || tVaryKey[1]!=vec.y || tVaryKey[2]!=vec.z || tVaryKey[3]!=angRad)
+	{
+		new(pCone) CConeSampler(vec,angRad);	// (nothing to destroy, its just numbers)
+		tVaryKey[0]=vec.x;	tVaryKey[1]=vec.y;	tVaryKey[2]=vec.z;	tVaryKey[3]=angRad;
+		tVaryCached=true;
+	}
+	return pCone->Generate(CRandom::Get());
 }
 
 D3DCOLOR CParticleSystem::GetRandomColour()
 {
-	return D3DCOLOR_XRGB(rand()%256,rand()%256,rand()%256);
+	// 24 random bits is all three channels at once
+	return D3DCOLOR_XRGB(0,0,0)|(CRandom::Get().Next()>>8);
 }
 
 //*****************************************************************************
@@ -374,51 +804,77 @@ bool CPrecipitation::Init( IDirect3DDevice9* inDevice, char* inTextureFilename,D
 	return CParticleSystem::Init(inDevice,inTextureFilename,setting);
 }
 
-void CPrecipitation::Update( float inDeltaTime )
+void CPrecipitation::BeginUpdate( float inDeltaTime )
 {
-	// could call the base class, but not bothering:
-
 	// compute limits:
 	D3DXVECTOR3 minA=mCentre-mDimension/2;
 	D3DXVECTOR3 maxA=mCentre+mDimension/2;
+	// the number of particles is cut down, rather than the emission
+	int target=(int)(mSettings.MaxParticles*mEmitScale);
+	if (mCount>target)
+	{
+		mCount=target;
+		if (mpRecorder)	mpRecorder->RecordCut(this);
+	}
 	// add new particles:
-	while(mParticles.size()< mSettings.MaxParticles)
+	int count=TakeBudget(target-mCount);
+	for(int i=0;i<count;i++)
 	{
-		// add them
-        //TODO("Add particle");
+		// particle should be between minA and maxA for location
+		// and should be moving in direction mEmitDirection
 		D3DXVECTOR3 pos = D3DXVECTOR3(GetRandomVector(minA, maxA));
 		D3DXVECTOR3 vel = mEmitDirection * mEmitDirVar;
 		AddParticle(pos,vel);
-        // particle should be between minA and maxA for location
-        // and should be moving in direction mEmitDirection
-        // but the direction should vary a bit (mEmitDirVar);
 	}
-	// move all:
-	std::deque<SAttribute>::iterator theIterator = mParticles.begin();
-	std::deque<SAttribute>::iterator theEnd = mParticles.end();
-	for( ; theIterator != theEnd; ++theIterator )
+}
+
+/// wraps v into the range lo..lo+size (however far out it is)
+static inline float Wrap(float v,float lo,float size)
+{
+	if (v>=lo && v<lo+size)	return v;	// the usual case
+	float r=fmodf(v-lo,size);
+	if (r<0)	r+=size;
+	return lo+r;
+}
+
+void CPrecipitation::UpdateRange( int begin, int end, float inDeltaTime )
+{
+	// compute limits:
+	D3DXVECTOR3 minA=mCentre-mDimension/2;
+	D3DXVECTOR3 maxA=mCentre+mDimension/2;
+	// move all (they never age):
+	IntegrateParticles(mParticles,begin,(end+3)&~3,inDeltaTime);
+	// wrap, so the box is the same all over (however far the centre moved since last time)
+	for(int i=begin;i<end;i++)
+	{
+		mParticles.PosX[i]=Wrap(mParticles.PosX[i],minA.x,mDimension.x);
+		mParticles.PosY[i]=Wrap(mParticles.PosY[i],minA.y,mDimension.y);
+		mParticles.PosZ[i]=Wrap(mParticles.PosZ[i],minA.z,mDimension.z);
+	}
+	if (!CollidesWithGround())	return;
+	// anything which hit the ground goes back to the top, less however far it went under
+	// (but never into the ground, & if the ground is above the box, eg. a hill by the camera, it waits at the top)
+	GetGroundHeights(begin,end);
+	const float* pGround=&mGroundHeight[0];
+	for(int i=begin;i<end;i++)
 	{
-		theIterator->mPosition += theIterator->mVelocity * inDeltaTime;
-		// wrap:
-		if (theIterator->mPosition.x<minA.x)
-			theIterator->mPosition.x+=mDimension.x;
-		if (theIterator->mPosition.x>maxA.x)
-			theIterator->mPosition.x-=mDimension.x;
-		if (theIterator->mPosition.y<minA.y)
-			theIterator->mPosition.y+=mDimension.y;
-		if (theIterator->mPosition.y>maxA.y)
-			theIterator->mPosition.y-=mDimension.y;
-		if (theIterator->mPosition.z<minA.z)
-			theIterator->mPosition.z+=mDimension.z;
-		if (theIterator->mPosition.z>maxA.z)
-			theIterator->mPosition.z-=mDimension.z;
+		if (mParticles.PosY[i]>=pGround[i])	continue;
+		if (pGround[i]>=maxA.y)
+		{
+			mParticles.PosY[i]=maxA.y;
+			continue;
+		}
+		float y=maxA.y-(pGround[i]-mParticles.PosY[i]);
+		mParticles.PosY[i]=(y>pGround[i])? y : pGround[i];
 	}
-
 }
 
 //*****************************************************************************
 // Explosion System
 //********************
+// how many random colour ramps the explosions pick from
+const int EXPLOSION_RAMPS=64;
+
 bool CExplosion::Init( IDirect3DDevice9* inDevice, char* inTextureFilename)
 {
 	SParticleSetting setting;
@@ -427,35 +883,37 @@ bool CExplosion::Init( IDirect3DDevice9* inDevice, char* inTextureFilename)
 	setting.SourceBlend=D3DBLEND_ONE;
 	setting.DestBlend=D3DBLEND_ONE;
 	setting.MaxParticles=1000;
-	return CParticleSystem::Init(inDevice,inTextureFilename,setting);
+	if (CParticleSystem::Init(inDevice,inTextureFilename,setting)==false)
+		return false;
+	// a set of random colour ramps to pick from
+	mRandomRamps=(int)mRampKeys.size()/2;
+	for(int i=0;i<EXPLOSION_RAMPS;i++)
+		FindOrAddRamp(D3DXCOLOR(GetRandomColour()),D3DXCOLOR(GetRandomColour()));
+	return true;
 }
 void CExplosion::Explode(const D3DXVECTOR3& pos,float speed,int number)
 {
-	//TODO(CExplosion::Explode);
-	// AddParticle doesn't allow for random colour
-	// so we do it all ourselves
-
-	// TODO: add in 'number' particles
-	// with a random start colour & endCol
+	if (mCapacity==0)	return;	// not initialised
+	// each particle gets one of the random colour ramps made in Init()
 	// & a random direction
+	number=ScaleCount(number,pos);
+	if (mpRecorder)	mpRecorder->RecordExplode(this,pos,NULL,NULL,speed,number);
+	CRandom& rnd=CRandom::Get();
 	for(int i = 0 ; i<number; i++)
 	{
-		D3DXCOLOR endCol= GetRandomColour();
-		D3DXCOLOR startCol = GetRandomColour();
-		D3DXVECTOR3 dir = speed * GetRandomDirection();
-		AddParticle(pos, dir, startCol,endCol,mSettings.LifeTime);
+		int ramp=mRandomRamps+(int)(rnd.Next()%EXPLOSION_RAMPS);
+		SetParticle(NewParticle(),pos,speed*GetRandomDirection(),mSettings.LifeTime,ramp);
 	}
 }
 
 void CExplosion::Explode(const D3DXVECTOR3& pos,D3DXCOLOR startCol,D3DXCOLOR endCol,float speed,int number)
 {
-	//TODO(CExplosion::Explode);
-	
+	if (mCapacity==0)	return;	// not initialised
+	int ramp=FindOrAddRamp(startCol,endCol);
+	number=ScaleCount(number,pos);
+	if (mpRecorder)	mpRecorder->RecordExplode(this,pos,&startCol,&endCol,speed,number);
 	for(int i = 0 ; i<number; i++)
 	{
-		AddParticle(pos, speed*GetRandomDirection(), startCol,endCol,mSettings.LifeTime);
+		SetParticle(NewParticle(),pos,speed*GetRandomDirection(),mSettings.LifeTime,ramp);
 	}
-	// TODO: add in 'number' particles
-	// with a random direction 
-	// & the specified colours
 }
\ No newline at end of file
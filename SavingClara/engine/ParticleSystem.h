@@ -10,7 +10,9 @@
 #pragma once
 
 #include <d3dx9.h>
-#include <deque>
+#include <vector>
+
+class CMeshNode;
 
 /// This is the rendering type
 /// used it the vertex buffered
@@ -21,25 +23,44 @@ struct SPointSprite
 };
 const DWORD D3DFVF_POINTSPRITE=(D3DFVF_XYZ|D3DFVF_DIFFUSE);
 
-/// this is the individual particles
-struct SAttribute
-{
-	SAttribute()
-	{
-		mLifeTime = 0.0f;
-		mAge      = 0.0f;
-		mIsAlive  = true;
-	}
+/** The particles themselves.
+These are stored as a structure of arrays (one array per value) rather than an array of structures,
+so that Update can work on 4 particles at a time.
+All arrays are 16 byte aligned & the same size (a multiple of 4).
 
-	D3DXVECTOR3 mPosition;     
-	D3DXVECTOR3 mVelocity;     
-	float       mLifeTime;     // how long the particle lives for before dying  
-	float       mAge;          // current age of the particle  
-	D3DXCOLOR   mColor;        // current color of the particle   
-	D3DXCOLOR   mColorFade;    // how the color fades with respect to time
-	bool        mIsAlive;    
+The colour is not stored, instead each particle has a colour ramp (see CParticleSystem::FindOrAddRamp)
+which is looked up using its age when drawing.
+So a particle is 33 bytes, rather than the 64 it would be with a colour & fade.
+*/
+struct SParticleArrays
+{
+	float *PosX,*PosY,*PosZ;	// position
+	float *VelX,*VelY,*VelZ;	// velocity
+	float *Age;	// age of the particle as a fraction of its life (0=new, >1 is dead)
+	float *InvLife;	// 1/lifetime, how fast Age goes up
+	unsigned char *Ramp;	// which colour ramp it uses (must be the last one)
 };
 
+/// number of colours in each colour ramp
+const int PARTICLE_RAMP_SIZE=64;
+/// number of frames of particles the vertex buffer holds
+const int PARTICLE_VB_FRAMES=3;
+/// max number of colour ramps in a particle system
+const int MAX_PARTICLE_RAMPS=256;
+
+/** Fills in point sprites from the particles, ready for drawing.
+This does not touch the device, so it can be used (& tested) without one.
+\param particles the particles (all of them must be alive)
+\param ramps the colour ramps (PARTICLE_RAMP_SIZE colours each)
+\param order the order to draw them in (NULL for the order they are in)
+\param count how many to do
+\param [out] out count point sprites
+*/
+void PackPointSprites(const SParticleArrays& particles,const D3DCOLOR* ramps,const int* order,int count,SPointSprite* out);
+
+class CTerrain;
+class CParticleRecorder;
+
 /** The settings for the particle system.
 You will need to fill this class in & use it to describe your particles
 */
@@ -50,6 +71,13 @@ struct SParticleSetting
 	float Size;	// size of the particle
 	float LifeTime;	// lifetime of the particle
 	DWORD SourceBlend,DestBlend;	// source & destination blend values
+	int Priority;	// when over the particle budget, the lowest priority systems are cut down first
+	float LodDistance;	// emission is cut down beyond this distance from the camera (0 for never)
+	bool DepthSort;	// draw back to front (needed for D3DBLEND_INVSRCALPHA, not for additive blends)
+	/// what happens when a particle hits the ground (see CParticleSystem::SetTerrain)
+	enum Collision {PASS_THROUGH, KILL, BOUNCE, STICK};
+	Collision GroundCollision;	// what happens when it hits the ground
+	float Bounce;	// for BOUNCE: how much of the speed is kept (0..1)
 
 	SParticleSetting()	// constructor with default values
 	{
@@ -57,10 +85,73 @@ struct SParticleSetting
 		StartColor=EndColor=D3DCOLOR_XRGB(255,0,0);
 		Size=LifeTime=1;
 		SourceBlend=DestBlend=D3DBLEND_ONE;
+		Priority=0;
+		LodDistance=0;
+		DepthSort=false;
+		GroundCollision=PASS_THROUGH;
+		Bounce=0.5f;
 	}
 };
 
 
+/** The settings for a particle emitter.
+Fill this in & pass it to CParticleSystem::AddEmitter()
+*/
+struct SEmitterSetting
+{
+	float Rate;	// particles per second (fractions carry over to the next frame)
+	D3DXVECTOR3 Offset;	// where to emit from, relative to the node (see CNode::OffsetPos)
+	D3DXVECTOR3 Direction;	// centre of the cone of emission
+	bool LocalDirection;	// if true Direction is turned with the node, otherwise its in world space
+	float Angle;	// half angle of the cone (radians)
+	float MinSpeed,MaxSpeed;	// each particle gets a random speed in this range
+	bool UseColors;	// if true use the colors below, otherwise the particle system's colors
+	D3DXCOLOR StartColor,EndColor;	// start & end colors
+	float LifeTime;	// lifetime of the particles (0 for the particle system's lifetime)
+
+	SEmitterSetting()	// constructor with default values
+	{
+		Rate=10;
+		Offset=D3DXVECTOR3(0,0,0);
+		Direction=D3DXVECTOR3(0,1,0);
+		LocalDirection=false;
+		Angle=0;
+		MinSpeed=MaxSpeed=1;
+		UseColors=false;
+		StartColor=EndColor=D3DCOLOR_XRGB(255,0,0);
+		LifeTime=0;
+	}
+};
+
+/** A source of particles, owned by a CParticleSystem.
+The emitter can be bound to a CMeshNode, in which case it follows the node about
+& is removed automatically once the node is dead.
+Otherwise use SetPos() to move it & Kill() to remove it.
+\note the system keeps the removed emitters to reuse (see CParticleSystem::ReserveEmitters),
+so don't hang on to an emitter once its dead, it may come back as someone else's.
+*/
+class CParticleEmitter
+{
+public:
+	SEmitterSetting& GetSettings(){return mSettings;}
+	CMeshNode* GetNode(){return mpNode;}
+	/// sets the position (only used if its not bound to a node)
+	void SetPos(const D3DXVECTOR3& pos){mPos=pos;}
+	/// stops the emitter, it will be removed by the particle system on its next update
+	void Kill(){mAlive=false;}
+	bool IsAlive(){return mAlive;}
+private:
+	friend class CParticleSystem;	// only the particle system can create these
+	CParticleEmitter(const SEmitterSetting& settings,CMeshNode* pNode);
+	/// \internal starts it afresh (as if just made)
+	void Reset(const SEmitterSetting& settings,CMeshNode* pNode);
+	SEmitterSetting mSettings;
+	CMeshNode* mpNode;	// the node to follow (may be NULL)
+	D3DXVECTOR3 mPos;	// the position, if there is no node
+	float mAccumulator;	// fraction of a particle left over from last frame
+	bool mAlive;
+};
+
 /** This is the particle system class which holds all the rendering code
 as well as all the particles.
 */
@@ -72,30 +163,103 @@ public:
 
 	virtual bool Init( IDirect3DDevice9* inDevice, const char* inTextureFilename,
 					const SParticleSetting& settings);
-	virtual void Clear(){mParticles.clear();}
+	virtual void Clear(){mCount=mReplace=0;}
 
 	virtual void AddParticle(D3DXVECTOR3 pos,D3DXVECTOR3 vel=D3DXVECTOR3(0,0,0));
 
 	virtual void AddParticle(D3DXVECTOR3 pos,D3DXVECTOR3 vel,D3DXCOLOR startCol,D3DXCOLOR endCol, float lifeTime);
 
-	virtual void Update( float inDeltaTime );
+	/** Adds a number of particles at once, moving away from pos in random directions within a cone.
+	This is much faster than calling AddParticle() in a loop with VaryDirection().
+	\param count how many particles
+	\param pos where they start
+	\param dir the centre of the cone (the length does not matter)
+	\param angle the half angle of the cone in radians
+	\param minSpeed,maxSpeed each particle gets a random speed in this range
+	*/
+	void Emit(int count,const D3DXVECTOR3& pos,const D3DXVECTOR3& dir,float angle,float minSpeed=1,float maxSpeed=1);
+	/// as Emit() above, but with the colors & lifetime provided
+	void Emit(int count,const D3DXVECTOR3& pos,const D3DXVECTOR3& dir,float angle,float minSpeed,float maxSpeed,
+				const D3DXCOLOR& startCol,const D3DXCOLOR& endCol,float lifeTime);
+
+	/** Emits the particles from all the emitters, then moves & ages all the particles.
+	This is just BeginUpdate(), UpdateRange() over all the particles, then EndUpdate().
+	*/
+	void Update( float inDeltaTime );
+
+	/// \defgroup SplitUpdate Update in parts
+	/// Update() split up so the particles can be updated on several threads (see CParticleManager).
+	/// Derived classes should override these rather than Update().
+	/// @{
+	/// adds any new particles, call on the main thread before UpdateRange()
+	virtual void BeginUpdate( float inDeltaTime );
+	/** moves & ages particles begin..end-1.
+	Can be called from any thread, so long as no other thread is doing the same particles at the same time.
+	\param begin the first particle (must be a multiple of 4)
+	\param end one after the last particle (GetCount() for the end of the list)
+	*/
+	virtual void UpdateRange( int begin, int end, float inDeltaTime );
+	/// removes the dead particles, call on the main thread once all the UpdateRange() calls are done
+	virtual void EndUpdate( float inDeltaTime );
+	/// @}
+
+	/** Adds an emitter to the system.
+	The system owns the emitter & will remove it when its killed, its node dies or the system is deleted.
+	Removed emitters are kept & reused, so once there are enough, adding them doesn't new anything.
+	\param settings how to emit
+	\param pNode the node to follow (NULL if you wish to position it yourself)
+	\return the emitter, in case you want to change it later
+	*/
+	CParticleEmitter* AddEmitter(const SEmitterSetting& settings,CMeshNode* pNode=NULL);
+	/// removes all the emitters (they are kept to be reused)
+	void ClearEmitters();
+	/** Makes sure there are enough emitters to have this many at once, without new'ing any more.
+	Use it for the systems which get lots of short lived emitters (eg. the shot trails, see CShotStore::AddEmitter).
+	*/
+	void ReserveEmitters(int count);
+
+	/// sets the terrain for SParticleSetting::GroundCollision (NULL for none)
+	void SetTerrain(CTerrain* pTerrain){mpTerrain=pTerrain;}
+
+	/// sets the recorder which records everything done to this system (see CParticleRecorder::Add)
+	void SetRecorder(CParticleRecorder* pRecorder,int id){mpRecorder=pRecorder;mRecordId=id;}
+	CParticleRecorder* GetRecorder(){return mpRecorder;}
+	int GetRecordId(){return mRecordId;}
 
 	virtual void Draw(const D3DXMATRIX& world);		///< call this to draw all particles
 
 	bool IsEmpty();	///< returns true if there are no particles
 	bool IsDead();	///< returns true if there are no live particles
-	std::deque<SAttribute>* GetParticles(){return &mParticles;}
+	int GetCount(){return mCount;}	///< number of particles
 	SParticleSetting& GetSettings(){return mSettings;}
 
-	/// removes the dead particles, keeping the count down.
+	/** removes the dead particles, keeping the count down.
+	Each dead particle is replaced by the last one in the list, so the order of the particles is not kept.
+	*/
 	virtual void RemoveDeadParticles();
 
 	// helpers for deling with resetting of the screen
 	void OnLostDevice();	// called just before reset device
 	void OnResetDevice();	// called just after reset device
 
+	/// \defgroup Lod Level of detail
+	/// These are normally set by CParticleManager each frame to keep the number of particles down.
+	/// They cut down Emit(), the emitters & CExplosion::Explode(), but not AddParticle().
+	/// @{
+	/// sets the camera position & zoom (1 for a 45 degree field of view, more if zoomed in) for SParticleSetting::LodDistance
+	void SetLodView(const D3DXVECTOR3& eye,float zoom){mLodEye=eye;mLodZoom=zoom;}
+	/// sets the fraction of the particles to emit (0..1)
+	void SetEmitScale(float scale){mEmitScale=scale;}
+	float GetEmitScale(){return mEmitScale;}
+	/// sets the count of particles which may still be emitted, shared by all the systems (NULL for no limit)
+	void SetEmitBudget(int* pBudget){mpEmitBudget=pBudget;}
+	/// whether CParticleManager holds it to the budget (& may cut it down)
+	virtual bool IsBudgeted(){return true;}
+	/// @}
+
 
 	/// \defgroup Rand Random number generators
+	/// These all use the per thread generator in Random.h, call SeedRandom() for repeatable results
 	/// @{
 	/// returns a random float in the range inLowBound..inHighBound
 	static float GetRandomFloat( float inLowBound, float inHighBound );
@@ -103,22 +267,86 @@ public:
 	static D3DXVECTOR3 GetRandomVector( const D3DXVECTOR3& inMin, const D3DXVECTOR3& inMax );
 	/// returns a random D3DXVECTOR3 which is normalised to length 1
 	static D3DXVECTOR3 GetRandomDirection();
-	/// adds a variation of the provided angle to a direction
+	/// returns a random direction within angRad of vec (the same length as vec), the last cone is kept so asking again is cheap
 	static D3DXVECTOR3 VaryDirection(const D3DXVECTOR3& vec, float angRad);
 	/// returns a random colour
 	static D3DCOLOR GetRandomColour();
 	/// }@
 protected:
+	friend class CParticleRecorder;	// to record & replay the particles
+	friend class CParticlePlayer;
+
 	virtual void PreDraw();	///< \internal DO NOT CALL
 	virtual void PostDraw();	///< \internal DO NOT CALL
 
+	/// \internal is particle i alive
+	bool IsAlive(int i){return mParticles.Age[i]<=1;}
+	/// \internal copies particle src over particle dest
+	void CopyParticle(int dest,int src);
+	/// \internal returns the index for a new particle (replacing one if its full)
+	int NewParticle();
+	/// \internal fills in particle i
+	void SetParticle(int i,const D3DXVECTOR3& pos,const D3DXVECTOR3& vel,float lifeTime,int ramp);
+	/// \internal how fast SParticleArrays::Age goes up for a lifetime
+	static float GetInvLife(float lifeTime);
+	/** \internal returns the colour ramp which fades from start to end.
+	The ramp is added if its not there already. If there are MAX_PARTICLE_RAMPS already the closest is used instead.
+	*/
+	int FindOrAddRamp(const D3DXCOLOR& start,const D3DXCOLOR& end);
+	/** \internal sorts the particles back to front.
+	The particles are not moved, instead mSortIndex is filled with their indexes in order.
+	\param worldView the world & view matrices multiplied together (Draw() gets the view from the device)
+	*/
+	void SortByDepth(const D3DXMATRIX& worldView);
+	/// \internal checks particles begin..end-1 against the terrain
+	void CollideWithTerrain(int begin,int end);
+	/// \internal whether the particles are checked against the ground (there is a terrain, or recorded heights)
+	virtual bool CollidesWithGround();
+	/** \internal fills mGroundHeight[begin..end-1] with the ground under particles begin..end-1.
+	The heights come from the terrain, or from the recording when its being replayed (see CParticlePlayer).
+	*/
+	virtual void GetGroundHeights(int begin,int end);
+	/// \internal emits the particles from all the emitters (& removes the dead ones)
+	void UpdateEmitters(float inDeltaTime);
+	/// \internal Emit() without the level of detail
+	void EmitCone(int count,const D3DXVECTOR3& pos,const D3DXVECTOR3& dir,float angle,float minSpeed,float maxSpeed,
+				const D3DXCOLOR& startCol,const D3DXCOLOR& endCol,float lifeTime);
+	/// \internal the fraction of the particles emitted at pos which should be kept
+	float GetLodScale(const D3DXVECTOR3& pos);
+	/// \internal takes up to count particles from the budget, returns how many it got
+	int TakeBudget(int count);
+	/// \internal how many of count particles emitted at pos to keep (GetLodScale() & TakeBudget())
+	int ScaleCount(int count,const D3DXVECTOR3& pos);
+
 protected:
 //public:	// hack for particle editor...
 	IDirect3DDevice9*       mpDevice;
 	SParticleSetting		mSettings;
 	IDirect3DTexture9*      mpTexture;
 	IDirect3DVertexBuffer9* mpVertexBuffer;
-	std::deque<SAttribute>   mParticles;
+	// the particles are kept packed in 0..mCount-1, in no particular order
+	SParticleArrays	mParticles;
+	float*	mpParticleMemory;	// the block which all the arrays are in
+	int	mCapacity;	// size of the arrays (MaxParticles rounded up to a multiple of 4)
+	int	mCount;	// number of particles
+	int	mReplace;	// which particle to replace next when full
+	std::vector<CParticleEmitter*> mEmitters;
+	std::vector<CParticleEmitter*> mFreeEmitters;	// removed emitters, to be reused
+	std::vector<D3DXCOLOR> mRampKeys;	// start & end colour of each ramp
+	std::vector<D3DCOLOR> mRamps;	// PARTICLE_RAMP_SIZE colours for each ramp
+	D3DXVECTOR3	mLodEye;	// the camera position
+	float	mLodZoom;	// the camera zoom
+	float	mEmitScale;	// fraction of the particles to emit
+	int*	mpEmitBudget;	// how many particles may still be emitted (may be NULL)
+	CTerrain*	mpTerrain;	// for the ground collision (may be NULL)
+	CParticleRecorder*	mpRecorder;	// (may be NULL)
+	int	mRecordId;	// this system's number in the recording
+	std::vector<float> mGroundHeight;	// the ground under each particle
+	const float*	mpReplayGround;	// the recorded ground under each particle, when replaying (NULL otherwise)
+	// for the depth sort
+	std::vector<float> mSortDepth;	// view space depth of each particle
+	std::vector<unsigned short> mSortKey;	// the depth as a 16 bit number
+	std::vector<int> mSortIndex,mSortTemp;	// the particle indexes, in order
 
 	//
 	// Following data elements used for rendering the p-system efficiently
@@ -134,6 +362,11 @@ Works similar to a normal particle system but with the following changes.
 + you don't need to call AddParticle, as Update will do this for you.
 + you should SetCentre() onto the camera for best effect.
 
+The particles never die: the box wraps around (like a torus), so a flake which leaves one side comes
+back in the other, & the box can be moved any distance without changing the density.
+If there is a terrain (see SetTerrain()) flakes which hit the ground go back to the top.
+So once its full, it costs the same every frame.
+
 */
 class CPrecipitation : public CParticleSystem
 {
@@ -150,17 +383,31 @@ public:
 	/** Special init function.
 	*/
 	bool Init(IDirect3DDevice9* inDevice, char* inTextureFilename,D3DXVECTOR3 dir=D3DXVECTOR3(0,-5,0),float variation=D3DX_PI/180*10);
-	/// creates new particles & moves them
-	void Update( float inDeltaTime );
+	/// creates new particles
+	void BeginUpdate( float inDeltaTime );
+	/// moves the particles, wrapping them around the box (& from the ground to the top)
+	void UpdateRange( int begin, int end, float inDeltaTime );
+	/// the particles never die, so nothing to do
+	void EndUpdate( float inDeltaTime ){}
+	/// the flakes go back to the top when they hit the ground (whatever GroundCollision is)
+	bool CollidesWithGround(){return mpTerrain || mpReplayGround;}
+	/// there are always MaxParticles flakes, so they are left out of the budget (cutting them down makes the snow flicker)
+	bool IsBudgeted(){return false;}
 	/// updates the Precipitation box centre.
 	/// call this before Update() for preference
 	void SetCentre(D3DXVECTOR3 cent){mCentre=cent;}
 	/// sets the emittion direction
 	void SetEmitDirection(D3DXVECTOR3 dir,float var){mEmitDirection=dir; mEmitDirVar=var;}
+	const D3DXVECTOR3& GetCentre(){return mCentre;}
+	const D3DXVECTOR3& GetDimension(){return mDimension;}
+	void SetDimension(D3DXVECTOR3 dim){mDimension=dim;}
 };
 
 class CExplosion : public CParticleSystem
 {
+	friend class CParticleRecorder;
+	friend class CParticlePlayer;
+	int mRandomRamps;	// the first of the random colour ramps
 public:
 	// init with standard settings
 	bool Init( IDirect3DDevice9* inDevice, char* inTextureFilename);
@@ -0,0 +1,85 @@
+/*==============================================
+ * Perception
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#include <math.h>
+#include "Perception.h"
+
+void Perceive(const D3DXVECTOR3& pos,const D3DXVECTOR3& forward,const D3DXVECTOR3& right,
+				const D3DXVECTOR3& target,SPerception& out)
+{
+	D3DXVECTOR3 to=target-pos;
+	out.DistSq=D3DXVec3LengthSq(&to);
+	out.Side=to.x*right.x+to.z*right.z;
+	// the angle across the ground: dot product of the two directions, over their lengths
+	float lenSq=(to.x*to.x+to.z*to.z)*(forward.x*forward.x+forward.z*forward.z);
+	if (lenSq<=0)
+	{
+		out.CosAngle=1;	// (on top of it, or looking straight up: call that in front)
+		return;
+	}
+	out.CosAngle=(to.x*forward.x+to.z*forward.z)/sqrtf(lenSq);
+	if (out.CosAngle>1)	out.CosAngle=1;	// (rounding, so acos is safe)
+	if (out.CosAngle<-1)	out.CosAngle=-1;
+}
+
+CHearingGrid::CHearingGrid(float cellSize,int buckets)
+{
+	mInvCellSize=1/cellSize;
+	mNumBuckets=1;
+	while((int)mNumBuckets<buckets)
+		mNumBuckets*=2;
+}
+
+void CHearingGrid::Clear()
+{
+	mEntries.clear();
+	mSorted.clear();
+	mStart.clear();
+}
+
+void CHearingGrid::Add(int id,const D3DXVECTOR3& pos)
+{
+	SEntry entry={id,Cell(pos.x),Cell(pos.z),pos.x,pos.z};
+	mEntries.push_back(entry);
+}
+
+void CHearingGrid::Build()
+{
+	// counting sort: count each bucket, work out where they start, then drop each in
+	mStart.assign(mNumBuckets+1,0);
+	for(unsigned i=0;i<mEntries.size();i++)
+		mStart[Bucket(mEntries[i].CellX,mEntries[i].CellZ)+1]++;
+	for(unsigned b=0;b<mNumBuckets;b++)
+		mStart[b+1]+=mStart[b];
+	mSorted.resize(mEntries.size());
+	std::vector<int> next(mStart.begin(),mStart.end()-1);
+	for(unsigned i=0;i<mEntries.size();i++)
+		mSorted[next[Bucket(mEntries[i].CellX,mEntries[i].CellZ)]++]=mEntries[i];
+}
+
+void CHearingGrid::Query(const D3DXVECTOR3& centre,float radius,std::vector<int>& out)
+{
+	if (mSorted.empty())	return;
+	const float radiusSq=radius*radius;
+	const int x0=Cell(centre.x-radius),x1=Cell(centre.x+radius);
+	const int z0=Cell(centre.z-radius),z1=Cell(centre.z+radius);
+	for(int cz=z0;cz<=z1;cz++)
+	{
+		for(int cx=x0;cx<=x1;cx++)
+		{
+			unsigned b=Bucket(cx,cz);
+			for(int i=mStart[b];i<mStart[b+1];i++)
+			{
+				const SEntry& e=mSorted[i];
+				// (other cells may share the bucket)
+				if (e.CellX!=cx || e.CellZ!=cz)	continue;
+				float dx=e.X-centre.x,dz=e.Z-centre.z;
+				if (dx*dx+dz*dz<=radiusSq)
+					out.push_back(e.Id);
+			}
+		}
+	}
+}
@@ -0,0 +1,92 @@
+/*==============================================
+ * Perception
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#pragma once
+
+/** \file Perception.h What the AI can see & hear.
+Rather than each state working out the distance & direction to the player again
+(a square root for each distance & an atan2 for the direction), Perceive() works it out once per update:
+the squared distance (compared against squared ranges) & the cosine of the angle off the agent's facing
+(a dot product, compared against the cosine of the view angle, worked out once).
+
+CHearingGrid finds the agents close enough to hear a noise, so a shot only reaches the ones nearby
+rather than being checked by every agent.
+*/
+
+#include <vector>
+#include <d3dx9.h>
+
+/// what an agent can see of a target (from Perceive())
+struct SPerception
+{
+	float DistSq;	// the squared distance to the target
+	float CosAngle;	// cosine of the angle between the agent's facing & the target, across the ground (1 dead ahead, -1 behind)
+	float Side;	// >0 if the target is to the right, <0 if its to the left
+};
+
+/** Works out what an agent can see of a target.
+The angle is across the ground (as the yaw), the distance is the full 3D one.
+\param pos where the agent is
+\param forward,right the agent's facing (see CNode::GetBasis)
+\param target where the target is
+\param [out] out what it can see
+*/
+void Perceive(const D3DXVECTOR3& pos,const D3DXVECTOR3& forward,const D3DXVECTOR3& right,
+				const D3DXVECTOR3& target,SPerception& out);
+/// whether the target is within dist
+inline bool InRange(const SPerception& see,float dist){return see.DistSq<=dist*dist;}
+/// whether the target is within a cone either side of the facing (cosAngle is the cosine of that angle)
+inline bool InCone(const SPerception& see,float cosAngle){return see.CosAngle>=cosAngle;}
+
+/** A grid on the ground, for finding the agents near a point (eg. the ones who hear a noise).
+The cells are hashed into a fixed number of buckets, so the world can be any size.
+Its rebuilt whenever its needed (Clear(), Add() each agent, Build()), which is a single counting sort.
+\code
+grid.Clear();
+for(int i=0;i<agents.size();i++)
+	grid.Add(i,agents[i]->GetPos());
+grid.Build();
+grid.Query(noisePos,HEARING_DISTANCE,heard);	// heard is the ids of the agents in range
+\endcode
+*/
+class CHearingGrid
+{
+public:
+	/** Constructor.
+	\param cellSize the size of a cell (about the range of the queries is best)
+	\param buckets number of buckets (rounded up to a power of 2)
+	*/
+	CHearingGrid(float cellSize,int buckets=4096);
+	/// empties the grid
+	void Clear();
+	/// adds an agent (call Build() once they are all added)
+	void Add(int id,const D3DXVECTOR3& pos);
+	/// sorts the agents into their cells
+	void Build();
+	/** Finds the agents within radius of centre (across the ground).
+	\param centre the centre
+	\param radius the range
+	\param [out] out the ids of the agents (added to the end)
+	*/
+	void Query(const D3DXVECTOR3& centre,float radius,std::vector<int>& out);
+	int GetCount(){return (int)mEntries.size();}
+private:
+	/// \internal an agent in the grid
+	struct SEntry
+	{
+		int Id;
+		int CellX,CellZ;
+		float X,Z;
+	};
+	int Cell(float v){return (int)floorf(v*mInvCellSize);}
+	unsigned Bucket(int cx,int cz){return ((unsigned)cx*73856093u ^ (unsigned)cz*19349663u)&(mNumBuckets-1);}
+
+	float mInvCellSize;
+	unsigned mNumBuckets;
+	std::vector<SEntry> mEntries;	// as added
+	std::vector<SEntry> mSorted;	// sorted by bucket
+	std::vector<int> mStart;	// where each bucket starts in mSorted (& one more for the end)
+};
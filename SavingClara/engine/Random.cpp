@@ -0,0 +1,151 @@
+/*==============================================
+ * Fast random numbers for GDEV Engine
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#include <windows.h>	// Interlocked functions
+#include <math.h>
+#include <xmmintrin.h>	// SSE
+#include "Random.h"
+
+// the seed which all the threads are seeded from
+static volatile LONG sSeed=12345;
+// bumped by SeedRandom(), so the threads know to reseed
+static volatile LONG sSeedVersion=1;
+// how many threads have been seeded (so each gets a different sequence)
+static volatile LONG sThreadCount=0;
+
+// each threads generator & the seed version it was seeded with
+static __declspec(thread) CRandom tRandom;
+static __declspec(thread) LONG tSeedVersion=0;
+
+// splitmix32, used to turn the one seed into the whole state
+static unsigned SplitMix(unsigned& x)
+{
+	unsigned z=(x+=0x9E3779B9);
+	z=(z^(z>>16))*0x85EBCA6B;
+	z=(z^(z>>13))*0xC2B2AE35;
+	return z^(z>>16);
+}
+
+void CRandom::Seed(unsigned seed)
+{
+	for(int i=0;i<4;i++)
+		mState[i]=SplitMix(seed);
+}
+
+CRandom& CRandom::Get()
+{
+	if (tSeedVersion!=sSeedVersion)
+	{
+		tSeedVersion=sSeedVersion;
+		unsigned thread=(unsigned)InterlockedIncrement(&sThreadCount);
+		tRandom.Seed((unsigned)sSeed+thread*0x632BE5AB);
+	}
+	return tRandom;
+}
+
+void SeedRandom(unsigned seed)
+{
+	InterlockedExchange(&sSeed,(LONG)seed);
+	InterlockedExchange(&sThreadCount,0);
+	InterlockedIncrement(&sSeedVersion);
+	CRandom::Get();	// reseed this thread now, so its always the first
+}
+
+//////////////////////////////////////////////////////////////
+// table of cos/sin around the circle, indexed by the top bits of a random number
+const int CIRCLE_BITS=10;
+const int CIRCLE_SIZE=1<<CIRCLE_BITS;
+static float sCircleCos[CIRCLE_SIZE],sCircleSin[CIRCLE_SIZE];
+// turns the rest of the bits into 0..1 (not including 1)
+const float CONE_SCALE=1.0f/(1u<<(32-CIRCLE_BITS));
+
+// fills in the table at startup
+static struct SCircleTableInit
+{
+	SCircleTableInit()
+	{
+		for(int i=0;i<CIRCLE_SIZE;i++)
+		{
+			// offset by half a step, so the table is symmetric
+			float ang=(i+0.5f)*(2*D3DX_PI/CIRCLE_SIZE);
+			sCircleCos[i]=cosf(ang);
+			sCircleSin[i]=sinf(ang);
+		}
+	}
+} sCircleTableInit;
+
+// a*c+b*u+d*v for 4 at once (in the same order as the scalar sums)
+static inline __m128 Combine(float a,float b,float d,__m128 c,__m128 u,__m128 v)
+{
+	return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(a),c),_mm_mul_ps(_mm_set1_ps(b),u)),_mm_mul_ps(_mm_set1_ps(d),v));
+}
+
+CConeSampler::CConeSampler(const D3DXVECTOR3& axis,float angle)
+{
+	mAxis=axis;
+	mCosAngle=cosf(angle);
+	// pick whichever world axis is least like the cone axis to build the basis from
+	D3DXVECTOR3 other=(fabs(axis.x)<fabs(axis.y))? D3DXVECTOR3(1,0,0) : D3DXVECTOR3(0,1,0);
+	if (fabs(axis.z)<fabs(axis.x) && fabs(axis.z)<fabs(axis.y))
+		other=D3DXVECTOR3(0,0,1);
+	float len=D3DXVec3Length(&axis);
+	D3DXVec3Cross(&mU,&axis,&other);
+	D3DXVec3Normalize(&mU,&mU);
+	mU*=len;
+	D3DXVec3Cross(&mV,&axis,&mU);
+	if (len>0)	mV/=len;
+}
+
+D3DXVECTOR3 CConeSampler::Generate(CRandom& rnd) const
+{
+	D3DXVECTOR3 result;
+	Generate(rnd,1,&result.x,&result.y,&result.z);
+	return result;
+}
+
+void CConeSampler::Generate(CRandom& rnd,int n,float* outX,float* outY,float* outZ) const
+{
+	// for an even spread over the cone's cap, the cosine of the angle from the axis is uniform
+	// (one random number does both: the bottom bits go round the circle, the rest are the cosine)
+	// 4 at a time first: the random numbers are drawn in the same order as the rest, so the results are the same
+	int i=0;
+	const __m128 one=_mm_set1_ps(1);
+	const __m128 range=_mm_set1_ps(1-mCosAngle);
+	for(;i+4<=n;i+=4)
+	{
+		float r[4];
+		unsigned k[4];
+		for(int j=0;j<4;j++)
+		{
+			unsigned bits=rnd.Next();
+			r[j]=(bits>>CIRCLE_BITS)*CONE_SCALE;
+			k[j]=bits&(CIRCLE_SIZE-1);
+		}
+		__m128 c=_mm_sub_ps(one,_mm_mul_ps(_mm_setr_ps(r[0],r[1],r[2],r[3]),range));
+		__m128 s=_mm_sqrt_ps(_mm_sub_ps(one,_mm_mul_ps(c,c)));
+		__m128 u=_mm_mul_ps(_mm_setr_ps(sCircleCos[k[0]],sCircleCos[k[1]],sCircleCos[k[2]],sCircleCos[k[3]]),s);
+		__m128 v=_mm_mul_ps(_mm_setr_ps(sCircleSin[k[0]],sCircleSin[k[1]],sCircleSin[k[2]],sCircleSin[k[3]]),s);
+		_mm_storeu_ps(outX+i,Combine(mAxis.x,mU.x,mV.x,c,u,v));
+		_mm_storeu_ps(outY+i,Combine(mAxis.y,mU.y,mV.y,c,u,v));
+		_mm_storeu_ps(outZ+i,Combine(mAxis.z,mU.z,mV.z,c,u,v));
+	}
+	for(;i<n;i++)
+	{
+		unsigned bits=rnd.Next();
+		float c=1-(bits>>CIRCLE_BITS)*CONE_SCALE*(1-mCosAngle);
+		float s=sqrtf(1-c*c);
+		unsigned k=bits&(CIRCLE_SIZE-1);
+		float u=sCircleCos[k]*s,v=sCircleSin[k]*s;
+		outX[i]=mAxis.x*c+mU.x*u+mV.x*v;
+		outY[i]=mAxis.y*c+mU.y*u+mV.y*v;
+		outZ[i]=mAxis.z*c+mU.z*u+mV.z*v;
+	}
+}
+
+void GenerateDirections(int n,const D3DXVECTOR3& axis,float angle,float* outX,float* outY,float* outZ)
+{
+	CConeSampler(axis,angle).Generate(CRandom::Get(),n,outX,outY,outZ);
+}
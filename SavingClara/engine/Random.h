@@ -0,0 +1,91 @@
+/*==============================================
+ * Fast random numbers for GDEV Engine
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#pragma once
+
+/** \file Random.h Fast random numbers.
+rand() is slow, low quality & shared between all threads.
+This provides a small, fast generator (xoshiro128**) with one per thread,
+and a sampler for random directions in a cone (used for particle emission).
+
+All generators are seeded from a single seed (see SeedRandom()), so the results are repeatable.
+
+\par References
+- http://prng.di.unimi.it/ (xoshiro128** & splitmix)
+*/
+
+#include <d3dx9.h>
+
+/** A xoshiro128** random number generator.
+This has no constructor so it can be a thread local, you must call Seed() before use.
+Normally you just want CRandom::Get() which returns the generator for this thread.
+*/
+class CRandom
+{
+public:
+	/// seeds the generator (any value is fine, including 0)
+	void Seed(unsigned seed);
+	/// returns a random 32 bit number
+	unsigned Next()
+	{
+		const unsigned result=Rotl(mState[1]*5,7)*9;
+		const unsigned t=mState[1]<<9;
+		mState[2]^=mState[0];
+		mState[3]^=mState[1];
+		mState[1]^=mState[2];
+		mState[0]^=mState[3];
+		mState[2]^=t;
+		mState[3]=Rotl(mState[3],11);
+		return result;
+	}
+	/// returns a random float in the range 0..1 (not including 1)
+	float NextFloat(){return (Next()>>8)*(1.0f/16777216.0f);}
+	/// returns a random float in the range lo..hi
+	float NextFloat(float lo,float hi){return lo+NextFloat()*(hi-lo);}
+
+	/// copies out the state (so it can be put back later with SetState(), eg. for a replay)
+	void GetState(unsigned outState[4]) const{for(int i=0;i<4;i++) outState[i]=mState[i];}
+	/// sets the state from GetState()
+	void SetState(const unsigned state[4]){for(int i=0;i<4;i++) mState[i]=state[i];}
+
+	/// returns the generator for the current thread (seeding it if needed)
+	static CRandom& Get();
+private:
+	static unsigned Rotl(unsigned x,int k){return (x<<k)|(x>>(32-k));}
+	unsigned mState[4];
+};
+
+/** Sets the seed for all the random generators.
+The current thread is reseeded at once, other threads will be reseeded the next time they call CRandom::Get().
+Each thread gets a different sequence, based upon the order they first asked for a number.
+*/
+void SeedRandom(unsigned seed);
+
+/** Generates random directions evenly spread over a cone.
+The axis basis & cosine of the angle are worked out once when the sampler is set up,
+so each direction only costs a few multiplies & a square root (no trig).
+*/
+class CConeSampler
+{
+public:
+	/** sets up the cone.
+	\param axis the centre of the cone (the directions will be the same length as this)
+	\param angle the half angle of the cone in radians (PI gives the whole sphere)
+	*/
+	CConeSampler(const D3DXVECTOR3& axis,float angle);
+	/// returns one random direction
+	D3DXVECTOR3 Generate(CRandom& rnd) const;
+	/// fills n random directions into separate x,y,z arrays
+	void Generate(CRandom& rnd,int n,float* outX,float* outY,float* outZ) const;
+private:
+	D3DXVECTOR3 mAxis,mU,mV;	// the axis & two vectors at right angles to it (all the length of the axis)
+	float mCosAngle;	// cosine of the half angle
+};
+
+/** Fills n random directions within angle radians of axis into separate x,y,z arrays.
+Uses this thread's generator.
+*/
+void GenerateDirections(int n,const D3DXVECTOR3& axis,float angle,float* outX,float* outY,float* outZ);
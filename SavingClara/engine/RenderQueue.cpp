@@ -0,0 +1,90 @@
+/*==============================================
+ * Render Queue
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#include <algorithm>
+#include <string.h>
+#include "RenderQueue.h"
+
+// the sort key, from the top: layer, texture, material, then mesh
+const int KEY_LAYER_SHIFT=56,KEY_TEXTURE_SHIFT=44,KEY_MATERIAL_SHIFT=30,KEY_MESH_SHIFT=0;
+const UINT64 KEY_TEXTURE_MASK=0xFFF,KEY_MATERIAL_MASK=0x3FFF,KEY_MESH_MASK=0x3FFFFFFF;
+
+CRenderQueue::CRenderQueue(IDirect3DDevice9* pDev)
+{
+	mpDev=pDev;
+	memset(&mStats,0,sizeof(mStats));
+}
+
+int CRenderQueue::FindOrAddId(std::vector<const void*>& ids,const void* p)
+{
+	// there are not many of these, so a search is fine
+	for(unsigned i=0;i<ids.size();i++)
+	{
+		if (ids[i]==p)	return i;
+	}
+	ids.push_back(p);
+	return (int)ids.size()-1;
+}
+
+void CRenderQueue::Add(ID3DXMesh* pMesh,int subset,const D3DMATERIAL9* pMaterial,IDirect3DTexture9* pTexture,
+					const D3DXMATRIX& world,int layer)
+{
+	SItem item;
+	item.pMesh=pMesh;
+	item.Subset=subset;
+	item.pMaterial=pMaterial;
+	item.pTexture=pTexture;
+	item.World=world;
+
+	// (ids which are too big just share a number, which costs a few extra changes but still works)
+	UINT64 key=(UINT64)(layer&0xFF)<<KEY_LAYER_SHIFT;
+	key|=(FindOrAddId(mTextureIds,pTexture)&KEY_TEXTURE_MASK)<<KEY_TEXTURE_SHIFT;
+	key|=(FindOrAddId(mMaterialIds,pMaterial)&KEY_MATERIAL_MASK)<<KEY_MATERIAL_SHIFT;
+	key|=(FindOrAddId(mMeshIds,pMesh)&KEY_MESH_MASK)<<KEY_MESH_SHIFT;
+	SKey sortKey={key,GetCount()};
+	mKeys.push_back(sortKey);
+	mItems.push_back(item);
+}
+
+void CRenderQueue::Add(CXMesh* pMesh,const D3DXMATRIX& world,int layer)
+{
+	for(int i=0;i<pMesh->GetNumMaterial();i++)
+		Add(pMesh->GetMesh(),i,&pMesh->GetMaterial(i),pMesh->GetTexture(i),world,layer);
+}
+
+void CRenderQueue::Flush()
+{
+	memset(&mStats,0,sizeof(mStats));
+	// (the items stay where they are, only the keys are moved)
+	std::sort(mKeys.begin(),mKeys.end());
+
+	const D3DMATERIAL9* pLastMaterial=NULL;
+	IDirect3DTexture9* pLastTexture=NULL;
+	for(unsigned k=0;k<mKeys.size();k++)
+	{
+		const SItem& item=mItems[mKeys[k].Index];
+		// only change what is different (the first draw sets both, as we don't know what was there)
+		if (k==0 || item.pTexture!=pLastTexture)
+		{
+			SetTexture(item.pTexture);
+			pLastTexture=item.pTexture;
+			mStats.TextureChanges++;
+		}
+		if (k==0 || (item.pMaterial!=pLastMaterial &&
+					memcmp(item.pMaterial,pLastMaterial,sizeof(D3DMATERIAL9))!=0))
+		{
+			SetMaterial(item.pMaterial);
+			mStats.MaterialChanges++;
+		}
+		pLastMaterial=item.pMaterial;
+		SetWorld(item.World);
+		DrawSubset(item.pMesh,item.Subset);
+		mStats.Draws++;
+	}
+	// (the space is kept for next frame)
+	mItems.clear();
+	mKeys.clear();
+}
@@ -0,0 +1,100 @@
+/*==============================================
+ * Render Queue
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#pragma once
+#include <vector>
+#include <d3d9.h>
+#include <d3dx9.h>
+#include "XMesh.h"
+
+/// what a CRenderQueue did in its last Flush()
+struct SRenderStats
+{
+	int Draws;	// number of subsets drawn
+	int TextureChanges;	// number of SetTexture calls
+	int MaterialChanges;	// number of SetMaterial calls
+};
+
+/** Collects up the draws for a frame, then draws them in the order which changes the device the least.
+Rather than drawing each mesh as soon as its reached (setting the material & texture for every subset),
+each subset is added to the queue with its world matrix.
+Flush() then sorts them by texture & material, & draws them all:
+only changing the texture & material when they are different to the last draw.
+
+Each draw is given a 64 bit sort key: the layer, then the texture, the material & the mesh.
+Draws with the same key stay in the order they were added.
+Lower layers are drawn first, so things which must be drawn after the rest (eg. the sky) can be put last.
+The queue grows as needed, so however much is added it is all sorted (& drawn) together in Flush().
+
+\code
+mpQueue=new CRenderQueue(GetDevice());
+...
+mpQueue->Add(mpTreeMesh,treeWorld);
+mPlayer.Submit(*mpQueue);	// (a CMeshNode)
+...
+mpQueue->Flush();	// draws the lot
+\endcode
+*/
+class CRenderQueue
+{
+public:
+	CRenderQueue(IDirect3DDevice9* pDev);
+	virtual ~CRenderQueue(){}
+
+	/** Adds one subset of a mesh.
+	\param pMesh the mesh
+	\param subset which subset to draw
+	\param pMaterial the material (must last until Flush())
+	\param pTexture the texture (may be NULL)
+	\param world the world matrix
+	\param layer lower layers are drawn first (0..255)
+	*/
+	void Add(ID3DXMesh* pMesh,int subset,const D3DMATERIAL9* pMaterial,IDirect3DTexture9* pTexture,
+			const D3DXMATRIX& world,int layer=0);
+	/// adds all the subsets of a mesh
+	void Add(CXMesh* pMesh,const D3DXMATRIX& world,int layer=0);
+
+	/// sorts & draws everything added since the last Flush(), then empties the queue
+	void Flush();
+	/// the number of draws waiting
+	int GetCount(){return (int)mItems.size();}
+	/// what the last Flush() did
+	const SRenderStats& GetStats(){return mStats;}
+protected:
+	/// \defgroup RenderQueueDevice What Flush() does to the device (overridden to run without one, eg. in the Bench)
+	/// @{
+	virtual void SetTexture(IDirect3DTexture9* pTexture){mpDev->SetTexture(0,pTexture);}
+	virtual void SetMaterial(const D3DMATERIAL9* pMaterial){mpDev->SetMaterial(pMaterial);}
+	virtual void SetWorld(const D3DXMATRIX& world){mpDev->SetTransform(D3DTS_WORLD,&world);}
+	virtual void DrawSubset(ID3DXMesh* pMesh,int subset){pMesh->DrawSubset(subset);}
+	/// @}
+private:
+	/// \internal the number for a mesh, material or texture in the sort key (the same each frame)
+	static int FindOrAddId(std::vector<const void*>& ids,const void* p);
+
+	/// \internal one draw
+	struct SItem
+	{
+		ID3DXMesh* pMesh;
+		int Subset;
+		const D3DMATERIAL9* pMaterial;
+		IDirect3DTexture9* pTexture;
+		D3DXMATRIX World;
+	};
+	/// \internal the sort key of an item (the index keeps the items with the same key in order)
+	struct SKey
+	{
+		UINT64 Key;
+		int Index;
+		bool operator<(const SKey& other) const{return Key<other.Key || (Key==other.Key && Index<other.Index);}
+	};
+
+	IDirect3DDevice9* mpDev;
+	std::vector<SItem> mItems;
+	std::vector<SKey> mKeys;	// the sort key for each item
+	std::vector<const void*> mMeshIds,mMaterialIds,mTextureIds;
+	SRenderStats mStats;
+};
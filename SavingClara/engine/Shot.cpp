@@ -0,0 +1,203 @@
+/*==============================================
+ * Shot class
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#include "Shot.h"
+#include "Collision.h"
+#include "ParticleSystem.h"
+#include "RenderQueue.h"
+
+// a handle is the slot in the low 16 bits & its generation in the high 16
+static ShotHandle MakeHandle(int slot,unsigned short generation){return ((ShotHandle)generation<<16)|slot;}
+static int HandleSlot(ShotHandle shot){return shot&0xFFFF;}
+static unsigned short HandleGeneration(ShotHandle shot){return (unsigned short)(shot>>16);}
+
+CShotStore::CShotStore(int capacity)
+{
+	if (capacity>0x10000)	capacity=0x10000;
+	// set aside everything now, so there are no allocations while playing
+	mPos.reserve(capacity);
+	mVel.reserve(capacity);
+	mLife.reserve(capacity);
+	mScale.reserve(capacity);
+	mOrient.reserve(capacity);
+	mpMesh.reserve(capacity);
+	mpTrail.reserve(capacity);
+	mSlot.reserve(capacity);
+
+	mIndex.resize(capacity,-1);
+	mGeneration.resize(capacity,1);	// (so no handle is NULL_SHOT)
+	mFreeSlots.resize(capacity);
+	for(int i=0;i<capacity;i++)
+		mFreeSlots[i]=capacity-1-i;	// slot 0 on the top
+	mHighWater=0;
+	mOverflows=0;
+}
+
+ShotHandle CShotStore::Add(CXMesh* pMesh,const D3DXVECTOR3& pos,const D3DXVECTOR3& hpr,
+					const D3DXVECTOR3& vel,float scale,float lifeTime)
+{
+	if (mFreeSlots.empty())
+	{
+		mOverflows++;
+		return NULL_SHOT;
+	}
+	int slot=mFreeSlots.back();
+	mFreeSlots.pop_back();
+	mIndex[slot]=GetCount();
+
+	D3DXMATRIX rot,scl;
+	D3DXMatrixRotationYawPitchRoll(&rot,hpr.x,hpr.y,hpr.z);
+	D3DXMatrixScaling(&scl,scale,scale,scale);
+
+	mPos.push_back(pos);
+	mVel.push_back(vel);
+	mLife.push_back(lifeTime);
+	mScale.push_back(scale);
+	mOrient.push_back(scl*rot);
+	mpMesh.push_back(pMesh);
+	mpTrail.push_back(NULL);
+	mSlot.push_back(slot);
+
+	if (GetCount()>mHighWater)	mHighWater=GetCount();
+	return MakeHandle(slot,mGeneration[slot]);
+}
+
+CParticleEmitter* CShotStore::AddEmitter(CParticleSystem* pSystem,const SEmitterSetting& settings,ShotHandle shot)
+{
+	int index=GetIndex(shot);
+	if (index<0)	return NULL;
+	// the shot never turns, so the direction & offset can be turned into world space now
+	SEmitterSetting set=settings;
+	D3DXVECTOR3 offset=set.Offset/mScale[index];
+	D3DXVec3TransformNormal(&set.Offset,&offset,&mOrient[index]);
+	if (set.LocalDirection)
+	{
+		D3DXVECTOR3 dir=set.Direction/mScale[index];
+		D3DXVec3TransformNormal(&set.Direction,&dir,&mOrient[index]);
+		set.LocalDirection=false;
+	}
+	// (its not bound to a node, so the offset is only used by Update())
+	CParticleEmitter* pEmitter=pSystem->AddEmitter(set);
+	pEmitter->SetPos(mPos[index]+set.Offset);
+	if (mpTrail[index])	mpTrail[index]->Kill();
+	mpTrail[index]=pEmitter;
+	return pEmitter;
+}
+
+void CShotStore::Update(float dt)
+{
+	const int count=GetCount();
+	// move them
+	for(int i=0;i<count;i++)
+		mPos[i]+=mVel[i]*dt;
+	// age them
+	for(int i=0;i<count;i++)
+		mLife[i]-=dt;
+	// & bring the trails along (or stop them, if the shot has run out)
+	for(int i=0;i<count;i++)
+	{
+		if (mpTrail[i]==NULL)	continue;
+		if (mLife[i]>0)
+			mpTrail[i]->SetPos(mPos[i]+mpTrail[i]->GetSettings().Offset);
+		else
+			Destroy(i);
+	}
+}
+
+void CShotStore::Destroy(int index)
+{
+	mLife[index]=0;
+	if (mpTrail[index])
+	{
+		mpTrail[index]->Kill();	// the particle system deletes it
+		mpTrail[index]=NULL;
+	}
+}
+
+void CShotStore::Draw(CRenderQueue* pQueue)
+{
+	const int count=GetCount();
+	for(int i=0;i<count;i++)
+	{
+		if (mLife[i]<=0)	continue;
+		D3DXMATRIX world=mOrient[i];
+		world._41=mPos[i].x;	world._42=mPos[i].y;	world._43=mPos[i].z;
+		if (pQueue)
+			pQueue->Add(mpMesh[i],world);
+		else
+			mpMesh[i]->Draw(world);
+	}
+}
+
+void CShotStore::Remove(int index)
+{
+	Destroy(index);	// (in case its life was run down some other way)
+	int slot=mSlot[index];
+	mIndex[slot]=-1;
+	if (++mGeneration[slot]==0)	mGeneration[slot]=1;	// any handles to it are now stale
+	mFreeSlots.push_back(slot);
+
+	// move the last shot into the gap
+	int last=GetCount()-1;
+	if (index!=last)
+	{
+		mPos[index]=mPos[last];
+		mVel[index]=mVel[last];
+		mLife[index]=mLife[last];
+		mScale[index]=mScale[last];
+		mOrient[index]=mOrient[last];
+		mpMesh[index]=mpMesh[last];
+		mpTrail[index]=mpTrail[last];
+		mSlot[index]=mSlot[last];
+		mIndex[mSlot[index]]=index;
+	}
+	mPos.pop_back();
+	mVel.pop_back();
+	mLife.pop_back();
+	mScale.pop_back();
+	mOrient.pop_back();
+	mpMesh.pop_back();
+	mpTrail.pop_back();
+	mSlot.pop_back();
+}
+
+void CShotStore::RemoveDead()
+{
+	// one pass: each dead shot is replaced by the last one, which is then checked in its turn
+	for(int i=0;i<GetCount();)
+	{
+		if (mLife[i]<=0)
+			Remove(i);
+		else
+			i++;
+	}
+}
+
+void CShotStore::Clear()
+{
+	while(GetCount()>0)
+		Remove(GetCount()-1);
+}
+
+bool CShotStore::Collides(int index,CMeshNode* pTarget,float factor)
+{
+	return CollisionSphereSphere(mPos[index],GetBoundingRadius(index)*factor,
+								pTarget->mPos,pTarget->GetBoundingRadius()*factor);
+}
+
+ShotHandle CShotStore::GetHandle(int index)
+{
+	int slot=mSlot[index];
+	return MakeHandle(slot,mGeneration[slot]);
+}
+
+int CShotStore::GetIndex(ShotHandle shot)
+{
+	int slot=HandleSlot(shot);
+	if (slot>=GetCapacity() || mGeneration[slot]!=HandleGeneration(shot))
+		return -1;
+	return mIndex[slot];
+}
@@ -5,8 +5,14 @@
  *
  *==============================================*/
 #pragma once
+#include <vector>
 #include "Node.h"
 
+class CParticleSystem;
+class CRenderQueue;
+class CParticleEmitter;
+struct SEmitterSetting;
+
 /// extra class for shot
 /// the life is the number of miliseconds the shot will live for
 /// its a simple way to ensure they they don't exist forever
@@ -19,4 +25,123 @@ public:
 		mPos+=mVel*dt;	// move it
 		mLife-=(int)(1000*dt);	// decrease life
 	}
-};
\ No newline at end of file
+};
+
+/** Refers to one shot in a CShotStore.
+Unlike its index, a handle stays with the shot, & goes stale once the shot is removed
+(so it will never refer to a different shot which reused the space), see CShotStore::IsValid().
+*/
+typedef unsigned ShotHandle;
+/// a handle which never refers to a shot
+const ShotHandle NULL_SHOT=0;
+/// how many shots a CShotStore holds, unless told otherwise
+const int DEFAULT_SHOT_CAPACITY=256;
+
+/** A pool of shots of one kind (eg. all the fireballs), kept as packed arrays.
+Rather than a std::vector<CMeshNode*> of CShot's (each one new'ed, somewhere in memory,
+& moved by a virtual Update()), each part of the shots is kept in its own array:
+the positions together, the velocities together & so on.
+Moving them is then one straight loop over the arrays, & removing the dead ones is a single sweep.
+
+All the space is set aside when the store is made, so adding & removing shots never touches the heap,
+& both are O(1). If its full Add() fails, see GetHighWater() to check the capacity is big enough.
+
+Shots don't turn, so their orientation (& scale) is worked out once when they are added.
+In the loops the shots are referred to by their index, which is only good until the next RemoveDead().
+To keep hold of a shot for longer use its ShotHandle.
+
+\code
+ShotHandle shot=mShots.Add(pMesh,pos,hpr,dir*SHOT_VEL,0.3f,3.0f);
+mShots.AddEmitter(mpFire,trail,shot);
+...
+mShots.Update(dt);
+for(int i=0;i<mShots.GetCount();i++)
+	if (mShots.Collides(i,pEnemy))
+		mShots.Destroy(i);
+mShots.RemoveDead();
+...
+mShots.Draw();
+\endcode
+*/
+class CShotStore
+{
+public:
+	/// \param capacity the most shots there can be at once (up to 65536)
+	CShotStore(int capacity=DEFAULT_SHOT_CAPACITY);
+	/** Adds a shot.
+	\param pMesh the mesh to draw it with (will not be delete'd)
+	\param pos,hpr where it starts & its orientation
+	\param vel its velocity
+	\param scale uniform scale of the mesh
+	\param lifeTime how long it lives for (in seconds)
+	\return the handle of the new shot, or NULL_SHOT if the store is full
+	*/
+	ShotHandle Add(CXMesh* pMesh,const D3DXVECTOR3& pos,const D3DXVECTOR3& hpr,
+			const D3DXVECTOR3& vel,float scale,float lifeTime);
+	/** Adds a particle emitter which follows the shot (like CParticleSystem::AddEmitter with a node).
+	The emitter is killed when the shot dies (& the system reuses it, see CParticleSystem::ReserveEmitters()).
+	Offset & Direction (if LocalDirection) are turned with the shot.
+	\return the emitter, or NULL if the shot is no longer there
+	*/
+	CParticleEmitter* AddEmitter(CParticleSystem* pSystem,const SEmitterSetting& settings,ShotHandle shot);
+
+	/// moves & ages all the shots, the trails are moved with them
+	void Update(float dt);
+	/// draws all the living shots (or adds them to the render queue, if there is one)
+	void Draw(CRenderQueue* pQueue=NULL);
+	/// removes the dead shots (& kills their trails), the indexes change after this
+	void RemoveDead();
+	/// removes all the shots & kills their trails (call before the particle systems are deleted)
+	void Clear();
+
+	int GetCount(){return (int)mPos.size();}
+	const D3DXVECTOR3& GetPos(int index){return mPos[index];}
+	const D3DXVECTOR3& GetVel(int index){return mVel[index];}
+	bool IsAlive(int index){return mLife[index]>0;}
+	/// kills the shot (& its trail), it will be removed by RemoveDead()
+	void Destroy(int index);
+	/// as CMeshNode::GetBoundingRadius()
+	float GetBoundingRadius(int index){return mpMesh[index]->GetRadius()*mScale[index];}
+	/// returns true if the shot hits the target, see CollisionMeshNode() for the factor
+	bool Collides(int index,CMeshNode* pTarget,float factor=0.75f);
+
+	/// \defgroup ShotHandles Shot handles
+	/// @{
+	/// the handle of the shot at this index
+	ShotHandle GetHandle(int index);
+	/// returns true if the shot is still in the store (it may be dead, but not yet removed)
+	bool IsValid(ShotHandle shot){return GetIndex(shot)>=0;}
+	/// the current index of the shot, or -1 if it has been removed
+	int GetIndex(ShotHandle shot);
+	/// @}
+
+	/// \defgroup ShotStats Pool statistics
+	/// @{
+	int GetCapacity(){return (int)mGeneration.size();}
+	/// the most shots there have been at once
+	int GetHighWater(){return mHighWater;}
+	/// number of times Add() failed because the store was full
+	int GetOverflows(){return mOverflows;}
+	/// @}
+private:
+	/// \internal frees the slot of the shot at this index & fills the gap with the last shot
+	void Remove(int index);
+
+	// one entry per shot in each (packed, so the first GetCount() are the shots)
+	std::vector<D3DXVECTOR3> mPos;
+	std::vector<D3DXVECTOR3> mVel;
+	std::vector<float> mLife;	// seconds left, <=0 is dead
+	std::vector<float> mScale;
+	std::vector<D3DXMATRIX> mOrient;	// scale * rotation (the translation is filled in when drawing)
+	std::vector<CXMesh*> mpMesh;
+	std::vector<CParticleEmitter*> mpTrail;	// the trail (may be NULL)
+	std::vector<int> mSlot;	// the slot which refers to this shot
+
+	// one entry per slot, a handle is a slot & its generation
+	std::vector<int> mIndex;	// the index of the shot in the slot
+	std::vector<unsigned short> mGeneration;	// goes up each time the slot is freed
+	std::vector<int> mFreeSlots;	// slots which are not in use
+
+	int mHighWater;
+	int mOverflows;
+};
@@ -557,6 +557,43 @@ float CTerrain::GetHeight( float inX, float inZ )
 	return theHeight;
 }
 
+void CTerrain::GetHeights( const float* inX, const float* inZ, float* outHeights, int inCount )
+{
+	// the same as GetHeight(), but with the sums worked out once
+	// & the cell clamped to the terrain
+	const float theHalfWidth = static_cast<float>( mWidth ) / 2.0f;
+	const float theHalfDepth = static_cast<float>( mDepth ) / 2.0f;
+	const float theInvSpacing = 1.0f / static_cast<float>( mCellSpacing );
+	const float theMaxCol = static_cast<float>( mNumCellsPerRow ) - 0.001f;
+	const float theMaxRow = static_cast<float>( mNumCellsPerCol ) - 0.001f;
+	const float* theMap = &mHeightMap[0];
+
+	for( int i = 0; i < inCount; i++ )
+	{
+		float x = ( theHalfWidth + inX[i] ) * theInvSpacing;
+		float z = ( theHalfDepth - inZ[i] ) * theInvSpacing;
+		if( x < 0 )	x = 0;
+		if( x > theMaxCol )	x = theMaxCol;
+		if( z < 0 )	z = 0;
+		if( z > theMaxRow )	z = theMaxRow;
+
+		int col = (int)x;	// (its positive, so this is floor)
+		int row = (int)z;
+		const float* theRow = theMap + row*mNumVerticesPerRow + col;
+		float A = theRow[0];
+		float B = theRow[1];
+		float C = theRow[mNumVerticesPerRow];
+		float D = theRow[mNumVerticesPerRow+1];
+
+		float dx = x - col;
+		float dz = z - row;
+		if( dz < 1.0f - dx )  // upper triangle ABC
+			outHeights[i] = A + (B - A) * dx + (C - A) * dz;
+		else // lower triangle DCB
+			outHeights[i] = D + (C - D) * (1.0f - dx) + (B - D) * (1.0f - dz);
+	}
+}
+
 bool CTerrain::Draw(const D3DXMATRIX& inWorldMatrix, bool inDrawTriangles )
 {
 	HRESULT hr = 0;
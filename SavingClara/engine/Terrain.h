@@ -58,6 +58,13 @@ public:
 	int GetTerrainDepth(){return mDepth;}	///< returns the scaled size of the terrain
 	/// returns the height of the terrain, given the x&z coordinates.
 	float GetHeight( float x, float z);
+	/** Gets the height of the terrain for a lot of points at once.
+	Unlike GetHeight(), points off the edge of the terrain are safe (they get the height at the edge).
+	\param x,z the coordinates of the points
+	\param [out] heights the height of each point
+	\param count the number of points
+	*/
+	void GetHeights( const float* x, const float* z, float* heights, int count);
 	/// Returns a point on the ground (with a specified offset)
 	D3DXVECTOR3 GetPointOnGround(D3DXVECTOR3 pos, float offset=0);
 	/// returns if a given point is above the ground
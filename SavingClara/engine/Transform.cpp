@@ -0,0 +1,143 @@
+/*==============================================
+ * Batched world matrices
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#include <math.h>
+#include <xmmintrin.h>	// SSE
+#include <emmintrin.h>	// SSE2 (for the rounding)
+#include "Transform.h"
+
+/** works out the sin & cos of 4 angles at once.
+The angle is brought into -PI..PI, then folded into -PI/2..PI/2 (where the series works well)
+& the sin worked out with its series up to x^11. The cos is the sin of the angle+PI/2.
+*/
+static void SinCos4(__m128 angle,__m128& s,__m128& c)
+{
+	const __m128 TWO_PI=_mm_set1_ps(2*D3DX_PI),INV_TWO_PI=_mm_set1_ps(1/(2*D3DX_PI));
+	const __m128 PI=_mm_set1_ps(D3DX_PI),HALF_PI=_mm_set1_ps(D3DX_PI/2);
+	const __m128 SIGN=_mm_set1_ps(-0.0f);
+
+	// bring x into -PI..PI (the nearest whole turn is taken off)
+	__m128 turns=_mm_cvtepi32_ps(_mm_cvtps_epi32(_mm_mul_ps(angle,INV_TWO_PI)));
+	__m128 x[2];
+	x[0]=_mm_sub_ps(angle,_mm_mul_ps(turns,TWO_PI));
+	// cos(x)=sin(x+PI/2), which might need bringing back into -PI..PI
+	x[1]=_mm_add_ps(x[0],HALF_PI);
+	x[1]=_mm_sub_ps(x[1],_mm_and_ps(_mm_cmpgt_ps(x[1],PI),TWO_PI));
+
+	__m128 result[2];
+	for(int i=0;i<2;i++)
+	{
+		// fold: sin(x)=sin(PI-x) for x>PI/2 & sin(-PI-x) for x<-PI/2
+		__m128 sign=_mm_and_ps(x[i],SIGN);
+		__m128 mirror=_mm_sub_ps(_mm_or_ps(PI,sign),x[i]);	// +/-PI-x
+		__m128 fold=_mm_cmpgt_ps(_mm_andnot_ps(SIGN,x[i]),HALF_PI);	// |x|>PI/2
+		__m128 v=_mm_or_ps(_mm_and_ps(fold,mirror),_mm_andnot_ps(fold,x[i]));
+		// x - x^3/3! + x^5/5! - ... - x^11/11!
+		__m128 v2=_mm_mul_ps(v,v);
+		__m128 p=_mm_set1_ps(-1.0f/39916800);
+		p=_mm_add_ps(_mm_mul_ps(p,v2),_mm_set1_ps(1.0f/362880));
+		p=_mm_add_ps(_mm_mul_ps(p,v2),_mm_set1_ps(-1.0f/5040));
+		p=_mm_add_ps(_mm_mul_ps(p,v2),_mm_set1_ps(1.0f/120));
+		p=_mm_add_ps(_mm_mul_ps(p,v2),_mm_set1_ps(-1.0f/6));
+		p=_mm_add_ps(_mm_mul_ps(p,v2),_mm_set1_ps(1.0f));
+		result[i]=_mm_mul_ps(p,v);
+	}
+	s=result[0];
+	c=result[1];
+}
+
+/// \internal writes one row of 4 matrices, from the 3 columns of the row (the 4th column is w)
+static void StoreRows(__m128 a,__m128 b,__m128 c,__m128 w,D3DXMATRIX* out,int row)
+{
+	_MM_TRANSPOSE4_PS(a,b,c,w);
+	// (the matrices may not be aligned)
+	_mm_storeu_ps(out[0].m[row],a);
+	_mm_storeu_ps(out[1].m[row],b);
+	_mm_storeu_ps(out[2].m[row],c);
+	_mm_storeu_ps(out[3].m[row],w);
+}
+
+void BuildWorldMatrices(const STransformArrays& in,int count,D3DXMATRIX* out)
+{
+	int i=0;
+	// 4 at a time: the 12 parts of the scaled rotation are worked out for 4 objects together,
+	// then turned around into the rows of the 4 matrices
+	for(;i+4<=count;i+=4,out+=4)
+	{
+		__m128 sy,cy,sp,cp,sr,cr;
+		SinCos4(_mm_loadu_ps(in.Yaw+i),sy,cy);
+		SinCos4(_mm_loadu_ps(in.Pitch+i),sp,cp);
+		SinCos4(_mm_loadu_ps(in.Roll+i),sr,cr);
+		__m128 scale=_mm_loadu_ps(in.Scale+i);
+		__m128 zero=_mm_setzero_ps();
+
+		// the rows of roll * pitch * yaw
+		__m128 srsp=_mm_mul_ps(sr,sp),crsp=_mm_mul_ps(cr,sp);
+		__m128 m11=_mm_add_ps(_mm_mul_ps(cr,cy),_mm_mul_ps(srsp,sy));
+		__m128 m12=_mm_mul_ps(sr,cp);
+		__m128 m13=_mm_sub_ps(_mm_mul_ps(srsp,cy),_mm_mul_ps(cr,sy));
+		__m128 m21=_mm_sub_ps(_mm_mul_ps(crsp,sy),_mm_mul_ps(sr,cy));
+		__m128 m22=_mm_mul_ps(cr,cp);
+		__m128 m23=_mm_add_ps(_mm_mul_ps(sr,sy),_mm_mul_ps(crsp,cy));
+		__m128 m31=_mm_mul_ps(cp,sy);
+		__m128 m32=_mm_sub_ps(zero,sp);
+		__m128 m33=_mm_mul_ps(cp,cy);
+
+		StoreRows(_mm_mul_ps(m11,scale),_mm_mul_ps(m12,scale),_mm_mul_ps(m13,scale),zero,out,0);
+		StoreRows(_mm_mul_ps(m21,scale),_mm_mul_ps(m22,scale),_mm_mul_ps(m23,scale),zero,out,1);
+		StoreRows(_mm_mul_ps(m31,scale),_mm_mul_ps(m32,scale),_mm_mul_ps(m33,scale),zero,out,2);
+		StoreRows(_mm_loadu_ps(in.PosX+i),_mm_loadu_ps(in.PosY+i),_mm_loadu_ps(in.PosZ+i),_mm_set1_ps(1),out,3);
+	}
+	// the rest one at a time
+	for(;i<count;i++,out++)
+	{
+		float sy=sinf(in.Yaw[i]),cy=cosf(in.Yaw[i]);
+		float sp=sinf(in.Pitch[i]),cp=cosf(in.Pitch[i]);
+		float sr=sinf(in.Roll[i]),cr=cosf(in.Roll[i]);
+		float s=in.Scale[i];
+		*out=D3DXMATRIX((cr*cy+sr*sp*sy)*s,	sr*cp*s,	(sr*sp*cy-cr*sy)*s,	0,
+						(cr*sp*sy-sr*cy)*s,	cr*cp*s,	(sr*sy+cr*sp*cy)*s,	0,
+						cp*sy*s,			-sp*s,		cp*cy*s,			0,
+						in.PosX[i],			in.PosY[i],	in.PosZ[i],			1);
+	}
+}
+
+void PackInstances(const D3DXMATRIX* worlds,int count,SMeshInstance* out)
+{
+	// each matrix is turned around, & the columns kept
+	for(int i=0;i<count;i++)
+	{
+		__m128 r0=_mm_loadu_ps(worlds[i].m[0]),r1=_mm_loadu_ps(worlds[i].m[1]);
+		__m128 r2=_mm_loadu_ps(worlds[i].m[2]),r3=_mm_loadu_ps(worlds[i].m[3]);
+		_MM_TRANSPOSE4_PS(r0,r1,r2,r3);
+		_mm_storeu_ps(&out[i].X.x,r0);
+		_mm_storeu_ps(&out[i].Y.x,r1);
+		_mm_storeu_ps(&out[i].Z.x,r2);
+	}
+}
+
+void CTransformBatch::Clear()
+{
+	mPosX.clear();	mPosY.clear();	mPosZ.clear();
+	mYaw.clear();	mPitch.clear();	mRoll.clear();
+	mScale.clear();
+}
+
+int CTransformBatch::Add(const D3DXVECTOR3& pos,const D3DXVECTOR3& hpr,float scale)
+{
+	mPosX.push_back(pos.x);	mPosY.push_back(pos.y);	mPosZ.push_back(pos.z);
+	mYaw.push_back(hpr.x);	mPitch.push_back(hpr.y);	mRoll.push_back(hpr.z);
+	mScale.push_back(scale);
+	return GetCount()-1;
+}
+
+void CTransformBatch::Build()
+{
+	mWorld.resize(mPosX.size());
+	if (mWorld.empty())	return;
+	STransformArrays in={&mPosX[0],&mPosY[0],&mPosZ[0],&mYaw[0],&mPitch[0],&mRoll[0],&mScale[0]};
+	BuildWorldMatrices(in,GetCount(),&mWorld[0]);
+}
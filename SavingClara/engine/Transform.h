@@ -0,0 +1,81 @@
+/*==============================================
+ * Batched world matrices
+ *
+ * Written by Marcus Khoo
+ *
+ *==============================================*/
+#pragma once
+
+/** \file Transform.h Building lots of world matrices at once.
+Rather than making a translation, a scaling & a yaw-pitch-roll matrix for each object
+& multiplying them together (which is what D3DX does), the world matrix is worked out directly:
+four objects at a time with SSE, using a fast sin/cos.
+*/
+
+#include <vector>
+#include <d3dx9.h>
+
+/// the positions, orientations & scales to build world matrices from (one array for each)
+struct STransformArrays
+{
+	const float *PosX,*PosY,*PosZ;	// position
+	const float *Yaw,*Pitch,*Roll;	// orientation in radians, as a CNode's hpr
+	const float *Scale;	// uniform scale
+};
+
+/** Works out scale * rotation * translation for count objects.
+The results are the same as D3DXMatrixScaling * D3DXMatrixRotationYawPitchRoll * D3DXMatrixTranslation
+(to about 1e-6).
+\param in the objects
+\param count how many
+\param [out] out count world matrices
+*/
+void BuildWorldMatrices(const STransformArrays& in,int count,D3DXMATRIX* out);
+
+/** One instance for hardware instancing (see CXMesh::DrawInstanced).
+The world matrix is stored as its first 3 columns (the 4th is always 0,0,0,1),
+so the shader works out the world position as x=dot(pos,X), y=dot(pos,Y), z=dot(pos,Z).
+*/
+struct SMeshInstance
+{
+	D3DXVECTOR4 X,Y,Z;
+};
+
+/** Packs world matrices into instances, ready to copy into an instance vertex buffer.
+\param worlds the world matrices
+\param count how many
+\param [out] out count instances
+*/
+void PackInstances(const D3DXMATRIX* worlds,int count,SMeshInstance* out);
+
+/** A batch of objects to build world matrices for.
+\code
+batch.Clear();
+for(...)
+	batch.Add(pos,hpr,scale);
+batch.Build();
+for(int i=0;i<batch.GetCount();i++)
+	pMesh->Draw(batch.GetMatrix(i));
+\endcode
+The space is kept between batches, so once its big enough there are no more allocations.
+*/
+class CTransformBatch
+{
+public:
+	/// empties the batch (but keeps the space)
+	void Clear();
+	/// adds an object, returns its index
+	int Add(const D3DXVECTOR3& pos,const D3DXVECTOR3& hpr,float scale);
+	/// works out the world matrices for all the objects
+	void Build();
+	int GetCount(){return (int)mPosX.size();}
+	/// the world matrix of the object (after Build())
+	const D3DXMATRIX& GetMatrix(int index){return mWorld[index];}
+	/// all the world matrices (NULL if there are none)
+	const D3DXMATRIX* GetMatrices(){return mWorld.empty()?NULL:&mWorld[0];}
+private:
+	std::vector<float> mPosX,mPosY,mPosZ;
+	std::vector<float> mYaw,mPitch,mRoll;
+	std::vector<float> mScale;
+	std::vector<D3DXMATRIX> mWorld;
+};
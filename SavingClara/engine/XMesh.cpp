@@ -5,13 +5,67 @@
  *==============================================*/
 #pragma once
 #include <string>
+#include <math.h>
 #include "XMesh.h"
+#include "Transform.h"
 #include "Fail.h"
 
+/// the most instances drawn in one go (more are drawn in several goes)
+const int MAX_INSTANCES=1024;
+
+/** \internal the shaders for CXMesh::DrawInstanced.
+They copy what the fixed pipeline does for the game's meshes:
+one directional light, the ambient, material colours & range based linear fog.
+*/
+static const char INSTANCE_SHADER[]=
+	"row_major float4x4 View : register(c0);\n"
+	"row_major float4x4 Proj : register(c4);\n"
+	"float4 LightDir : register(c8);\n"	// the way the light shines
+	"float4 LightDiffuse : register(c9);\n"
+	"float4 Ambient : register(c10);\n"	// the ambient render state + the light's ambient
+	"float4 MatDiffuse : register(c11);\n"
+	"float4 MatAmbient : register(c12);\n"
+	"float4 MatEmissive : register(c13);\n"
+	"float4 Fog : register(c14);\n"	// start, 1/(end-start), enabled
+	"struct VS_IN{float4 Pos:POSITION; float3 Normal:NORMAL; float2 Tex:TEXCOORD0;\n"
+	"	float4 X:TEXCOORD5; float4 Y:TEXCOORD6; float4 Z:TEXCOORD7;};\n"
+	"struct VS_OUT{float4 Pos:POSITION; float4 Colour:COLOR0; float2 Tex:TEXCOORD0; float Fog:TEXCOORD1;};\n"
+	"VS_OUT VSMain(VS_IN i)\n"
+	"{\n"
+	"	VS_OUT o;\n"
+	"	float4 world=float4(dot(i.Pos,i.X),dot(i.Pos,i.Y),dot(i.Pos,i.Z),1);\n"
+	"	float3 normal=normalize(float3(dot(i.Normal,i.X.xyz),dot(i.Normal,i.Y.xyz),dot(i.Normal,i.Z.xyz)));\n"
+	"	float4 view=mul(world,View);\n"
+	"	o.Pos=mul(view,Proj);\n"
+	"	float light=max(0,dot(normal,-LightDir.xyz));\n"
+	"	o.Colour=saturate(MatEmissive+MatAmbient*Ambient+MatDiffuse*LightDiffuse*light);\n"
+	"	o.Colour.a=MatDiffuse.a;\n"
+	"	o.Tex=i.Tex;\n"
+	"	o.Fog=lerp(1,saturate(1-(length(view.xyz)-Fog.x)*Fog.y),Fog.z);\n"
+	"	return o;\n"
+	"}\n"
+	"sampler Texture : register(s0);\n"
+	"float4 FogColour : register(c0);\n"
+	"float4 UseTexture : register(c1);\n"	// 1 if there is a texture
+	"float4 PSMain(VS_OUT i) : COLOR\n"
+	"{\n"
+	"	float4 col=i.Colour*lerp(1,tex2D(Texture,i.Tex),UseTexture.x);\n"
+	"	col.rgb=lerp(FogColour.rgb,col.rgb,i.Fog);\n"
+	"	return col;\n"
+	"}\n";
+
 CXMesh::CXMesh(LPDIRECT3DDEVICE9 pDev,const char * name)
 {
 	mpDev=pDev;
 	mpMesh=0;
+	mInstancing=INSTANCING_UNKNOWN;
+	mpInstanceDecl=NULL;
+	mpInstanceVS=NULL;
+	mpInstancePS=NULL;
+	mpInstanceVB=NULL;
+	mInstanceCapacity=0;
+	mInstanceOffset=0;
+	mHasTexCoords=false;
 
 	LoadMesh(name);
 	TidyMesh();	///< optimisation & repairs
@@ -21,6 +75,10 @@ CXMesh::CXMesh(LPDIRECT3DDEVICE9 pDev,const char * name)
 CXMesh::~CXMesh()
 {
 	mpMesh->Release();
+	if (mpInstanceDecl)	mpInstanceDecl->Release();
+	if (mpInstanceVS)	mpInstanceVS->Release();
+	if (mpInstancePS)	mpInstancePS->Release();
+	if (mpInstanceVB)	mpInstanceVB->Release();
 	mMats.clear();
 	mTextures.clear();
 }
@@ -114,6 +172,17 @@ void CXMesh::TidyMesh()	///< optimisation & repairs
 		// Reassign our pointer to the new generated mesh with normals.
 		mpMesh = theTempMesh;
 	}
+
+	// sort the faces by subset, so each subset can be drawn in one go (see DrawInstanced)
+	// (done here, as its slow & must not happen while drawing)
+	DWORD numAttribs=0;
+	mpMesh->GetAttributeTable(NULL,&numAttribs);
+	if (numAttribs==0)
+	{
+		std::vector<DWORD> adjacency(mpMesh->GetNumFaces()*3);
+		mpMesh->GenerateAdjacency(0.0f,&adjacency[0]);
+		mpMesh->OptimizeInplace(D3DXMESHOPT_ATTRSORT,&adjacency[0],NULL,NULL,NULL);
+	}
 }
 
 void CXMesh::ComputeCollisionInfo()	///< computes the bounding sphere
@@ -156,11 +225,208 @@ void CXMesh::Draw(const D3DXMATRIX& mat)	// renders at matrix
 }
 void CXMesh::Draw(const D3DXVECTOR3& pos,float scale, float yaw)	// at some position
 {
-	// hint: create the matrix, then call Draw(D3DXMATRIX& mat);
-	D3DXMATRIX world, trans, scaling, rot;
-	D3DXMatrixTranslation(&trans, pos.x, pos.y,pos.z);
-	D3DXMatrixScaling(&scaling,scale,scale,scale);
-	D3DXMatrixRotationYawPitchRoll(&rot, yaw,0,0);
-	world = scaling * rot * trans;
+	// scaling * yaw * translation, worked out directly (rather than multiplying 3 matrices)
+	float s=sinf(yaw)*scale, c=cosf(yaw)*scale;
+	D3DXMATRIX world(	c,		0,		-s,		0,
+						0,		scale,	0,		0,
+						s,		0,		c,		0,
+						pos.x,	pos.y,	pos.z,	1);
 	Draw(world);
 }
+
+bool CXMesh::InitInstancing()
+{
+	if (mpMesh==NULL)	return false;
+	D3DCAPS9 caps;
+	mpDev->GetDeviceCaps(&caps);
+	if (caps.VertexShaderVersion<D3DVS_VERSION(3,0) || caps.PixelShaderVersion<D3DPS_VERSION(3,0))
+		return false;	// (instancing needs shader model 3)
+
+	// each subset is drawn with DrawIndexedPrimitive, so the faces must be sorted by subset (see TidyMesh)
+	DWORD numAttribs=0;
+	mpMesh->GetAttributeTable(NULL,&numAttribs);
+	if (numAttribs==0)	return false;
+	mAttribs.resize(numAttribs);
+	mpMesh->GetAttributeTable(&mAttribs[0],&numAttribs);
+
+	// the mesh's own vertex, with the instance on stream 1 after it
+	D3DVERTEXELEMENT9 decl[MAX_FVF_DECL_SIZE+3];
+	if (FAILED(mpMesh->GetDeclaration(decl)))	return false;
+	int end=0;
+	while(decl[end].Stream!=0xFF)
+	{
+		if (decl[end].Usage==D3DDECLUSAGE_TEXCOORD && decl[end].UsageIndex==0)
+			mHasTexCoords=true;
+		end++;
+	}
+	for(int i=0;i<3;i++)
+	{
+		D3DVERTEXELEMENT9 elem={1,(WORD)(i*sizeof(D3DXVECTOR4)),D3DDECLTYPE_FLOAT4,D3DDECLMETHOD_DEFAULT,D3DDECLUSAGE_TEXCOORD,(BYTE)(5+i)};
+		decl[end+i]=elem;
+	}
+	D3DVERTEXELEMENT9 declEnd=D3DDECL_END();
+	decl[end+3]=declEnd;
+	if (FAILED(mpDev->CreateVertexDeclaration(decl,&mpInstanceDecl)))	return false;
+
+	// compile the shaders
+	LPD3DXBUFFER pCode=NULL,pErrors=NULL;
+	if (FAILED(D3DXCompileShader(INSTANCE_SHADER,sizeof(INSTANCE_SHADER)-1,NULL,NULL,"VSMain","vs_3_0",0,&pCode,&pErrors,NULL)))
+	{
+		if (pErrors)	pErrors->Release();
+		return false;
+	}
+	HRESULT hr=mpDev->CreateVertexShader((DWORD*)pCode->GetBufferPointer(),&mpInstanceVS);
+	pCode->Release();
+	if (FAILED(hr))	return false;
+	if (FAILED(D3DXCompileShader(INSTANCE_SHADER,sizeof(INSTANCE_SHADER)-1,NULL,NULL,"PSMain","ps_3_0",0,&pCode,&pErrors,NULL)))
+	{
+		if (pErrors)	pErrors->Release();
+		return false;
+	}
+	hr=mpDev->CreatePixelShader((DWORD*)pCode->GetBufferPointer(),&mpInstancePS);
+	pCode->Release();
+	if (FAILED(hr))	return false;
+
+	mInstanceCapacity=MAX_INSTANCES;
+	return CreateInstanceBuffer();
+}
+
+bool CXMesh::CreateInstanceBuffer()
+{
+	mInstanceOffset=0;
+	// its refilled every draw, so dynamic (which has to be in the default pool, like the particles' VB)
+	return SUCCEEDED(mpDev->CreateVertexBuffer(mInstanceCapacity*sizeof(SMeshInstance),
+										D3DUSAGE_DYNAMIC|D3DUSAGE_WRITEONLY,0,
+										D3DPOOL_DEFAULT,&mpInstanceVB,NULL));
+}
+
+void CXMesh::OnLostDevice()
+{
+	// we must release the VB so the device can reset
+	if (mpInstanceVB)	mpInstanceVB->Release();
+	mpInstanceVB=NULL;
+}
+
+void CXMesh::OnResetDevice()
+{
+	// (if it was never set up, DrawInstanced() will do it)
+	if (mInstancing==INSTANCING_ON && CreateInstanceBuffer()==false)
+		mInstancing=INSTANCING_OFF;
+}
+
+void CXMesh::SetInstanceConstants()
+{
+	D3DXMATRIX view,proj;
+	mpDev->GetTransform(D3DTS_VIEW,&view);
+	mpDev->GetTransform(D3DTS_PROJECTION,&proj);
+	mpDev->SetVertexShaderConstantF(0,view,4);
+	mpDev->SetVertexShaderConstantF(4,proj,4);
+
+	D3DLIGHT9 light;
+	BOOL lightOn=FALSE;
+	mpDev->GetLightEnable(0,&lightOn);
+	if (lightOn==FALSE || FAILED(mpDev->GetLight(0,&light)))
+		memset(&light,0,sizeof(light));
+	DWORD ambient;
+	mpDev->GetRenderState(D3DRS_AMBIENT,&ambient);
+	D3DXCOLOR amb=D3DXCOLOR(ambient)+D3DXCOLOR(light.Ambient);
+	D3DXVECTOR4 dir(light.Direction.x,light.Direction.y,light.Direction.z,0);
+	mpDev->SetVertexShaderConstantF(8,dir,1);
+	mpDev->SetVertexShaderConstantF(9,(const float*)&light.Diffuse,1);
+	mpDev->SetVertexShaderConstantF(10,amb,1);
+
+	DWORD fogOn,fogStart,fogEnd,fogColour;
+	mpDev->GetRenderState(D3DRS_FOGENABLE,&fogOn);
+	mpDev->GetRenderState(D3DRS_FOGSTART,&fogStart);
+	mpDev->GetRenderState(D3DRS_FOGEND,&fogEnd);
+	mpDev->GetRenderState(D3DRS_FOGCOLOR,&fogColour);
+	float start=*(float*)&fogStart,end=*(float*)&fogEnd;
+	D3DXVECTOR4 fog(start,(end>start)?1/(end-start):0,fogOn?1.0f:0.0f,0);
+	mpDev->SetVertexShaderConstantF(14,fog,1);
+	D3DXCOLOR fogCol(fogColour);
+	mpDev->SetPixelShaderConstantF(0,fogCol,1);
+}
+
+void CXMesh::DrawInstanced(const D3DXMATRIX* worlds,int count)
+{
+	if (count<=0)	return;
+	if (mInstancing==INSTANCING_UNKNOWN)
+		mInstancing=InitInstancing()?INSTANCING_ON:INSTANCING_OFF;
+	if (mInstancing==INSTANCING_OFF || mpInstanceVB==NULL)
+	{
+		DrawBatched(worlds,count);
+		return;
+	}
+
+	IDirect3DVertexBuffer9* pVB=NULL;
+	IDirect3DIndexBuffer9* pIB=NULL;
+	mpMesh->GetVertexBuffer(&pVB);
+	mpMesh->GetIndexBuffer(&pIB);
+	mpDev->SetVertexDeclaration(mpInstanceDecl);
+	mpDev->SetVertexShader(mpInstanceVS);
+	mpDev->SetPixelShader(mpInstancePS);
+	SetInstanceConstants();
+	mpDev->SetStreamSource(0,pVB,0,mpMesh->GetNumBytesPerVertex());
+	mpDev->SetStreamSourceFreq(1,D3DSTREAMSOURCE_INSTANCEDATA|1);
+	mpDev->SetIndices(pIB);
+
+	for(int first=0;first<count;first+=mInstanceCapacity)
+	{
+		int num=count-first;
+		if (num>mInstanceCapacity)	num=mInstanceCapacity;
+		// the instances go after the last lot (so the card can still be drawing them),
+		// if they won't fit, start again at the beginning (discarding the old contents)
+		if (mInstanceOffset+num>mInstanceCapacity)
+			mInstanceOffset=0;
+		SMeshInstance* pInst=NULL;
+		if (FAILED(mpInstanceVB->Lock(mInstanceOffset*sizeof(SMeshInstance),num*sizeof(SMeshInstance),(void**)&pInst,
+									mInstanceOffset ? D3DLOCK_NOOVERWRITE : D3DLOCK_DISCARD)))
+			break;
+		PackInstances(worlds+first,num,pInst);
+		mpInstanceVB->Unlock();
+		mpDev->SetStreamSource(1,mpInstanceVB,mInstanceOffset*sizeof(SMeshInstance),sizeof(SMeshInstance));
+		mInstanceOffset+=num;
+
+		// the mesh is drawn num times
+		mpDev->SetStreamSourceFreq(0,D3DSTREAMSOURCE_INDEXEDDATA|num);
+		for(unsigned a=0;a<mAttribs.size();a++)
+		{
+			const D3DXATTRIBUTERANGE& range=mAttribs[a];
+			if (range.FaceCount==0 || range.AttribId>=mMats.size())	continue;
+			const D3DMATERIAL9& mat=mMats[range.AttribId];
+			mpDev->SetVertexShaderConstantF(11,(const float*)&mat.Diffuse,1);
+			mpDev->SetVertexShaderConstantF(12,(const float*)&mat.Ambient,1);
+			mpDev->SetVertexShaderConstantF(13,(const float*)&mat.Emissive,1);
+			IDirect3DTexture9* pTex=mHasTexCoords?mTextures[range.AttribId]:NULL;
+			D3DXVECTOR4 useTex(pTex?1.0f:0.0f,0,0,0);
+			mpDev->SetPixelShaderConstantF(1,useTex,1);
+			mpDev->SetTexture(0,pTex);
+			mpDev->DrawIndexedPrimitive(D3DPT_TRIANGLELIST,0,range.VertexStart,range.VertexCount,
+										range.FaceStart*3,range.FaceCount);
+		}
+	}
+
+	// put it all back, so the fixed pipeline works again
+	mpDev->SetStreamSourceFreq(0,1);
+	mpDev->SetStreamSourceFreq(1,1);
+	mpDev->SetStreamSource(1,NULL,0,0);
+	mpDev->SetVertexShader(NULL);
+	mpDev->SetPixelShader(NULL);
+	pVB->Release();
+	pIB->Release();
+}
+
+void CXMesh::DrawBatched(const D3DXMATRIX* worlds,int count)
+{
+	// a subset at a time, so the material & texture are only set once for all of them
+	for(unsigned i=0;i<mMats.size();i++)
+	{
+		mpDev->SetMaterial(&mMats[i]);
+		mpDev->SetTexture(0,mTextures[i]);
+		for(int j=0;j<count;j++)
+		{
+			mpDev->SetTransform(D3DTS_WORLD,&worlds[j]);
+			mpMesh->DrawSubset(i);
+		}
+	}
+}
@@ -57,6 +57,17 @@ public:
 	\note does not reset the world matrix after drawing
 	*/
 	void Draw(const D3DXVECTOR3& pos,float scale=1.0f, float rotate = 0.0f);	// at some position
+	/** Draws lots of copies of the model, one for each world matrix.
+	If the card has shader model 3, this uses hardware instancing:
+	the world matrices go in a second vertex stream (see SetStreamSourceFreq) & each subset is drawn once for all of them.
+	Otherwise they are drawn one after another, setting each material & texture only once.
+	\param worlds the world matrices
+	\param count how many
+	\note the instanced shader only does what the game uses: light 0 (directional), the ambient & linear fog
+	*/
+	void DrawInstanced(const D3DXMATRIX* worlds,int count);
+	void OnLostDevice();	// called just before reset device
+	void OnResetDevice();	// called just after reset device
 	float GetRadius(){return mRadius;}	///< gets the model size
 	ID3DXMesh* GetMesh(){return mpMesh;}	///< accessor for the Mesh
 	int GetNumMaterial(){return mMats.size();}	///< accessor for the number of materials
@@ -68,12 +79,27 @@ public:
 	const D3DMATERIAL9& GetMaterial(int id){return mMats[id];}
 private:	// internal fns
 	bool LoadMesh(const char* name);	///< does the loading
-	void TidyMesh();	///< optimisation & repairs
+	void TidyMesh();	///< optimisation & repairs (& sorts the faces by subset)
 	void ComputeCollisionInfo();	///< computes the bounding sphere
+	bool InitInstancing();	///< sets up the shaders & buffers for DrawInstanced(), false if the card can't do it
+	bool CreateInstanceBuffer();	///< makes mpInstanceVB (its in the default pool, so its remade after a reset)
+	void DrawBatched(const D3DXMATRIX* worlds,int count);	///< DrawInstanced() without instancing
+	void SetInstanceConstants();	///< copies the matrices, light & fog into the shader constants
 private:
 	LPDIRECT3DDEVICE9 mpDev;	// the device
 	ID3DXMesh* mpMesh;	// the mesh
 	std::vector<D3DMATERIAL9> mMats;	// array of materials
 	std::vector<LPDIRECT3DTEXTURE9>  mTextures;	// array of texture pointers
 	float mRadius;	///< radius of bounding sphere
+
+	// instancing (only set up on the first DrawInstanced())
+	enum {INSTANCING_UNKNOWN,INSTANCING_ON,INSTANCING_OFF} mInstancing;
+	IDirect3DVertexDeclaration9* mpInstanceDecl;	// the mesh's vertex + the instance stream
+	IDirect3DVertexShader9* mpInstanceVS;
+	IDirect3DPixelShader9* mpInstancePS;
+	IDirect3DVertexBuffer9* mpInstanceVB;	// SMeshInstance's (dynamic, NULL while the device is lost)
+	int mInstanceCapacity;	// number of instances mpInstanceVB holds
+	int mInstanceOffset;	// where the next instances go in mpInstanceVB (after the ones the card may still be drawing)
+	std::vector<D3DXATTRIBUTERANGE> mAttribs;	// the subsets
+	bool mHasTexCoords;
 };